@@ -0,0 +1,633 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ * vim: set et ts=8 sw=8:
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include "avahi-mock.h"
+
+#define AVAHI_BUS "org.freedesktop.Avahi"
+#define AVAHI_SERVER_IFACE "org.freedesktop.Avahi.Server"
+#define AVAHI_SERVER2_IFACE "org.freedesktop.Avahi.Server2"
+#define AVAHI_SERVICE_BROWSER_IFACE "org.freedesktop.Avahi.ServiceBrowser"
+#define AVAHI_PROTO_INET 0
+#define AVAHI_PROTO_INET6 1
+#define AVAHI_PROTO_UNSPEC -1
+
+#define MOCK_INTERFACE 1
+#define MOCK_SERVICE_NAME "Mock Printer %d"
+
+static const char mock_introspection_xml[] =
+        "<node>"
+        "  <interface name='" AVAHI_SERVER_IFACE "'>"
+        "    <method name='ServiceBrowserNew'>"
+        "      <arg name='interface' type='i' direction='in'/>"
+        "      <arg name='protocol' type='i' direction='in'/>"
+        "      <arg name='type' type='s' direction='in'/>"
+        "      <arg name='domain' type='s' direction='in'/>"
+        "      <arg name='flags' type='u' direction='in'/>"
+        "      <arg name='path' type='o' direction='out'/>"
+        "    </method>"
+        "    <method name='ResolveService'>"
+        "      <arg name='interface' type='i' direction='in'/>"
+        "      <arg name='protocol' type='i' direction='in'/>"
+        "      <arg name='name' type='s' direction='in'/>"
+        "      <arg name='type' type='s' direction='in'/>"
+        "      <arg name='domain' type='s' direction='in'/>"
+        "      <arg name='aprotocol' type='i' direction='in'/>"
+        "      <arg name='flags' type='u' direction='in'/>"
+        "      <arg name='interface' type='i' direction='out'/>"
+        "      <arg name='protocol' type='i' direction='out'/>"
+        "      <arg name='name' type='s' direction='out'/>"
+        "      <arg name='type' type='s' direction='out'/>"
+        "      <arg name='domain' type='s' direction='out'/>"
+        "      <arg name='host' type='s' direction='out'/>"
+        "      <arg name='aprotocol' type='i' direction='out'/>"
+        "      <arg name='address' type='s' direction='out'/>"
+        "      <arg name='port' type='q' direction='out'/>"
+        "      <arg name='txt' type='aay' direction='out'/>"
+        "      <arg name='flags' type='u' direction='out'/>"
+        "    </method>"
+        "  </interface>"
+        "  <interface name='" AVAHI_SERVER2_IFACE "'>"
+        "    <method name='ServiceBrowserPrepare'>"
+        "      <arg name='interface' type='i' direction='in'/>"
+        "      <arg name='protocol' type='i' direction='in'/>"
+        "      <arg name='type' type='s' direction='in'/>"
+        "      <arg name='domain' type='s' direction='in'/>"
+        "      <arg name='flags' type='u' direction='in'/>"
+        "      <arg name='path' type='o' direction='out'/>"
+        "    </method>"
+        "  </interface>"
+        "  <interface name='" AVAHI_SERVICE_BROWSER_IFACE "'>"
+        "    <method name='Free'/>"
+        "    <method name='Start'/>"
+        "  </interface>"
+        "</node>";
+
+struct AvahiMock
+{
+        AvahiMockConfig  config;
+        GDBusConnection *connection;
+        GDBusNodeInfo   *introspection;
+        guint            server_id;
+        guint            server2_id;
+        /* object path -> MockBrowser */
+        GHashTable      *browsers;
+        guint            browser_serial;
+        guint            n_resolved;
+        /* replies still waiting for resolve_latency */
+        GList           *pending;
+};
+
+typedef struct
+{
+        AvahiMock *mock;
+        char      *path;
+        char      *type;
+        char      *domain;
+        int        protocol;
+        guint      registration_id;
+        gboolean   started;
+        int        next;
+        guint      announce_id;
+        guint      churn_id;
+        /* service currently withdrawn by churn, -1 if none */
+        int        withdrawn;
+} MockBrowser;
+
+typedef struct
+{
+        AvahiMock             *mock;
+        GDBusMethodInvocation *invocation;
+        GVariant              *reply;
+        guint                  id;
+} MockResolveReply;
+
+/******************************************************
+ * Browsers
+ ******************************************************/
+
+static void
+mock_browser_emit (MockBrowser *browser,
+                   const char  *signal_name,
+                   int          index)
+{
+        char *name;
+        int   protocols[2];
+        int   n_protocols = 0;
+        int   i;
+
+        if (browser->protocol == AVAHI_PROTO_UNSPEC) {
+                protocols[n_protocols++] = AVAHI_PROTO_INET;
+                if (browser->mock->config.dual_stack)
+                        protocols[n_protocols++] = AVAHI_PROTO_INET6;
+        } else {
+                protocols[n_protocols++] = browser->protocol;
+        }
+
+        name = g_strdup_printf (MOCK_SERVICE_NAME, index);
+
+        for (i = 0; i < n_protocols; i++)
+                g_dbus_connection_emit_signal (browser->mock->connection,
+                                               NULL,
+                                               browser->path,
+                                               AVAHI_SERVICE_BROWSER_IFACE,
+                                               signal_name,
+                                               g_variant_new ("(iisssu)",
+                                                              MOCK_INTERFACE,
+                                                              protocols[i],
+                                                              name,
+                                                              browser->type,
+                                                              browser->domain,
+                                                              0),
+                                               NULL);
+
+        g_free (name);
+}
+
+static gboolean
+mock_browser_churn_cb (gpointer user_data)
+{
+        MockBrowser *browser = user_data;
+
+        if (browser->withdrawn >= 0) {
+                mock_browser_emit (browser, "ItemNew", browser->withdrawn);
+                browser->withdrawn = -1;
+        } else {
+                browser->withdrawn = g_random_int_range (0, browser->mock->config.n_services);
+                mock_browser_emit (browser, "ItemRemove", browser->withdrawn);
+        }
+
+        return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+mock_browser_announce_cb (gpointer user_data)
+{
+        MockBrowser     *browser = user_data;
+        AvahiMockConfig *config = &browser->mock->config;
+        int              end;
+
+        if (config->announce_batch > 0)
+                end = MIN (browser->next + config->announce_batch, config->n_services);
+        else
+                end = config->n_services;
+
+        for (; browser->next < end; browser->next++)
+                mock_browser_emit (browser, "ItemNew", browser->next);
+
+        if (browser->next < config->n_services)
+                return G_SOURCE_CONTINUE;
+
+        g_dbus_connection_emit_signal (browser->mock->connection,
+                                       NULL,
+                                       browser->path,
+                                       AVAHI_SERVICE_BROWSER_IFACE,
+                                       "AllForNow",
+                                       NULL,
+                                       NULL);
+
+        if (config->churn_interval > 0 && config->n_services > 0)
+                browser->churn_id = g_timeout_add (config->churn_interval,
+                                                   mock_browser_churn_cb,
+                                                   browser);
+
+        browser->announce_id = 0;
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+mock_browser_start (MockBrowser *browser)
+{
+        if (browser->started)
+                return;
+
+        /* Announce from an idle so that the reply creating the browser
+         * is sent before its first signal, as the real daemon does. */
+        browser->started = TRUE;
+        browser->announce_id = g_idle_add (mock_browser_announce_cb, browser);
+}
+
+static void
+mock_browser_free (gpointer user_data)
+{
+        MockBrowser *browser = user_data;
+
+        if (browser->announce_id > 0)
+                g_source_remove (browser->announce_id);
+        if (browser->churn_id > 0)
+                g_source_remove (browser->churn_id);
+
+        g_dbus_connection_unregister_object (browser->mock->connection,
+                                             browser->registration_id);
+
+        g_free (browser->path);
+        g_free (browser->type);
+        g_free (browser->domain);
+        g_free (browser);
+}
+
+static void
+mock_browser_method_call (GDBusConnection       *connection,
+                          const char            *sender,
+                          const char            *object_path,
+                          const char            *interface_name,
+                          const char            *method_name,
+                          GVariant              *parameters,
+                          GDBusMethodInvocation *invocation,
+                          gpointer               user_data)
+{
+        AvahiMock   *mock = user_data;
+        MockBrowser *browser;
+
+        browser = g_hash_table_lookup (mock->browsers, object_path);
+        if (!browser) {
+                g_dbus_method_invocation_return_dbus_error (invocation,
+                                                            "org.freedesktop.Avahi.InvalidObjectError",
+                                                            "Invalid object");
+                return;
+        }
+
+        if (g_strcmp0 (method_name, "Start") == 0)
+                mock_browser_start (browser);
+        else
+                g_hash_table_remove (mock->browsers, object_path);
+
+        g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+static const GDBusInterfaceVTable mock_browser_vtable = {
+        mock_browser_method_call,
+        NULL,
+        NULL
+};
+
+static MockBrowser *
+mock_browser_new (AvahiMock  *mock,
+                  GVariant   *parameters,
+                  GError    **error)
+{
+        MockBrowser *browser;
+        const char  *type;
+        const char  *domain;
+        int          interface;
+        int          protocol;
+        guint32      flags;
+
+        g_variant_get (parameters, "(ii&s&su)",
+                       &interface, &protocol, &type, &domain, &flags);
+
+        browser = g_new0 (MockBrowser, 1);
+        browser->mock = mock;
+        browser->path = g_strdup_printf ("/Client1/ServiceBrowser%u",
+                                         ++mock->browser_serial);
+        browser->type = g_strdup (type);
+        browser->domain = g_strdup (domain[0] != '\0' ? domain : "local");
+        browser->protocol = protocol;
+        browser->withdrawn = -1;
+
+        browser->registration_id =
+                g_dbus_connection_register_object (mock->connection,
+                                                   browser->path,
+                                                   g_dbus_node_info_lookup_interface (mock->introspection,
+                                                                                      AVAHI_SERVICE_BROWSER_IFACE),
+                                                   &mock_browser_vtable,
+                                                   mock,
+                                                   NULL,
+                                                   error);
+        if (browser->registration_id == 0) {
+                g_free (browser->path);
+                g_free (browser->type);
+                g_free (browser->domain);
+                g_free (browser);
+                return NULL;
+        }
+
+        g_hash_table_insert (mock->browsers, browser->path, browser);
+
+        return browser;
+}
+
+/******************************************************
+ * Resolver
+ ******************************************************/
+
+static GVariant *
+mock_resolve_reply_new (int         interface,
+                        int         protocol,
+                        const char *name,
+                        const char *type,
+                        const char *domain,
+                        int         index)
+{
+        GVariantBuilder  txt;
+        const char      *entries[5];
+        char            *uuid;
+        char            *host;
+        char            *address;
+        GVariant        *reply;
+        int              i;
+
+        uuid = g_strdup_printf ("UUID=00000000-0000-0000-0000-%012x", index);
+
+        entries[0] = "rp=ipp/print";
+        entries[1] = "ty=Mock Printer";
+        entries[2] = "pdl=application/pdf,image/urf";
+        entries[3] = "usb_MFG=Mock";
+        entries[4] = uuid;
+
+        g_variant_builder_init (&txt, G_VARIANT_TYPE ("aay"));
+        for (i = 0; i < G_N_ELEMENTS (entries); i++)
+                g_variant_builder_add_value (&txt,
+                                             g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                        entries[i],
+                                                                        strlen (entries[i]),
+                                                                        1));
+
+        host = g_strdup_printf ("mock-printer-%d.local", index);
+        if (protocol == AVAHI_PROTO_INET6)
+                address = g_strdup_printf ("fd00::%x", index + 1);
+        else
+                address = g_strdup_printf ("10.%d.%d.%d",
+                                           (index >> 16) & 0xff,
+                                           (index >> 8) & 0xff,
+                                           index & 0xff);
+
+        reply = g_variant_new ("(iissssisqaayu)",
+                               interface,
+                               protocol,
+                               name,
+                               type,
+                               domain,
+                               host,
+                               protocol,
+                               address,
+                               (guint16) 631,
+                               &txt,
+                               0);
+
+        g_free (address);
+        g_free (host);
+        g_free (uuid);
+
+        return reply;
+}
+
+static gboolean
+mock_resolve_reply_cb (gpointer user_data)
+{
+        MockResolveReply *reply = user_data;
+
+        reply->mock->pending = g_list_remove (reply->mock->pending, reply);
+        reply->mock->n_resolved++;
+
+        g_dbus_method_invocation_return_value (reply->invocation, reply->reply);
+        g_free (reply);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+mock_resolve_service (AvahiMock             *mock,
+                      GVariant              *parameters,
+                      GDBusMethodInvocation *invocation)
+{
+        MockResolveReply *reply;
+        const char       *name;
+        const char       *type;
+        const char       *domain;
+        guint32           flags;
+        int               interface;
+        int               protocol;
+        int               aprotocol;
+        int               index;
+
+        g_variant_get (parameters, "(ii&s&s&siu)",
+                       &interface, &protocol, &name, &type, &domain,
+                       &aprotocol, &flags);
+
+        if (sscanf (name, MOCK_SERVICE_NAME, &index) != 1 ||
+            index < 0 || index >= mock->config.n_services) {
+                g_dbus_method_invocation_return_dbus_error (invocation,
+                                                            "org.freedesktop.Avahi.TimeoutError",
+                                                            "Timeout reached");
+                return;
+        }
+
+        if (protocol == AVAHI_PROTO_UNSPEC)
+                protocol = AVAHI_PROTO_INET;
+
+        if (mock->config.resolve_latency <= 0) {
+                mock->n_resolved++;
+                g_dbus_method_invocation_return_value (invocation,
+                                                       mock_resolve_reply_new (interface, protocol,
+                                                                               name, type, domain,
+                                                                               index));
+                return;
+        }
+
+        reply = g_new0 (MockResolveReply, 1);
+        reply->mock = mock;
+        reply->invocation = invocation;
+        reply->reply = mock_resolve_reply_new (interface, protocol,
+                                               name, type, domain, index);
+        reply->id = g_timeout_add (mock->config.resolve_latency,
+                                   mock_resolve_reply_cb,
+                                   reply);
+        mock->pending = g_list_prepend (mock->pending, reply);
+}
+
+/******************************************************
+ * Server
+ ******************************************************/
+
+static void
+mock_server_method_call (GDBusConnection       *connection,
+                         const char            *sender,
+                         const char            *object_path,
+                         const char            *interface_name,
+                         const char            *method_name,
+                         GVariant              *parameters,
+                         GDBusMethodInvocation *invocation,
+                         gpointer               user_data)
+{
+        AvahiMock   *mock = user_data;
+        MockBrowser *browser;
+        GError      *error = NULL;
+
+        if (g_strcmp0 (method_name, "ResolveService") == 0) {
+                mock_resolve_service (mock, parameters, invocation);
+                return;
+        }
+
+        browser = mock_browser_new (mock, parameters, &error);
+        if (!browser) {
+                g_dbus_method_invocation_take_error (invocation, error);
+                return;
+        }
+
+        /* ServiceBrowserNew starts right away, ServiceBrowserPrepare
+         * waits for ServiceBrowser.Start. */
+        if (g_strcmp0 (method_name, "ServiceBrowserNew") == 0)
+                mock_browser_start (browser);
+
+        g_dbus_method_invocation_return_value (invocation,
+                                               g_variant_new ("(o)", browser->path));
+}
+
+static const GDBusInterfaceVTable mock_server_vtable = {
+        mock_server_method_call,
+        NULL,
+        NULL
+};
+
+AvahiMock *
+avahi_mock_new (const char             *bus_address,
+                const AvahiMockConfig  *config,
+                GError                **error)
+{
+        AvahiMock *mock;
+        GVariant  *reply;
+        guint32    result;
+
+        mock = g_new0 (AvahiMock, 1);
+        mock->config = *config;
+        mock->browsers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                NULL, mock_browser_free);
+
+        mock->introspection = g_dbus_node_info_new_for_xml (mock_introspection_xml,
+                                                            error);
+        if (!mock->introspection)
+                goto out;
+
+        mock->connection = g_dbus_connection_new_for_address_sync (bus_address,
+                                                                    G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                                    G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                                    NULL,
+                                                                    NULL,
+                                                                    error);
+        if (!mock->connection)
+                goto out;
+
+        mock->server_id = g_dbus_connection_register_object (mock->connection,
+                                                             "/",
+                                                             g_dbus_node_info_lookup_interface (mock->introspection,
+                                                                                                AVAHI_SERVER_IFACE),
+                                                             &mock_server_vtable,
+                                                             mock,
+                                                             NULL,
+                                                             error);
+        if (mock->server_id == 0)
+                goto out;
+
+        if (!config->no_server2) {
+                mock->server2_id = g_dbus_connection_register_object (mock->connection,
+                                                                      "/",
+                                                                      g_dbus_node_info_lookup_interface (mock->introspection,
+                                                                                                         AVAHI_SERVER2_IFACE),
+                                                                      &mock_server_vtable,
+                                                                      mock,
+                                                                      NULL,
+                                                                      error);
+                if (mock->server2_id == 0)
+                        goto out;
+        }
+
+        /* Own the name synchronously: clients may call us as soon as
+         * this returns. */
+        reply = g_dbus_connection_call_sync (mock->connection,
+                                             "org.freedesktop.DBus",
+                                             "/org/freedesktop/DBus",
+                                             "org.freedesktop.DBus",
+                                             "RequestName",
+                                             g_variant_new ("(su)", AVAHI_BUS, 4),
+                                             G_VARIANT_TYPE ("(u)"),
+                                             G_DBUS_CALL_FLAGS_NONE,
+                                             -1,
+                                             NULL,
+                                             error);
+        if (!reply)
+                goto out;
+
+        g_variant_get (reply, "(u)", &result);
+        g_variant_unref (reply);
+
+        /* DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER */
+        if (result != 1) {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                             "%s is already owned on this bus", AVAHI_BUS);
+                goto out;
+        }
+
+        return mock;
+
+out:
+        avahi_mock_free (mock);
+        return NULL;
+}
+
+void
+avahi_mock_free (AvahiMock *mock)
+{
+        GList *l;
+
+        if (!mock)
+                return;
+
+        for (l = mock->pending; l; l = l->next) {
+                MockResolveReply *reply = l->data;
+
+                if (reply->id > 0)
+                        g_source_remove (reply->id);
+                g_dbus_method_invocation_return_dbus_error (reply->invocation,
+                                                            "org.freedesktop.Avahi.DisconnectedError",
+                                                            "Daemon connection failed");
+                g_variant_unref (g_variant_ref_sink (reply->reply));
+                g_free (reply);
+        }
+        g_list_free (mock->pending);
+
+        g_hash_table_destroy (mock->browsers);
+
+        if (mock->connection) {
+                if (mock->server_id > 0)
+                        g_dbus_connection_unregister_object (mock->connection,
+                                                             mock->server_id);
+                if (mock->server2_id > 0)
+                        g_dbus_connection_unregister_object (mock->connection,
+                                                             mock->server2_id);
+                g_dbus_connection_close_sync (mock->connection, NULL, NULL);
+                g_object_unref (mock->connection);
+        }
+
+        if (mock->introspection)
+                g_dbus_node_info_unref (mock->introspection);
+
+        g_free (mock);
+}
+
+guint
+avahi_mock_get_n_resolved (AvahiMock *mock)
+{
+        return mock->n_resolved;
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ * vim: set et ts=8 sw=8:
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#ifndef AVAHI_MOCK_H
+#define AVAHI_MOCK_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Minimal org.freedesktop.Avahi daemon for tests and benchmarks: every
+ * service browser announces n_services synthetic services of the browsed
+ * type, and ResolveService answers for any of them. */
+
+typedef struct
+{
+        /* services announced by each browser */
+        int      n_services;
+        /* ItemNew signals sent per main loop iteration, 0 for all at once */
+        int      announce_batch;
+        /* delay before ResolveService answers, in milliseconds */
+        int      resolve_latency;
+        /* once everything is announced, withdraw and re-announce one
+         * service every churn_interval milliseconds, 0 to disable */
+        int      churn_interval;
+        /* announce every service over both IPv4 and IPv6 */
+        gboolean dual_stack;
+        /* behave like Avahi < 0.8, without org.freedesktop.Avahi.Server2 */
+        gboolean no_server2;
+} AvahiMockConfig;
+
+typedef struct AvahiMock AvahiMock;
+
+AvahiMock *avahi_mock_new            (const char             *bus_address,
+                                      const AvahiMockConfig  *config,
+                                      GError                **error);
+
+void       avahi_mock_free           (AvahiMock              *mock);
+
+guint      avahi_mock_get_n_resolved (AvahiMock              *mock);
+
+G_END_DECLS
+
+#endif /* AVAHI_MOCK_H */
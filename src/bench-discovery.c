@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ * vim: set et ts=8 sw=8:
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* Discovery benchmark: runs ServicesBrowse and PrinterAppGet against a mock
+ * Avahi daemon on a private bus, for an increasing number of services, and
+ * reports wall time and resident memory growth.  The mock lives in this
+ * process, so memory figures include the synthesized records on the daemon
+ * side as well. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gio/gio.h>
+
+#include "avahi-mock.h"
+#include "cups.h"
+
+/* meson treats this exit status as a skipped test or benchmark */
+#define EXIT_SKIP 77
+
+typedef struct
+{
+        GMainLoop *loop;
+        GVariant  *result;
+} BenchCall;
+
+static char     *sizes_option = NULL;
+static int       latency_option = 0;
+static int       batch_option = 0;
+static int       churn_option = 0;
+static int       timeout_option = 120;
+static gboolean  dual_stack_option = FALSE;
+static gboolean  old_avahi_option = FALSE;
+
+static const GOptionEntry entries[] = {
+        { "sizes", 0, 0, G_OPTION_ARG_STRING, &sizes_option,
+          "Comma-separated numbers of services (default: 10,100,1000,5000)", "N,..." },
+        { "latency", 0, 0, G_OPTION_ARG_INT, &latency_option,
+          "Delay before each resolution is answered, in milliseconds", "MSEC" },
+        { "batch", 0, 0, G_OPTION_ARG_INT, &batch_option,
+          "Services announced per main loop iteration (default: all)", "N" },
+        { "churn", 0, 0, G_OPTION_ARG_INT, &churn_option,
+          "Withdraw and re-announce a service every MSEC milliseconds", "MSEC" },
+        { "timeout", 0, 0, G_OPTION_ARG_INT, &timeout_option,
+          "Timeout passed to each discovery call, in seconds", "SEC" },
+        { "dual-stack", 0, 0, G_OPTION_ARG_NONE, &dual_stack_option,
+          "Announce every service over IPv4 and IPv6", NULL },
+        { "old-avahi", 0, 0, G_OPTION_ARG_NONE, &old_avahi_option,
+          "Do not implement org.freedesktop.Avahi.Server2", NULL },
+        { NULL }
+};
+
+static long
+get_rss_kb (void)
+{
+        char  *contents;
+        char  *line;
+        long   rss = -1;
+
+        if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL))
+                return -1;
+
+        line = strstr (contents, "VmRSS:");
+        if (line)
+                rss = strtol (line + strlen ("VmRSS:"), NULL, 10);
+
+        g_free (contents);
+
+        return rss;
+}
+
+static int
+count_keys (GVariant   *result,
+            const char *prefix)
+{
+        GVariantIter  iter;
+        const char   *key;
+        int           count = 0;
+
+        if (!result)
+                return -1;
+
+        g_variant_iter_init (&iter, result);
+        while (g_variant_iter_next (&iter, "{&s&s}", &key, NULL))
+                if (g_str_has_prefix (key, prefix))
+                        count++;
+
+        return count;
+}
+
+static void
+services_browse_cb (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+        BenchCall *call = user_data;
+
+        if (!cph_cups_services_browse_finish (CPH_CUPS (source), result,
+                                              &call->result))
+                call->result = NULL;
+
+        g_main_loop_quit (call->loop);
+}
+
+static void
+printer_app_get_cb (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+        BenchCall *call = user_data;
+
+        if (!cph_cups_printer_app_get_finish (CPH_CUPS (source), result,
+                                              &call->result))
+                call->result = NULL;
+
+        g_main_loop_quit (call->loop);
+}
+
+static gboolean
+run_size (const char *bus_address,
+          int         n_services)
+{
+        static const char *const browse_types[] = { "_ipp._tcp", NULL };
+        AvahiMockConfig  config;
+        AvahiMock       *mock;
+        CphCups         *cups;
+        BenchCall        call;
+        GError          *error = NULL;
+        gint64           start;
+        double           browse_ms;
+        double           resolve_ms;
+        long             rss_before;
+        long             rss_after;
+        int              n_browsed;
+        int              n_apps;
+        int              n_protocols;
+        gboolean         ok = TRUE;
+
+        memset (&config, 0, sizeof (config));
+        config.n_services = n_services;
+        config.announce_batch = batch_option;
+        config.resolve_latency = latency_option;
+        config.churn_interval = churn_option;
+        config.dual_stack = dual_stack_option;
+        config.no_server2 = old_avahi_option;
+
+        mock = avahi_mock_new (bus_address, &config, &error);
+        if (!mock) {
+                g_printerr ("Cannot start mock Avahi daemon: %s\n", error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        /* A new CphCups per run, so that nothing is cached from the
+         * previous size. */
+        cups = cph_cups_new ();
+        if (!cups) {
+                avahi_mock_free (mock);
+                return FALSE;
+        }
+
+        call.loop = g_main_loop_new (NULL, FALSE);
+        rss_before = get_rss_kb ();
+
+        call.result = NULL;
+        start = g_get_monotonic_time ();
+        cph_cups_services_browse_async (cups, timeout_option, browse_types,
+                                        NULL, services_browse_cb, &call);
+        g_main_loop_run (call.loop);
+        browse_ms = (g_get_monotonic_time () - start) / 1000.0;
+        n_browsed = count_keys (call.result, "service-name:");
+        if (call.result)
+                g_variant_unref (call.result);
+
+        call.result = NULL;
+        start = g_get_monotonic_time ();
+        cph_cups_printer_app_get_async (cups, timeout_option,
+                                        NULL, printer_app_get_cb, &call);
+        g_main_loop_run (call.loop);
+        resolve_ms = (g_get_monotonic_time () - start) / 1000.0;
+        n_apps = count_keys (call.result, "hostname:");
+        if (call.result)
+                g_variant_unref (call.result);
+
+        rss_after = get_rss_kb ();
+
+        g_print ("%8d %12.1f %8d %12.1f %8d %8u %10ld\n",
+                 n_services,
+                 browse_ms, n_browsed,
+                 resolve_ms, n_apps,
+                 avahi_mock_get_n_resolved (mock),
+                 rss_before >= 0 && rss_after >= 0 ? rss_after - rss_before : -1);
+
+        /* Churn makes the counts a moving target; only check them on a
+         * stable network.  PrinterAppGet browses two service types and
+         * collapses IPv4/IPv6 duplicates. */
+        n_protocols = dual_stack_option ? 2 : 1;
+        if (churn_option <= 0 &&
+            (n_browsed != n_services * n_protocols || n_apps != 2 * n_services)) {
+                g_printerr ("Expected %d services and %d printer applications\n",
+                            n_services * n_protocols, 2 * n_services);
+                ok = FALSE;
+        }
+
+        g_main_loop_unref (call.loop);
+        g_object_unref (cups);
+        avahi_mock_free (mock);
+
+        return ok;
+}
+
+int
+main (int argc, char **argv)
+{
+        GOptionContext  *context;
+        GTestDBus       *bus;
+        GError          *error = NULL;
+        CphCups         *cups;
+        char           **sizes;
+        int              status = EXIT_SUCCESS;
+        int              i;
+
+        context = g_option_context_new ("- benchmark DNS-SD discovery");
+        g_option_context_add_main_entries (context, entries, NULL);
+        if (!g_option_context_parse (context, &argc, &argv, &error)) {
+                g_printerr ("%s\n", error->message);
+                g_error_free (error);
+                g_option_context_free (context);
+                return EXIT_FAILURE;
+        }
+        g_option_context_free (context);
+
+        /* CphCups needs a running cupsd even though only discovery is
+         * exercised here. */
+        cups = cph_cups_new ();
+        if (!cups) {
+                g_printerr ("Cannot connect to cupsd, skipping\n");
+                return EXIT_SKIP;
+        }
+        g_object_unref (cups);
+
+        g_test_dbus_unset ();
+        bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+        g_test_dbus_up (bus);
+
+        /* Discovery talks to Avahi on the system bus */
+        g_setenv ("DBUS_SYSTEM_BUS_ADDRESS", g_test_dbus_get_bus_address (bus), TRUE);
+
+        sizes = g_strsplit (sizes_option ? sizes_option : "10,100,1000,5000", ",", -1);
+
+        g_print ("%8s %12s %8s %12s %8s %8s %10s\n",
+                 "services", "browse (ms)", "found",
+                 "resolve (ms)", "apps", "resolved", "rss (KiB)");
+
+        for (i = 0; sizes[i]; i++) {
+                int n_services = atoi (sizes[i]);
+
+                if (n_services <= 0)
+                        continue;
+
+                if (!run_size (g_test_dbus_get_bus_address (bus), n_services))
+                        status = EXIT_FAILURE;
+        }
+
+        g_strfreev (sizes);
+        g_free (sizes_option);
+
+        g_test_dbus_down (bus);
+        g_object_unref (bus);
+
+        return status;
+}
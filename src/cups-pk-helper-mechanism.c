@@ -93,6 +93,8 @@ struct CphMechanismPrivate
         PolkitAuthority *pol_auth;
         CphCups         *cups;
         GDBusProxy      *dbus_proxy;
+        /* methods that did not answer yet */
+        guint            pending_calls;
 };
 
 enum {
@@ -166,6 +168,7 @@ cph_mechanism_init (CphMechanism *mechanism)
         mechanism->priv->pol_auth = NULL;
         mechanism->priv->cups = NULL;
         mechanism->priv->dbus_proxy = NULL;
+        mechanism->priv->pending_calls = 0;
 }
 
 static void
@@ -256,6 +259,24 @@ cph_mechanism_register (CphMechanism     *mechanism,
         return TRUE;
 }
 
+gboolean
+cph_mechanism_is_busy (CphMechanism *mechanism)
+{
+        g_return_val_if_fail (CPH_IS_MECHANISM (mechanism), FALSE);
+
+        return mechanism->priv->pending_calls > 0;
+}
+
+void
+cph_mechanism_start_resident_discovery (CphMechanism *mechanism,
+                                        int           refresh_interval)
+{
+        g_return_if_fail (CPH_IS_MECHANISM (mechanism));
+
+        cph_cups_start_resident_discovery (mechanism->priv->cups,
+                                           refresh_interval);
+}
+
 /* polkit helpers */
 
 static gboolean
@@ -550,6 +571,64 @@ _cph_mechanism_emit_called (CphMechanism *mechanism)
         g_signal_emit (mechanism, signals[CALLED], 0);
 }
 
+/* A method that answers from a callback */
+typedef struct
+{
+        CphMechanism          *mechanism;
+        GDBusMethodInvocation *context;
+        /* cancelled when the caller leaves the bus, as nobody is left to
+         * get the answer */
+        GCancellable          *cancellable;
+        guint                  watch_id;
+} CphMechanismAsyncCall;
+
+static void
+_cph_mechanism_async_call_vanished_cb (GDBusConnection *connection,
+                                       const char      *name,
+                                       gpointer         user_data)
+{
+        CphMechanismAsyncCall *call = user_data;
+
+        g_debug ("%s left the bus, cancelling its call", name);
+        g_cancellable_cancel (call->cancellable);
+}
+
+static CphMechanismAsyncCall *
+_cph_mechanism_async_call_new (CphMechanism          *mechanism,
+                               GDBusMethodInvocation *context)
+{
+        CphMechanismAsyncCall *call;
+
+        call = g_new0 (CphMechanismAsyncCall, 1);
+        call->mechanism = g_object_ref (mechanism);
+        call->context = context;
+        call->cancellable = g_cancellable_new ();
+        call->watch_id = g_bus_watch_name_on_connection (g_dbus_method_invocation_get_connection (context),
+                                                         g_dbus_method_invocation_get_sender (context),
+                                                         G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                         NULL,
+                                                         _cph_mechanism_async_call_vanished_cb,
+                                                         call, NULL);
+
+        mechanism->priv->pending_calls++;
+
+        return call;
+}
+
+static void
+_cph_mechanism_async_call_free (CphMechanismAsyncCall *call)
+{
+        call->mechanism->priv->pending_calls--;
+
+        /* the activity only ends now */
+        _cph_mechanism_emit_called (call->mechanism);
+
+        g_bus_unwatch_name (call->watch_id);
+        g_object_unref (call->cancellable);
+        g_object_unref (call->mechanism);
+        g_free (call);
+}
+
 /* exported methods */
 
 static gboolean
@@ -671,6 +750,32 @@ cph_mechanism_server_set_settings (CphIfaceMechanism     *object,
         return TRUE;
 }
 
+static void
+cph_mechanism_devices_get_cb (GObject      *source_object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+        CphMechanismAsyncCall *call = user_data;
+        CphMechanism          *mechanism = call->mechanism;
+        gboolean               ret;
+        GVariant              *devices = NULL;
+
+        ret = cph_cups_devices_get_finish (mechanism->priv->cups,
+                                           result,
+                                           &devices);
+
+        if (devices == NULL)
+                devices = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE_DICT_ENTRY, NULL, 0));
+
+        cph_iface_mechanism_complete_devices_get (
+                        CPH_IFACE_MECHANISM (mechanism), call->context,
+                        _cph_mechanism_return_error (mechanism, !ret),
+                        devices);
+
+        g_variant_unref (devices);
+        _cph_mechanism_async_call_free (call);
+}
+
 static gboolean
 cph_mechanism_devices_get (CphIfaceMechanism      *object,
                            GDBusMethodInvocation  *context,
@@ -679,9 +784,8 @@ cph_mechanism_devices_get (CphIfaceMechanism      *object,
                            const char *const      *include_schemes,
                            const char *const      *exclude_schemes)
 {
-        CphMechanism *mechanism = CPH_MECHANISM (object);
-        gboolean      ret;
-        GVariant     *devices = NULL;
+        CphMechanism          *mechanism = CPH_MECHANISM (object);
+        CphMechanismAsyncCall *call;
 
         _cph_mechanism_emit_called (mechanism);
 
@@ -691,21 +795,44 @@ cph_mechanism_devices_get (CphIfaceMechanism      *object,
                                          NULL))
                 return TRUE;
 
-        ret = cph_cups_devices_get (mechanism->priv->cups,
+        call = _cph_mechanism_async_call_new (mechanism, context);
+
+        cph_cups_devices_get_async (mechanism->priv->cups,
                                     timeout,
                                     limit,
                                     include_schemes,
                                     exclude_schemes,
-                                    &devices);
+                                    call->cancellable,
+                                    cph_mechanism_devices_get_cb,
+                                    call);
 
-        if (devices == NULL)
-                devices = g_variant_new_array (G_VARIANT_TYPE_DICT_ENTRY, NULL, 0);
+        return TRUE;
+}
 
-        cph_iface_mechanism_complete_devices_get (
-                        object, context,
+static void
+cph_mechanism_printer_app_get_cb (GObject      *source_object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+        CphMechanismAsyncCall *call = user_data;
+        CphMechanism          *mechanism = call->mechanism;
+        gboolean               ret;
+        GVariant              *apps = NULL;
+
+        ret = cph_cups_printer_app_get_finish (mechanism->priv->cups,
+                                               result,
+                                               &apps);
+
+        if (apps == NULL)
+                apps = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE_DICT_ENTRY, NULL, 0));
+
+        cph_iface_mechanism_complete_printer_app_get (
+                        CPH_IFACE_MECHANISM (mechanism), call->context,
                         _cph_mechanism_return_error (mechanism, !ret),
-                        devices);
-        return TRUE;
+                        apps);
+
+        g_variant_unref (apps);
+        _cph_mechanism_async_call_free (call);
 }
 
 static gboolean
@@ -713,9 +840,8 @@ cph_mechanism_printer_app_get (CphIfaceMechanism      *object,
                                GDBusMethodInvocation  *context,
                                int                     timeout)
 {
-        CphMechanism *mechanism = CPH_MECHANISM (object);
-        gboolean      ret;
-        GVariant     *devices = NULL;
+        CphMechanism          *mechanism = CPH_MECHANISM (object);
+        CphMechanismAsyncCall *call;
 
         _cph_mechanism_emit_called (mechanism);
 
@@ -725,18 +851,240 @@ cph_mechanism_printer_app_get (CphIfaceMechanism      *object,
                                          NULL))
                 return TRUE;
 
-        ret = cph_cups_printer_app_get (mechanism->priv->cups,
-                                    timeout,
-                                    &devices);
+        call = _cph_mechanism_async_call_new (mechanism, context);
 
-        if (devices == NULL)
-                devices = g_variant_new_array (G_VARIANT_TYPE_DICT_ENTRY, NULL, 0);
+        cph_cups_printer_app_get_async (mechanism->priv->cups,
+                                        timeout,
+                                        call->cancellable,
+                                        cph_mechanism_printer_app_get_cb,
+                                        call);
 
-        cph_iface_mechanism_complete_devices_get (
-                        object, context,
+        return TRUE;
+}
+
+static void
+cph_mechanism_printer_apps_describe_cb (GObject      *source_object,
+                                        GAsyncResult *result,
+                                        gpointer      user_data)
+{
+        CphMechanismAsyncCall *call = user_data;
+        CphMechanism          *mechanism = call->mechanism;
+        gboolean               ret;
+        GVariant              *apps = NULL;
+
+        ret = cph_cups_printer_apps_describe_finish (mechanism->priv->cups,
+                                                     result,
+                                                     &apps);
+
+        if (apps == NULL)
+                apps = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE_DICT_ENTRY, NULL, 0));
+
+        cph_iface_mechanism_complete_printer_apps_describe (
+                        CPH_IFACE_MECHANISM (mechanism), call->context,
                         _cph_mechanism_return_error (mechanism, !ret),
-                        devices);
-                
+                        apps);
+
+        g_variant_unref (apps);
+        _cph_mechanism_async_call_free (call);
+}
+
+static gboolean
+cph_mechanism_printer_apps_describe (CphIfaceMechanism      *object,
+                                     GDBusMethodInvocation  *context,
+                                     int                     timeout)
+{
+        CphMechanism          *mechanism = CPH_MECHANISM (object);
+        CphMechanismAsyncCall *call;
+
+        _cph_mechanism_emit_called (mechanism);
+
+        if (!_check_polkit_for_action_v (mechanism, context,
+                                         "all-edit",
+                                         "printer-app-get",
+                                         NULL))
+                return TRUE;
+
+        call = _cph_mechanism_async_call_new (mechanism, context);
+
+        cph_cups_printer_apps_describe_async (mechanism->priv->cups,
+                                              timeout,
+                                              call->cancellable,
+                                              cph_mechanism_printer_apps_describe_cb,
+                                              call);
+
+        return TRUE;
+}
+
+static void
+cph_mechanism_drivers_get_cb (GObject      *source_object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+        CphMechanismAsyncCall *call = user_data;
+        CphMechanism          *mechanism = call->mechanism;
+        gboolean               ret;
+        GVariant              *drivers = NULL;
+
+        ret = cph_cups_drivers_get_finish (mechanism->priv->cups,
+                                           result,
+                                           &drivers);
+
+        if (drivers == NULL)
+                drivers = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE_DICT_ENTRY, NULL, 0));
+
+        cph_iface_mechanism_complete_drivers_get (
+                        CPH_IFACE_MECHANISM (mechanism), call->context,
+                        _cph_mechanism_return_error (mechanism, !ret),
+                        drivers);
+
+        g_variant_unref (drivers);
+        _cph_mechanism_async_call_free (call);
+}
+
+static gboolean
+cph_mechanism_drivers_get (CphIfaceMechanism     *object,
+                           GDBusMethodInvocation *context,
+                           const char            *device_id,
+                           int                    limit)
+{
+        CphMechanism          *mechanism = CPH_MECHANISM (object);
+        CphMechanismAsyncCall *call;
+
+        _cph_mechanism_emit_called (mechanism);
+
+        if (!_check_polkit_for_action_v (mechanism, context,
+                                         "all-edit",
+                                         "devices-get",
+                                         NULL))
+                return TRUE;
+
+        call = _cph_mechanism_async_call_new (mechanism, context);
+
+        cph_cups_drivers_get_async (mechanism->priv->cups,
+                                    device_id,
+                                    limit,
+                                    call->cancellable,
+                                    cph_mechanism_drivers_get_cb,
+                                    call);
+
+        return TRUE;
+}
+
+static void
+cph_mechanism_services_browse_cb (GObject      *source_object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+        CphMechanismAsyncCall *call = user_data;
+        CphMechanism          *mechanism = call->mechanism;
+        gboolean               ret;
+        GVariant              *services = NULL;
+
+        ret = cph_cups_services_browse_finish (mechanism->priv->cups,
+                                               result,
+                                               &services);
+
+        if (services == NULL)
+                services = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE_DICT_ENTRY, NULL, 0));
+
+        cph_iface_mechanism_complete_services_browse (
+                        CPH_IFACE_MECHANISM (mechanism), call->context,
+                        _cph_mechanism_return_error (mechanism, !ret),
+                        services);
+
+        g_variant_unref (services);
+        _cph_mechanism_async_call_free (call);
+}
+
+static gboolean
+cph_mechanism_services_browse (CphIfaceMechanism      *object,
+                               GDBusMethodInvocation  *context,
+                               int                     timeout,
+                               const char *const      *service_types)
+{
+        CphMechanism          *mechanism = CPH_MECHANISM (object);
+        CphMechanismAsyncCall *call;
+
+        _cph_mechanism_emit_called (mechanism);
+
+        if (!_check_polkit_for_action_v (mechanism, context,
+                                         "all-edit",
+                                         "devices-get",
+                                         NULL))
+                return TRUE;
+
+        call = _cph_mechanism_async_call_new (mechanism, context);
+
+        cph_cups_services_browse_async (mechanism->priv->cups,
+                                        timeout,
+                                        service_types,
+                                        call->cancellable,
+                                        cph_mechanism_services_browse_cb,
+                                        call);
+
+        return TRUE;
+}
+
+static void
+cph_mechanism_service_resolve_cb (GObject      *source_object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+        CphMechanismAsyncCall *call = user_data;
+        CphMechanism          *mechanism = call->mechanism;
+        gboolean               ret;
+        GVariant              *service = NULL;
+
+        ret = cph_cups_service_resolve_finish (mechanism->priv->cups,
+                                               result,
+                                               &service);
+
+        if (service == NULL)
+                service = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE_DICT_ENTRY, NULL, 0));
+
+        cph_iface_mechanism_complete_service_resolve (
+                        CPH_IFACE_MECHANISM (mechanism), call->context,
+                        _cph_mechanism_return_error (mechanism, !ret),
+                        service);
+
+        g_variant_unref (service);
+        _cph_mechanism_async_call_free (call);
+}
+
+static gboolean
+cph_mechanism_service_resolve (CphIfaceMechanism      *object,
+                               GDBusMethodInvocation  *context,
+                               int                     interface,
+                               int                     protocol,
+                               const char             *name,
+                               const char             *type,
+                               const char             *domain,
+                               int                     timeout)
+{
+        CphMechanism          *mechanism = CPH_MECHANISM (object);
+        CphMechanismAsyncCall *call;
+
+        _cph_mechanism_emit_called (mechanism);
+
+        if (!_check_polkit_for_action_v (mechanism, context,
+                                         "all-edit",
+                                         "devices-get",
+                                         NULL))
+                return TRUE;
+
+        call = _cph_mechanism_async_call_new (mechanism, context);
+
+        cph_cups_service_resolve_async (mechanism->priv->cups,
+                                        interface,
+                                        protocol,
+                                        name,
+                                        type,
+                                        domain,
+                                        timeout,
+                                        call->cancellable,
+                                        cph_mechanism_service_resolve_cb,
+                                        call);
+
         return TRUE;
 }
 
@@ -766,6 +1114,86 @@ cph_mechanism_printer_add (CphIfaceMechanism     *object,
         return TRUE;
 }
 
+static void
+cph_mechanism_printers_add_many_cb (GObject      *source_object,
+                                    GAsyncResult *result,
+                                    gpointer      user_data)
+{
+        CphMechanismAsyncCall *call = user_data;
+        CphMechanism          *mechanism = call->mechanism;
+        gboolean               ret;
+        GVariant              *results = NULL;
+
+        ret = cph_cups_printers_add_many_finish (mechanism->priv->cups,
+                                                 result,
+                                                 &results);
+
+        if (results == NULL)
+                results = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("(ss)"), NULL, 0));
+
+        cph_iface_mechanism_complete_printers_add_many (
+                        CPH_IFACE_MECHANISM (mechanism), call->context,
+                        _cph_mechanism_return_error (mechanism, !ret),
+                        results);
+
+        g_variant_unref (results);
+        _cph_mechanism_async_call_free (call);
+}
+
+static gboolean
+cph_mechanism_printers_add_many (CphIfaceMechanism     *object,
+                                 GDBusMethodInvocation *context,
+                                 GVariant              *printers)
+{
+        CphMechanism          *mechanism = CPH_MECHANISM (object);
+        CphMechanismAsyncCall *call;
+        GVariantIter           iter;
+        const char           **names;
+        const char            *name;
+        const char            *uri;
+        gboolean               is_local;
+        int                    i = 0;
+
+        _cph_mechanism_emit_called (mechanism);
+
+        /* One authorization for all the printers: the remote action if any
+         * of them is remote. */
+        names = g_new0 (const char *, g_variant_n_children (printers) + 1);
+        is_local = TRUE;
+
+        g_variant_iter_init (&iter, printers);
+        while (g_variant_iter_next (&iter, "(&s&s&s&s@a{sv})",
+                                    &name, &uri, NULL, NULL, NULL)) {
+                names[i++] = name;
+                if (!cph_cups_is_printer_uri_local (uri))
+                        is_local = FALSE;
+        }
+
+        if (is_local)
+                is_local = cph_cups_printers_are_local (mechanism->priv->cups,
+                                                        names);
+
+        g_free (names);
+
+        if (!_check_polkit_for_action_v (mechanism, context,
+                                         "all-edit",
+                                         "printeraddremove",
+                                         is_local ? "printer-local-edit"
+                                                  : "printer-remote-edit",
+                                         NULL))
+                return TRUE;
+
+        call = _cph_mechanism_async_call_new (mechanism, context);
+
+        cph_cups_printers_add_many_async (mechanism->priv->cups,
+                                          printers,
+                                          call->cancellable,
+                                          cph_mechanism_printers_add_many_cb,
+                                          call);
+
+        return TRUE;
+}
+
 static gboolean
 cph_mechanism_printer_add_with_ppd_file (CphIfaceMechanism     *object,
                                          GDBusMethodInvocation *context,
@@ -1503,6 +1931,22 @@ cph_mechanism_connect_signals (CphMechanism *mechanism)
                           "handle-printer-app-get",
                           G_CALLBACK (cph_mechanism_printer_app_get),
                           NULL);
+        g_signal_connect (mechanism,
+                          "handle-printer-apps-describe",
+                          G_CALLBACK (cph_mechanism_printer_apps_describe),
+                          NULL);
+        g_signal_connect (mechanism,
+                          "handle-drivers-get",
+                          G_CALLBACK (cph_mechanism_drivers_get),
+                          NULL);
+        g_signal_connect (mechanism,
+                          "handle-services-browse",
+                          G_CALLBACK (cph_mechanism_services_browse),
+                          NULL);
+        g_signal_connect (mechanism,
+                          "handle-service-resolve",
+                          G_CALLBACK (cph_mechanism_service_resolve),
+                          NULL);
         g_signal_connect (mechanism,
                           "handle-file-get",
                           G_CALLBACK (cph_mechanism_file_get),
@@ -1531,6 +1975,10 @@ cph_mechanism_connect_signals (CphMechanism *mechanism)
                           "handle-printer-add",
                           G_CALLBACK (cph_mechanism_printer_add),
                           NULL);
+        g_signal_connect (mechanism,
+                          "handle-printers-add-many",
+                          G_CALLBACK (cph_mechanism_printers_add_many),
+                          NULL);
         g_signal_connect (mechanism,
                           "handle-printer-add-option",
                           G_CALLBACK (cph_mechanism_printer_add_option),
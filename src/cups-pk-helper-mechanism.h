@@ -79,6 +79,11 @@ gboolean       cph_mechanism_register    (CphMechanism     *mechanism,
                                           const char       *object_path,
                                           GError          **error);
 
+gboolean       cph_mechanism_is_busy     (CphMechanism     *mechanism);
+
+void           cph_mechanism_start_resident_discovery (CphMechanism *mechanism,
+                                                       int           refresh_interval);
+
 G_END_DECLS
 
 #endif /* CPH_MECHANISM_H */
@@ -37,6 +37,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <net/if.h>
 
 #define AVAHI_IF_UNSPEC -1
 #define AVAHI_PROTO_INET 0
@@ -44,6 +45,7 @@
 #define AVAHI_PROTO_UNSPEC -1
 #define AVAHI_BUS "org.freedesktop.Avahi"
 #define AVAHI_SERVER_IFACE "org.freedesktop.Avahi.Server"
+#define AVAHI_SERVER2_IFACE "org.freedesktop.Avahi.Server2"
 #define AVAHI_SERVICE_BROWSER_IFACE "org.freedesktop.Avahi.ServiceBrowser"
 #define AVAHI_SERVICE_RESOLVER_IFACE "org.freedesktop.Avahi.ServiceResolver"
 
@@ -68,6 +70,64 @@
  * restarting cups, so it should be fine */
 #define MAX_RECONNECT_ATTEMPTS 30
 
+/* Where the result of the last complete device discovery is kept, so that the
+ * first DevicesGet after activation can answer without waiting for a scan */
+#define DEVICE_CACHE_DIR       "/var/cache/cups-pk-helper"
+#define DEVICE_CACHE_FILE      DEVICE_CACHE_DIR "/devices.cache"
+/* A snapshot older than this (in seconds) is not worth showing, even as stale
+ * data */
+#define DEVICE_CACHE_MAX_AGE   3600
+
+/* Settings of the administrator; the build system passes the right path */
+#ifndef CPH_CONFIG_FILE
+#define CPH_CONFIG_FILE        "/etc/cups-pk-helper/cups-pk-helper.conf"
+#endif
+/* How many services can be resolved with Avahi at the same time by default */
+#define DEFAULT_MAX_RESOLVER_CALLS 16
+/* How many printer applications can be asked for devices at the same time
+ * by default */
+#define DEFAULT_MAX_APP_QUERIES    8
+
+/* The printer application PrinterAdd uses when none is configured */
+#define DEFAULT_PRINTER_APP_HOST "localhost"
+#define DEFAULT_PRINTER_APP_PORT 8001
+
+/* Connections to printer applications which are not used for this long (in
+ * seconds) get closed */
+#define APP_CONNECTION_IDLE_TIMEOUT    60
+/* How many idle connections are kept for each printer application */
+#define APP_CONNECTION_MAX_IDLE        4
+/* Timeout of requests to printer applications when the caller has no
+ * deadline, in seconds */
+#define APP_CONNECTION_REQUEST_TIMEOUT 30.0
+/* Requests to printer applications wait for an answer in slices of at most
+ * this many seconds, so that they notice when they get cancelled */
+#define APP_CONNECTION_POLL_INTERVAL   1.0
+/* Budget of the methods which talk to printer applications without a
+ * timeout from the caller, in seconds: this is the default timeout of
+ * D-Bus method calls, after which nobody waits for the answer anymore */
+#define APP_OPERATION_TIMEOUT          25
+
+/* How long the driver catalogue of a printer application is used without
+ * asking whether its configuration changed, in seconds */
+#define DRIVER_CATALOGUE_CHECK_INTERVAL 10
+
+/* Printer applications are left out of discovery after failing this many
+ * times in a row */
+#define APP_BREAKER_THRESHOLD    3
+/* and probed again after this long, in seconds; the delay doubles with
+ * each failed probe, up to APP_BREAKER_MAX_COOLDOWN */
+#define APP_BREAKER_COOLDOWN     15
+#define APP_BREAKER_MAX_COOLDOWN 600
+/* Timeout of the probes, in seconds */
+#define APP_PROBE_TIMEOUT        5
+/* Weight of the latest request in the error rate and latency averages */
+#define APP_HEALTH_EWMA_WEIGHT   0.2
+
+/* How long the list of PPDs from cupsd is used before it is fetched again,
+ * in seconds */
+#define PPD_INDEX_MAX_AGE 600
+
 /*
      getPrinters
      getDests
@@ -122,6 +182,23 @@
 */
 typedef void (printer_app_cb)(gpointer cb_data, gpointer user_data);
 
+typedef struct CphDeviceTable CphDeviceTable;
+typedef struct CphResidentDiscovery CphResidentDiscovery;
+typedef struct CphPrinterAppBrowse CphPrinterAppBrowse;
+typedef struct CphDiscoveryManager CphDiscoveryManager;
+typedef struct CphAppConnectionCache CphAppConnectionCache;
+typedef struct CphPrinterApp CphPrinterApp;
+typedef struct CphDriverIndex CphDriverIndex;
+
+/* Work for the pool of threads which talk to printer applications */
+typedef struct
+{
+        /* runs in a thread of the pool */
+        void        (*run)  (gpointer job);
+        /* then runs in the main loop, and frees the job */
+        GSourceFunc   done;
+} CphAppJob;
+
 typedef enum
 {
         CPH_RESOURCE_ROOT,
@@ -135,9 +212,29 @@ G_DEFINE_TYPE (CphCups, cph_cups, G_TYPE_OBJECT)
 
 struct CphCupsPrivate
 {
-        http_t       *connection;
-        ipp_status_t  last_status;
-        char         *internal_status;
+        http_t         *connection;
+        ipp_status_t    last_status;
+        char           *internal_status;
+        CphDeviceTable *device_snapshot;
+        guint           device_refresh_id;
+        CphResidentDiscovery *resident;
+        CphDiscoveryManager  *discovery;
+        int             max_resolver_calls;
+        int             max_app_queries;
+        /* runs the requests to printer applications (CphAppJob); created on
+         * first use */
+        GThreadPool    *app_query_pool;
+        /* Avahi protocol to browse with; AVAHI_PROTO_UNSPEC for both */
+        int             discovery_protocol;
+        /* names of the interfaces to discover on; NULL for all of them */
+        char          **discovery_interfaces;
+        CphAppConnectionCache *app_connections;
+        /* printer applications PrinterAdd can create queues on:
+         * "host:port" -> CphPrinterApp */
+        GHashTable     *printer_apps;
+        /* PPDs cupsd knows, for DriversGet; NULL until it is first needed */
+        CphDriverIndex *ppd_index;
+        gint64          ppd_index_time;
 };
 
 static GObject *cph_cups_constructor (GType                  type,
@@ -148,6 +245,28 @@ static void     cph_cups_finalize    (GObject *object);
 static void     _cph_cups_set_internal_status (CphCups    *cups,
                                                const char *status);
 
+static CphDeviceTable *_cph_device_table_load (const char *filename,
+                                               gint64      max_age);
+static void            _cph_device_table_free (CphDeviceTable *table);
+
+static void _cph_resident_discovery_free (CphResidentDiscovery *resident);
+static void _cph_discovery_manager_free (CphDiscoveryManager *manager);
+
+static CphAppConnectionCache *_cph_app_connection_cache_new  (void);
+static void                   _cph_app_connection_cache_free (CphAppConnectionCache *cache);
+
+static void _cph_cups_load_config (CphCups *cups);
+
+static void _cph_printer_app_free             (CphPrinterApp *app);
+static void _cph_app_registry_load_config     (CphCups       *cups,
+                                               GKeyFile      *keyfile);
+static void _cph_app_registry_add_default     (CphCups       *cups);
+
+static void _cph_driver_index_free (CphDriverIndex *index);
+
+static void _cph_app_job_push (CphCups   *cups,
+                               CphAppJob *job);
+
 
 static void
 cph_cups_class_init (CphCupsClass *klass)
@@ -185,6 +304,12 @@ cph_cups_constructor (GType                  type,
                 return NULL;
         }
 
+        cups->priv->device_snapshot = _cph_device_table_load (DEVICE_CACHE_FILE,
+                                                              DEVICE_CACHE_MAX_AGE);
+
+        _cph_cups_load_config (cups);
+        _cph_app_registry_add_default (cups);
+
         return obj;
 }
 
@@ -196,6 +321,21 @@ cph_cups_init (CphCups *cups)
         cups->priv->connection = NULL;
         cups->priv->last_status = IPP_OK;
         cups->priv->internal_status = NULL;
+        cups->priv->device_snapshot = NULL;
+        cups->priv->device_refresh_id = 0;
+        cups->priv->resident = NULL;
+        cups->priv->discovery = NULL;
+        cups->priv->max_resolver_calls = DEFAULT_MAX_RESOLVER_CALLS;
+        cups->priv->max_app_queries = DEFAULT_MAX_APP_QUERIES;
+        cups->priv->app_query_pool = NULL;
+        cups->priv->discovery_protocol = AVAHI_PROTO_UNSPEC;
+        cups->priv->discovery_interfaces = NULL;
+        cups->priv->app_connections = _cph_app_connection_cache_new ();
+        cups->priv->printer_apps = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                          g_free,
+                                                          (GDestroyNotify) _cph_printer_app_free);
+        cups->priv->ppd_index = NULL;
+        cups->priv->ppd_index_time = 0;
 }
 
 static gboolean
@@ -235,6 +375,42 @@ cph_cups_finalize (GObject *object)
                 g_free (cups->priv->internal_status);
         cups->priv->internal_status = NULL;
 
+        if (cups->priv->device_refresh_id)
+                g_source_remove (cups->priv->device_refresh_id);
+        cups->priv->device_refresh_id = 0;
+
+        if (cups->priv->device_snapshot)
+                _cph_device_table_free (cups->priv->device_snapshot);
+        cups->priv->device_snapshot = NULL;
+
+        if (cups->priv->resident)
+                _cph_resident_discovery_free (cups->priv->resident);
+        cups->priv->resident = NULL;
+
+        if (cups->priv->discovery)
+                _cph_discovery_manager_free (cups->priv->discovery);
+        cups->priv->discovery = NULL;
+
+        g_strfreev (cups->priv->discovery_interfaces);
+        cups->priv->discovery_interfaces = NULL;
+
+        /* the queries hold a reference on cups: none is left */
+        if (cups->priv->app_query_pool)
+                g_thread_pool_free (cups->priv->app_query_pool, FALSE, TRUE);
+        cups->priv->app_query_pool = NULL;
+
+        if (cups->priv->app_connections)
+                _cph_app_connection_cache_free (cups->priv->app_connections);
+        cups->priv->app_connections = NULL;
+
+        if (cups->priv->printer_apps)
+                g_hash_table_destroy (cups->priv->printer_apps);
+        cups->priv->printer_apps = NULL;
+
+        if (cups->priv->ppd_index)
+                _cph_driver_index_free (cups->priv->ppd_index);
+        cups->priv->ppd_index = NULL;
+
         G_OBJECT_CLASS (cph_cups_parent_class)->finalize (object);
 }
 
@@ -244,6 +420,141 @@ cph_cups_new (void)
         return g_object_new (CPH_TYPE_CUPS, NULL);
 }
 
+/******************************************************
+ * Configuration
+ ******************************************************/
+
+/* Reads a positive integer from the configuration; value is left untouched
+ * if the key is missing or invalid. */
+static void
+_cph_cups_config_get_positive (GKeyFile   *keyfile,
+                               const char *group,
+                               const char *key,
+                               int        *value)
+{
+        GError *error = NULL;
+        int     result;
+
+        result = g_key_file_get_integer (keyfile, group, key, &error);
+
+        if (error) {
+                if (!g_error_matches (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND) &&
+                    !g_error_matches (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND))
+                        g_warning ("Invalid value for %s in [%s] of %s: %s",
+                                   key, group, CPH_CONFIG_FILE, error->message);
+                g_error_free (error);
+                return;
+        }
+
+        if (result <= 0) {
+                g_warning ("Invalid value for %s in [%s] of %s: must be positive",
+                           key, group, CPH_CONFIG_FILE);
+                return;
+        }
+
+        *value = result;
+}
+
+/* Reads the protocol of the services to discover: "any", "ipv4" or
+ * "ipv6". */
+static void
+_cph_cups_config_get_protocol (GKeyFile   *keyfile,
+                               const char *group,
+                               const char *key,
+                               int        *protocol)
+{
+        char *value;
+
+        value = g_key_file_get_string (keyfile, group, key, NULL);
+        if (value == NULL)
+                return;
+
+        g_strstrip (value);
+
+        if (g_ascii_strcasecmp (value, "any") == 0)
+                *protocol = AVAHI_PROTO_UNSPEC;
+        else if (g_ascii_strcasecmp (value, "ipv4") == 0)
+                *protocol = AVAHI_PROTO_INET;
+        else if (g_ascii_strcasecmp (value, "ipv6") == 0)
+                *protocol = AVAHI_PROTO_INET6;
+        else
+                g_warning ("Invalid value for %s in [%s] of %s: must be any, ipv4 or ipv6",
+                           key, group, CPH_CONFIG_FILE);
+
+        g_free (value);
+}
+
+static void
+_cph_cups_load_config (CphCups *cups)
+{
+        GKeyFile *keyfile;
+        GError   *error = NULL;
+
+        keyfile = g_key_file_new ();
+
+        /* no configuration file simply means default settings */
+        if (!g_key_file_load_from_file (keyfile, CPH_CONFIG_FILE,
+                                        G_KEY_FILE_NONE, &error)) {
+                if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                        g_warning ("Cannot read %s: %s",
+                                   CPH_CONFIG_FILE, error->message);
+                g_error_free (error);
+                g_key_file_free (keyfile);
+                return;
+        }
+
+        _cph_cups_config_get_positive (keyfile, "Discovery", "MaxResolverCalls",
+                                       &cups->priv->max_resolver_calls);
+        _cph_cups_config_get_positive (keyfile, "Discovery", "MaxPrinterAppQueries",
+                                       &cups->priv->max_app_queries);
+        _cph_cups_config_get_protocol (keyfile, "Discovery", "Protocol",
+                                       &cups->priv->discovery_protocol);
+
+        cups->priv->discovery_interfaces = g_key_file_get_string_list (keyfile,
+                                                                       "Discovery",
+                                                                       "Interfaces",
+                                                                       NULL, NULL);
+        if (cups->priv->discovery_interfaces) {
+                int i;
+
+                for (i = 0; cups->priv->discovery_interfaces[i] != NULL; i++)
+                        g_strstrip (cups->priv->discovery_interfaces[i]);
+        }
+        if (cups->priv->discovery_interfaces &&
+            cups->priv->discovery_interfaces[0] == NULL) {
+                g_strfreev (cups->priv->discovery_interfaces);
+                cups->priv->discovery_interfaces = NULL;
+        }
+
+        _cph_app_registry_load_config (cups, keyfile);
+
+        g_key_file_free (keyfile);
+}
+
+/* Whether services seen on interface (an interface index, as reported by
+ * Avahi) are to be discovered. Interfaces are matched by name, since their
+ * index can change when they come and go. */
+static gboolean
+_cph_cups_is_interface_wanted (CphCups *cups,
+                               int      interface)
+{
+        char name[IF_NAMESIZE];
+        int  i;
+
+        if (cups->priv->discovery_interfaces == NULL)
+                return TRUE;
+
+        if (interface < 0 || if_indextoname (interface, name) == NULL)
+                return FALSE;
+
+        for (i = 0; cups->priv->discovery_interfaces[i] != NULL; i++) {
+                if (g_strcmp0 (cups->priv->discovery_interfaces[i], name) == 0)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
 /******************************************************
  * Validation
  ******************************************************/
@@ -498,6 +809,8 @@ _CPH_CUPS_IS_VALID (option_value, "value for option", FALSE, FALSE, CPH_STR_MAXL
 _CPH_CUPS_IS_VALID (info, "description", FALSE, TRUE, CPH_STR_MAXLEN)
 _CPH_CUPS_IS_VALID (location, "location", FALSE, TRUE, CPH_STR_MAXLEN)
 _CPH_CUPS_IS_VALID (reject_jobs_reason, "reason", FALSE, TRUE, CPH_STR_MAXLEN)
+/* device IDs with a long list of command sets do not fit in CPH_STR_MAXLEN */
+_CPH_CUPS_IS_VALID (device_id, "device ID", TRUE, FALSE, 2 * CPH_STR_MAXLEN)
 _CPH_CUPS_IS_VALID (job_hold_until, "job hold until", FALSE, FALSE, CPH_STR_MAXLEN)
 
 /* For put/get file: this is some text, but we could potentially do more
@@ -1177,6 +1490,89 @@ cph_cups_is_printer_local (CphCups    *cups,
         return retval;
 }
 
+/* Same as cph_cups_is_printer_local() for each of printer_names, with one
+ * request to cupsd for all of them. */
+gboolean
+cph_cups_printers_are_local (CphCups           *cups,
+                             const char *const *printer_names)
+{
+        const char * const  attrs[2] = { "printer-name", "device-uri" };
+        ipp_t              *request;
+        ipp_t              *reply;
+        ipp_attribute_t    *attr;
+        GHashTable         *uris;
+        gboolean            retval = TRUE;
+        int                 i;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+
+        request = ippNewRequest (CUPS_GET_PRINTERS);
+        _cph_cups_add_requesting_user_name (request, NULL);
+        ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                       "requested-attributes", G_N_ELEMENTS (attrs), NULL, attrs);
+
+        reply = cupsDoRequest (cups->priv->connection, request, "/");
+
+        if (!reply || ippGetStatusCode (reply) > IPP_OK_CONFLICT) {
+                /* there is no printer at all, or the list cannot be had */
+                if (reply)
+                        ippDelete (reply);
+
+                for (i = 0; printer_names[i] != NULL && retval; i++)
+                        retval = cph_cups_is_printer_local (cups, printer_names[i]);
+
+                return retval;
+        }
+
+        /* printer name, in lower case since cupsd ignores the case of
+         * names -> device URI */
+        uris = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+        attr = ippFirstAttribute (reply);
+        while (attr) {
+                const char *name = NULL;
+                const char *uri = NULL;
+
+                while (attr && ippGetGroupTag (attr) != IPP_TAG_PRINTER)
+                        attr = ippNextAttribute (reply);
+
+                while (attr && ippGetGroupTag (attr) == IPP_TAG_PRINTER) {
+                        if (g_strcmp0 (ippGetName (attr), "printer-name") == 0)
+                                name = ippGetString (attr, 0, NULL);
+                        else if (g_strcmp0 (ippGetName (attr), "device-uri") == 0)
+                                uri = ippGetString (attr, 0, NULL);
+
+                        attr = ippNextAttribute (reply);
+                }
+
+                if (name && uri)
+                        g_hash_table_insert (uris, g_ascii_strdown (name, -1),
+                                             (gpointer) uri);
+        }
+
+        for (i = 0; printer_names[i] != NULL && retval; i++) {
+                const char *uri;
+                char       *name;
+
+                if (!_cph_cups_is_printer_name_valid (cups, printer_names[i])) {
+                        retval = FALSE;
+                        break;
+                }
+
+                /* printers which do not exist yet are local */
+                name = g_ascii_strdown (printer_names[i], -1);
+                uri = g_hash_table_lookup (uris, name);
+                g_free (name);
+                if (uri)
+                        retval = cph_cups_is_printer_uri_local (uri);
+        }
+
+        g_hash_table_destroy (uris);
+        ippDelete (reply);
+
+        return retval;
+}
+
 gboolean
 cph_cups_file_get (CphCups      *cups,
                    const char   *resource,
@@ -1445,356 +1841,4149 @@ cph_cups_server_set_settings (CphCups  *cups,
         return TRUE;
 }
 
-typedef struct {
-        int              iter;
-        int              limit;
-        GVariantBuilder *builder;
-} CphCupsGetDevices;
-
-typedef struct {
-        int              iter;
-        GVariantBuilder *builder;
-} CphCupsGetPrinterApps;
-
-static void
-_cph_cups_get_devices_cb (const char *device_class,
-                          const char *device_id,
-                          const char *device_info,
-                          const char *device_make_and_model,
-                          const char *device_uri,
-                          const char *device_location,
-                          void       *user_data)
-{
-        CphCupsGetDevices *data = user_data;
-        char              *key;
+/* The services the dnssd backend of CUPS looks for, in the order it
+ * prefers them when a printer announces several. */
+static const char *const printer_service_types[] = {
+        "_ipps._tcp",
+        "_ipp._tcp",
+        "_printer._tcp",
+        "_pdl-datastream._tcp",
+        NULL
+};
 
-        g_return_if_fail (data != NULL);
+/******************************************************
+ * Device table
+ ******************************************************/
 
-        if (data->limit > 0 && data->iter >= data->limit)
-                return;
+/* The same physical printer is usually reported several times: by the dnssd
+ * backend of cups, by our own Avahi browsing and by the printer applications
+ * (FIND_DEVICES), each time with a different URI. We collapse these reports
+ * into one record per device, keeping the other URIs as alternatives.
+ *
+ * A record is identified by several keys, and two reports are the same device
+ * as soon as they share one key:
+ *   + "uri:"  the URI itself;
+ *   + "id:"   MFG, MDL and SN of the IEEE-1284 device ID (only when there is
+ *             a serial number, since there are many printers of one model);
+ *   + "uuid:" the printer UUID (from the URI or from the TXT record);
+ *   + "dnssd:" name and domain of dnssd URIs, so that the services of
+ *              one printer (_ipps, _ipp, _printer...) match, like the
+ *              dnssd backend reports one device per name and domain;
+ *   + "addr:" host, port and resource of network URIs, so that ipp and ipps
+ *             URIs of one printer match, but different queues of one server
+ *             do not. */
 
-        if (device_class && device_class[0] != '\0') {
-                key  = g_strdup_printf ("device-class:%d", data->iter);
-                g_variant_builder_add (data->builder, "{ss}",
-                                       key, device_class);
-                g_free (key);
-        }
-        if (device_id && device_id[0] != '\0') {
-                key  = g_strdup_printf ("device-id:%d", data->iter);
-                g_variant_builder_add (data->builder, "{ss}",
-                                       key, device_id);
-                g_free (key);
-        }
-        if (device_info && device_info[0] != '\0') {
-                key  = g_strdup_printf ("device-info:%d", data->iter);
-                g_variant_builder_add (data->builder, "{ss}",
-                                       key, device_info);
-                g_free (key);
-        }
-        if (device_make_and_model && device_make_and_model[0] != '\0') {
-                key  = g_strdup_printf ("device-make-and-model:%d", data->iter);
-                g_variant_builder_add (data->builder, "{ss}",
-                                       key, device_make_and_model);
-                g_free (key);
-        }
-        if (device_uri && device_uri[0] != '\0') {
-                key  = g_strdup_printf ("device-uri:%d", data->iter);
-                g_variant_builder_add (data->builder, "{ss}",
-                                       key, device_uri);
-                g_free (key);
-        }
-        if (device_location && device_location[0] != '\0') {
-                key  = g_strdup_printf ("device-location:%d", data->iter);
-                g_variant_builder_add (data->builder, "{ss}",
-                                       key, device_location);
-                g_free (key);
-        }
-        data->iter++;
-}
+typedef enum
+{
+        CPH_DEVICE_SOURCE_CUPS        = 1 << 0,
+        CPH_DEVICE_SOURCE_AVAHI       = 1 << 1,
+        CPH_DEVICE_SOURCE_PRINTER_APP = 1 << 2
+} CphDeviceSource;
 
 typedef struct
 {
+        char      *device_class;
+        char      *device_id;
+        char      *device_info;
+        char      *device_make_and_model;
+        char      *device_uri;
+        char      *device_location;
+        GPtrArray *alt_uris;
+        /* wall-clock time, in seconds, of the last report */
+        gint64     last_seen;
+        /* CphDeviceSource flags of the reports */
+        guint      sources;
+} CphDevice;
+
+struct CphDeviceTable
+{
+        GPtrArray  *devices;
+        GHashTable *index;
+        int         limit;
+};
 
-	ipp_t *response;
-	gchar *buff;
-	int buff_size;
-        cups_dest_t* service;
-
-} add_attribute_data;
-
-typedef struct 
+static void
+_cph_device_free (CphDevice *device)
 {
-        char                *avahi_service_browser_path;
-        guint                avahi_service_browser_subscription_id;
-        guint                avahi_service_browser_subscription_id_ind;           
-        guint                unsubscribe_general_subscription_id;
-        GDBusConnection     *dbus_connection;
-        GCancellable        *avahi_cancellable;
-        GList               *system_objects;
-        GMainLoop           *loop;
-        gpointer             user_data;
-        char                *service_type;
-        CphCups             *cups;
-        printer_app_cb      *callback;
-        void                *data;
-        gboolean             done;
-} Avahi;
+        g_free (device->device_class);
+        g_free (device->device_id);
+        g_free (device->device_info);
+        g_free (device->device_make_and_model);
+        g_free (device->device_uri);
+        g_free (device->device_location);
+        g_ptr_array_free (device->alt_uris, TRUE);
+        g_free (device);
+}
 
-typedef struct
+static void
+_cph_device_table_init (CphDeviceTable *table,
+                        int             limit)
 {
-        GList                *services;
-        gchar                *location;
-        gchar                *address;
-        gchar                *hostname;
-        gchar                *name;
-        gchar                *resource_path;
-        gchar                *type;
-        gchar                *domain;
-        gchar                *UUID;
-        gchar                *object_type;
-        gchar                *admin_url;
-        gchar                *uri;
-        gchar                *objAttr;
-        gint64               printer_type,
-                             printer_state;
-        gboolean             got_printer_state,
-                             got_printer_type;
-        int                  port;
-        int                  family;
-        gpointer             user_data;
-} AvahiData;
+        table->devices = g_ptr_array_new_with_free_func ((GDestroyNotify) _cph_device_free);
+        table->index = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+        table->limit = limit;
+}
 
-typedef struct
+static void
+_cph_device_table_clear (CphDeviceTable *table)
 {
-        CphCupsGetDevices *data;
-        gint              signal_pappl;      
+        g_hash_table_destroy (table->index);
+        table->index = NULL;
+        g_ptr_array_free (table->devices, TRUE);
+        table->devices = NULL;
 }
-pappl_data_callback;
 
-int
-pappl_timeout_cb (gpointer      user_data)
+static CphDeviceTable *
+_cph_device_table_new (int limit)
 {
-        ((pappl_data_callback*)(user_data))->signal_pappl = 1;
+        CphDeviceTable *table;
 
-        return 0;
+        table = g_new0 (CphDeviceTable, 1);
+        _cph_device_table_init (table, limit);
+
+        return table;
 }
 
-int compare_services (gconstpointer      data1,
-                      gconstpointer      data2)
+static void
+_cph_device_table_free (CphDeviceTable *table)
 {
-        AvahiData *data_1 = (AvahiData*)data1;
-        AvahiData *data_2 = (AvahiData*)data2;
-        
-        return g_strcmp0 (data_1->name,data_2->name);
+        _cph_device_table_clear (table);
+        g_free (table);
 }
 
-static gboolean
-avahi_txt_get_key_value_pair (const gchar  *entry,
-                              gchar       **key,
-                              gchar       **value)
+/* Lower-case the string, strip it and collapse internal whitespace, so that
+ * "HP  LaserJet " and "hp laserjet" give the same key. */
+static void
+_cph_device_key_append_normalized (GString    *key,
+                                   const char *value,
+                                   gssize      len)
 {
-  const gchar *equal_sign;
+        gboolean space = FALSE;
+        gsize    start = key->len;
+        gssize   i;
 
-  *key = NULL;
-  *value = NULL;
+        if (len < 0)
+                len = strlen (value);
 
-  if (entry != NULL)
-    {
-      equal_sign = strstr (entry, "=");
+        for (i = 0; i < len; i++) {
+                if (g_ascii_isspace (value[i])) {
+                        space = key->len > start;
+                        continue;
+                }
 
-      if (equal_sign != NULL)
-        {
-          *key = g_strndup (entry, equal_sign - entry);
-          *value = g_strdup (equal_sign + 1);
+                if (space)
+                        g_string_append_c (key, ' ');
+                space = FALSE;
 
-          return TRUE;
+                g_string_append_c (key, g_ascii_tolower (value[i]));
         }
-    }
-
-  return FALSE;
 }
 
-static void
-avahi_service_resolver_cb (GVariant*     output,
-                           gpointer      user_data)
+/* Find the value of a key of an IEEE-1284 device ID, like "MFG:HP;MDL:...;".
+ * Keys are case-insensitive. Returns the start of the value and sets len. */
+static const char *
+_cph_device_id_get_field (const char *device_id,
+                          const char *field,
+                          const char *alt_field,
+                          gsize      *len)
 {
-        AvahiData               *data;
-        Avahi                   *backend;
-        const char              *name;
-        const char              *hostname;
-        const char              *type;
-        const char              *domain;
-        const char              *address;
-        char                    *key;
-        char                    *value;
-        char                    *tmp;
-        char                    *endptr;
-        GVariant                *txt,
-                                *child;
-        guint32                  flags;
-        guint16                  port;
-        GError                  *error = NULL;
-        GList                   *iter;
-        gsize                    length; 
-        int                      interface;
-        int                      protocol;
-        int                      aprotocol;
-        int                      i;
+        const char *p;
 
+        if (!device_id)
+                return NULL;
 
-        backend = user_data;
-        if (output)
-        {
+        p = device_id;
+        while (*p != '\0') {
+                const char *colon;
+                const char *end;
+                gsize       key_len;
 
-                g_variant_get (output, "(ii&s&s&s&si&sq@aayu)",
-                               &interface,
-                               &protocol,
-                               &name,
-                               &type,
-                               &domain,
-                               &hostname,
-                               &aprotocol,
-                               &address,
-                               &port,
-                               &txt,
-                               &flags);
-
-                data = g_new0 (AvahiData, 1);
-                data->user_data = backend->user_data;
-                
-                if (g_strcmp0 (type, "_ipps-system._tcp") == 0 ||
-                    g_strcmp0 (type, "_ipp-system._tcp") == 0)
-                  {
-                       data->object_type = g_strdup("SYSTEM_OBJECT");
-                  } 
-                else
-                  {
-                      data->object_type = g_strdup("PRINTER_OBJECT");
-                  }
+                while (*p == ';' || g_ascii_isspace (*p))
+                        p++;
 
-            for (i = 0; i < g_variant_n_children (txt); i++)
-            {
-              child = g_variant_get_child_value (txt, i);
-
-              length = g_variant_get_size (child);
-              if (length > 0)
-                {
-                  tmp = g_strndup (g_variant_get_data (child), length);
-                  g_variant_unref (child);
-
-                  if (!avahi_txt_get_key_value_pair (tmp, &key, &value))
-                    {
-                      g_free (tmp);
-                      continue;
-                    }
-
-                  if (g_strcmp0 (key, "rp") == 0)
-                    {
-                      data->resource_path = g_strdup (value);
-                    }
-                  else if (g_strcmp0 (key, "note") == 0)
-                    {
-                      data->location = g_strdup (value);
-                    }
-                  else if (g_strcmp0 (key, "printer-type") == 0)
-                    {
-                      endptr = NULL;
-                      data->printer_type = g_ascii_strtoull (value, &endptr, 16);
-                      if (data->printer_type != 0 || endptr != value)
-                        data->got_printer_type = TRUE;
-                    }
-                  else if (g_strcmp0 (key, "printer-state") == 0)
-                    {
-                      endptr = NULL;
-                      data->printer_state = g_ascii_strtoull (value, &endptr, 10);
-                      if (data->printer_state != 0 || endptr != value)
-                        data->got_printer_state = TRUE;
-                    }
-                  else if (g_strcmp0 (key, "UUID") == 0)
-                    {
-                      if (*value != '\0')
-                        data->UUID = g_strdup (value);
-                    }
-                  else if (g_strcmp0 (key, "adminurl") == 0)
-                    {
-                      if (*value != '\0')
-                        data->admin_url = g_strdup (value);
-                    }
-                  g_clear_pointer (&key, g_free);
-                  g_clear_pointer (&value, g_free);
-                  g_free (tmp);
-                }
-              else
-                {
-                  g_variant_unref (child);
-                }
-            }
-
-                data->address = g_strdup (address);
-                data->hostname = g_strdup (hostname);
-                data->port = port;
-                data->family = protocol;
-                data->name = g_strdup (name);
-                data->type = g_strdup (type);
-                data->domain = g_strdup (domain);
-                data->services = NULL;
-                
-                g_variant_unref (txt);
-                g_variant_unref (output);
+                colon = strchr (p, ':');
+                if (!colon)
+                        break;
 
-                iter = g_list_find_custom (backend->system_objects, (gconstpointer) data, (GCompareFunc) compare_services);
-                if (iter == NULL)
-                  {
-                     backend->system_objects = g_list_append (backend->system_objects, data);
-                    //  if (g_strcmp0(data->object_type, "SYSTEM_OBJECT") == 0)
-                    //   get_services (data);
-                    //  else    Check new method for getting device from IPP request
-                //       add_device (data);    // Callbacks
-                        backend->callback (data, backend);
-                        g_message("%s\n", data->hostname);
+                end = strchr (colon + 1, ';');
+                if (!end)
+                        end = colon + 1 + strlen (colon + 1);
+
+                key_len = colon - p;
+                if ((strlen (field) == key_len &&
+                     g_ascii_strncasecmp (p, field, key_len) == 0) ||
+                    (alt_field && strlen (alt_field) == key_len &&
+                     g_ascii_strncasecmp (p, alt_field, key_len) == 0)) {
+                        *len = end - (colon + 1);
+                        return colon + 1;
+                }
 
-                  }
-                else 
-                 {
-                     g_free (data->location);
-                     g_free (data->address);
-                     g_free (data->hostname);
-                     g_free (data->name);
-                     g_free (data->resource_path);
-                     g_free (data->type);
-                     g_free (data->domain);
-                     g_free (data);
-                 }
-         }   
-        else
-         {
-                if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-                  {
-                        char *message = g_strdup_printf ("%s", error->message); 
-                        // _cph_cups_set_internal_status ( backend->cups, message );
-                        g_free (message);
-                  }
-                g_error_free (error);
-         }
+                p = end;
+        }
 
-        return;
+        return NULL;
 }
 
-static gboolean
-unsubscribe_general_subscription_cb (gpointer user_data)
+static char *
+_cph_device_id_key (const char *device_id)
 {
-        Avahi *printer_app_backend = user_data;
+        const char *mfg, *mdl, *sn;
+        gsize       mfg_len, mdl_len, sn_len;
+        GString    *key;
 
-        g_dbus_connection_signal_unsubscribe (printer_app_backend->dbus_connection,
-                                              printer_app_backend->avahi_service_browser_subscription_id);
-        printer_app_backend->avahi_service_browser_subscription_id = 0;
-        printer_app_backend->unsubscribe_general_subscription_id = 0;
+        mfg = _cph_device_id_get_field (device_id, "MFG", "MANUFACTURER", &mfg_len);
+        mdl = _cph_device_id_get_field (device_id, "MDL", "MODEL", &mdl_len);
+        sn = _cph_device_id_get_field (device_id, "SN", "SERIALNUMBER", &sn_len);
 
-        return G_SOURCE_REMOVE;
+        if (!mfg || !mdl || !sn || mfg_len == 0 || mdl_len == 0 || sn_len == 0)
+                return NULL;
+
+        key = g_string_new ("id:");
+        _cph_device_key_append_normalized (key, mfg, mfg_len);
+        g_string_append_c (key, ';');
+        _cph_device_key_append_normalized (key, mdl, mdl_len);
+        g_string_append_c (key, ';');
+        _cph_device_key_append_normalized (key, sn, sn_len);
+
+        return g_string_free (key, FALSE);
 }
 
-static void
-avahi_service_browser_signal_handler (GDBusConnection *connection,
+static char *
+_cph_device_uuid_key (const char *uuid)
+{
+        GString *key;
+
+        if (!uuid || uuid[0] == '\0')
+                return NULL;
+
+        if (g_ascii_strncasecmp (uuid, "urn:uuid:", 9) == 0)
+                uuid += 9;
+
+        if (uuid[0] == '\0')
+                return NULL;
+
+        key = g_string_new ("uuid:");
+        _cph_device_key_append_normalized (key, uuid, -1);
+
+        return g_string_free (key, FALSE);
+}
+
+/* Splits the host of a dnssd URI, "name._ipp._tcp.domain", into its
+ * service name, service type and domain. Returns FALSE if host is not a
+ * service. */
+static gboolean
+_cph_dnssd_host_split (const char  *host,
+                       gsize       *name_len,
+                       const char **type,
+                       gsize       *type_len,
+                       const char **domain)
+{
+        const char *proto;
+        const char *p;
+
+        proto = g_strrstr (host, "._tcp.");
+        if (!proto)
+                proto = g_strrstr (host, "._udp.");
+        if (!proto)
+                return FALSE;
+
+        /* the name can have dots, the service type does not */
+        for (p = proto - 1; p > host; p--) {
+                if (p[0] == '.' && p[1] == '_')
+                        break;
+        }
+        if (p <= host)
+                return FALSE;
+
+        *name_len = p - host;
+        *type = p + 1;
+        *type_len = proto + strlen ("._tcp") - *type;
+        *domain = proto + strlen ("._tcp.");
+
+        return TRUE;
+}
+
+/* Rank of the service type of a dnssd URI, lower is better: the dnssd
+ * backend reports a printer with the first of printer_service_types it
+ * announces. */
+static guint
+_cph_dnssd_uri_rank (const char *uri)
+{
+        char        scheme[HTTP_MAX_URI];
+        char        username[HTTP_MAX_URI];
+        char        host[HTTP_MAX_URI];
+        char        resource[HTTP_MAX_URI];
+        const char *type;
+        const char *domain;
+        gsize       name_len;
+        gsize       type_len;
+        int         port;
+        guint       i;
+
+        if (!uri ||
+            httpSeparateURI (HTTP_URI_CODING_ALL, uri,
+                             scheme, sizeof (scheme),
+                             username, sizeof (username),
+                             host, sizeof (host),
+                             &port,
+                             resource, sizeof (resource)) < HTTP_URI_STATUS_OK ||
+            g_ascii_strcasecmp (scheme, "dnssd") != 0 ||
+            !_cph_dnssd_host_split (host, &name_len, &type, &type_len, &domain))
+                return G_MAXUINT;
+
+        for (i = 0; printer_service_types[i] != NULL; i++) {
+                if (strlen (printer_service_types[i]) == type_len &&
+                    g_ascii_strncasecmp (printer_service_types[i], type, type_len) == 0)
+                        return i;
+        }
+
+        return G_MAXUINT;
+}
+
+/* Adds the keys derived from the URI: the URI itself, the uuid given in the
+ * query and the service name (dnssd URIs), and the network address. */
+static void
+_cph_device_uri_keys (const char *uri,
+                      GPtrArray  *keys)
+{
+        char        scheme[HTTP_MAX_URI];
+        char        username[HTTP_MAX_URI];
+        char        host[HTTP_MAX_URI];
+        char        resource[HTTP_MAX_URI];
+        int         port;
+        const char *uuid;
+        char       *query;
+        char       *lower_host;
+        gsize       len;
+
+        if (!uri || uri[0] == '\0')
+                return;
+
+        g_ptr_array_add (keys, g_strdup_printf ("uri:%s", uri));
+
+        if (httpSeparateURI (HTTP_URI_CODING_ALL, uri,
+                             scheme, sizeof (scheme),
+                             username, sizeof (username),
+                             host, sizeof (host),
+                             &port,
+                             resource, sizeof (resource)) < HTTP_URI_STATUS_OK)
+                return;
+
+        uuid = strstr (resource, "uuid=");
+        if (uuid) {
+                uuid += strlen ("uuid=");
+                len = strcspn (uuid, "&");
+                if (len > 0) {
+                        char *value = g_strndup (uuid, len);
+                        char *key = _cph_device_uuid_key (value);
+
+                        if (key)
+                                g_ptr_array_add (keys, key);
+                        g_free (value);
+                }
+        }
+
+        /* dnssd URIs carry a service name, not a host */
+        if (g_ascii_strcasecmp (scheme, "dnssd") == 0) {
+                const char *type;
+                const char *domain;
+                gsize       name_len;
+                gsize       type_len;
+
+                if (_cph_dnssd_host_split (host, &name_len, &type, &type_len, &domain)) {
+                        GString *key = g_string_new ("dnssd:");
+
+                        /* "local." and "local" are the same domain */
+                        len = strlen (domain);
+                        while (len > 0 && domain[len - 1] == '.')
+                                len--;
+
+                        _cph_device_key_append_normalized (key, host, name_len);
+                        g_string_append_c (key, '.');
+                        _cph_device_key_append_normalized (key, domain, len);
+                        g_ptr_array_add (keys, g_string_free (key, FALSE));
+                }
+                return;
+        }
+
+        if (host[0] == '\0' || port <= 0)
+                return;
+
+        query = strchr (resource, '?');
+        if (query)
+                *query = '\0';
+        len = strlen (resource);
+        while (len > 1 && resource[len - 1] == '/')
+                resource[--len] = '\0';
+
+        len = strlen (host);
+        while (len > 0 && host[len - 1] == '.')
+                host[--len] = '\0';
+
+        lower_host = g_ascii_strdown (host, -1);
+        g_ptr_array_add (keys,
+                         g_strdup_printf ("addr:%s:%d%s",
+                                          lower_host, port,
+                                          resource[0] == '/' ? resource : "/"));
+        g_free (lower_host);
+}
+
+static void
+_cph_device_merge_field (char       **field,
+                         const char  *value)
+{
+        if ((*field == NULL || (*field)[0] == '\0') &&
+            value && value[0] != '\0') {
+                g_free (*field);
+                *field = g_strdup (value);
+        }
+}
+
+static gboolean
+_cph_device_has_uri (CphDevice  *device,
+                     const char *uri)
+{
+        guint i;
+
+        if (g_strcmp0 (device->device_uri, uri) == 0)
+                return TRUE;
+
+        for (i = 0; i < device->alt_uris->len; i++) {
+                if (g_strcmp0 (g_ptr_array_index (device->alt_uris, i), uri) == 0)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+/* Moves the URIs, fields and sources of other into device. */
+static void
+_cph_device_fold (CphDevice *device,
+                  CphDevice *other)
+{
+        guint i;
+
+        if (other->device_uri && other->device_uri[0] != '\0' &&
+            !_cph_device_has_uri (device, other->device_uri))
+                g_ptr_array_add (device->alt_uris, g_strdup (other->device_uri));
+
+        for (i = 0; i < other->alt_uris->len; i++) {
+                const char *uri = g_ptr_array_index (other->alt_uris, i);
+
+                if (!_cph_device_has_uri (device, uri))
+                        g_ptr_array_add (device->alt_uris, g_strdup (uri));
+        }
+
+        _cph_device_merge_field (&device->device_class, other->device_class);
+        _cph_device_merge_field (&device->device_id, other->device_id);
+        _cph_device_merge_field (&device->device_info, other->device_info);
+        _cph_device_merge_field (&device->device_make_and_model, other->device_make_and_model);
+        _cph_device_merge_field (&device->device_location, other->device_location);
+
+        device->sources |= other->sources;
+        device->last_seen = MAX (device->last_seen, other->last_seen);
+}
+
+/* When the URI of device is a dnssd one, makes it the service the dnssd
+ * backend would report among the ones device has, the others staying
+ * alternatives. A URI from a printer application or another backend is
+ * kept. */
+static void
+_cph_device_prefer_service (CphDevice *device)
+{
+        guint rank;
+        guint best = G_MAXUINT;
+        guint i;
+
+        rank = _cph_dnssd_uri_rank (device->device_uri);
+        if (rank == G_MAXUINT)
+                return;
+
+        for (i = 0; i < device->alt_uris->len; i++) {
+                guint alt_rank = _cph_dnssd_uri_rank (g_ptr_array_index (device->alt_uris, i));
+
+                if (alt_rank < rank) {
+                        rank = alt_rank;
+                        best = i;
+                }
+        }
+
+        if (best != G_MAXUINT) {
+                char *uri = g_ptr_array_index (device->alt_uris, best);
+
+                device->alt_uris->pdata[best] = device->device_uri;
+                device->device_uri = uri;
+        }
+}
+
+/* Folds other, a record of the table, into device, and drops it: its keys
+ * then lead to device. */
+static void
+_cph_device_table_absorb (CphDeviceTable *table,
+                          CphDevice      *device,
+                          CphDevice      *other)
+{
+        GHashTableIter iter;
+        gpointer       value;
+
+        _cph_device_fold (device, other);
+
+        g_hash_table_iter_init (&iter, table->index);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                if (value == other)
+                        g_hash_table_iter_replace (&iter, device);
+        }
+
+        g_ptr_array_remove (table->devices, other);
+}
+
+static void
+_cph_device_table_link_keys (CphDeviceTable *table,
+                             CphDevice      *device,
+                             GPtrArray      *keys)
+{
+        guint i;
+
+        for (i = 0; i < keys->len; i++) {
+                const char *key = g_ptr_array_index (keys, i);
+
+                if (!g_hash_table_contains (table->index, key))
+                        g_hash_table_insert (table->index, g_strdup (key), device);
+        }
+}
+
+/* Merges a device record into the table: if any of its keys is known already,
+ * the fields, URIs and sources are merged into the existing record, otherwise
+ * a copy of the record is added. When the keys lead to several records, the
+ * report shows they are one device, and they are merged into the first.
+ * uuid is an additional UUID known for the device (from a TXT record, for
+ * example) and can be NULL. Returns the record in the table, or NULL if the
+ * device was dropped because the table is full. */
+static CphDevice *
+_cph_device_table_merge (CphDeviceTable *table,
+                         CphDevice      *report,
+                         const char     *uuid)
+{
+        CphDevice *device;
+        CphDevice *other;
+        GPtrArray *keys;
+        char      *key;
+        guint      i;
+
+        keys = g_ptr_array_new_with_free_func (g_free);
+
+        _cph_device_uri_keys (report->device_uri, keys);
+        for (i = 0; i < report->alt_uris->len; i++)
+                _cph_device_uri_keys (g_ptr_array_index (report->alt_uris, i), keys);
+        key = _cph_device_id_key (report->device_id);
+        if (key)
+                g_ptr_array_add (keys, key);
+        key = _cph_device_uuid_key (uuid);
+        if (key)
+                g_ptr_array_add (keys, key);
+
+        device = NULL;
+        for (i = 0; i < keys->len; i++) {
+                other = g_hash_table_lookup (table->index,
+                                             g_ptr_array_index (keys, i));
+                if (other == NULL || other == device)
+                        continue;
+
+                if (device == NULL)
+                        device = other;
+                else
+                        _cph_device_table_absorb (table, device, other);
+        }
+
+        if (device == NULL) {
+                if (table->limit > 0 && (int) table->devices->len >= table->limit) {
+                        g_ptr_array_free (keys, TRUE);
+                        return NULL;
+                }
+
+                device = g_new0 (CphDevice, 1);
+                device->device_uri = g_strdup (report->device_uri);
+                device->alt_uris = g_ptr_array_new_with_free_func (g_free);
+                g_ptr_array_add (table->devices, device);
+        }
+
+        _cph_device_fold (device, report);
+        _cph_device_prefer_service (device);
+
+        /* a report can link keys that were seen separately until now */
+        _cph_device_table_link_keys (table, device, keys);
+
+        g_ptr_array_free (keys, TRUE);
+
+        return device;
+}
+
+/* Adds one report of a device to the table; source tells who reported the
+ * device. See _cph_device_table_merge(). */
+static CphDevice *
+_cph_device_table_add (CphDeviceTable *table,
+                       CphDeviceSource source,
+                       const char     *device_class,
+                       const char     *device_id,
+                       const char     *device_info,
+                       const char     *device_make_and_model,
+                       const char     *device_uri,
+                       const char     *device_location,
+                       const char     *uuid)
+{
+        CphDevice  report;
+        CphDevice *device;
+
+        memset (&report, 0, sizeof (report));
+        report.device_class = (char *) device_class;
+        report.device_id = (char *) device_id;
+        report.device_info = (char *) device_info;
+        report.device_make_and_model = (char *) device_make_and_model;
+        report.device_uri = (char *) device_uri;
+        report.device_location = (char *) device_location;
+        report.alt_uris = g_ptr_array_new ();
+        report.last_seen = g_get_real_time () / G_USEC_PER_SEC;
+        report.sources = source;
+
+        device = _cph_device_table_merge (table, &report, uuid);
+
+        g_ptr_array_free (report.alt_uris, TRUE);
+
+        return device;
+}
+
+static void
+_cph_device_builder_add (GVariantBuilder *builder,
+                         const char      *name,
+                         int              index,
+                         const char      *value)
+{
+        char *key;
+
+        if (!value || value[0] == '\0')
+                return;
+
+        key = g_strdup_printf ("%s:%d", name, index);
+        g_variant_builder_add (builder, "{ss}", key, value);
+        g_free (key);
+}
+
+static void
+_cph_device_builder_add_device (GVariantBuilder *builder,
+                                CphDevice       *device,
+                                int              i,
+                                gboolean         stale)
+{
+        GString *sources;
+        char    *value;
+
+        _cph_device_builder_add (builder, "device-class", i,
+                                 device->device_class);
+        _cph_device_builder_add (builder, "device-id", i,
+                                 device->device_id);
+        _cph_device_builder_add (builder, "device-info", i,
+                                 device->device_info);
+        _cph_device_builder_add (builder, "device-make-and-model", i,
+                                 device->device_make_and_model);
+        _cph_device_builder_add (builder, "device-uri", i,
+                                 device->device_uri);
+        _cph_device_builder_add (builder, "device-location", i,
+                                 device->device_location);
+
+        /* URIs cannot contain spaces, so this is unambiguous */
+        if (device->alt_uris->len > 0) {
+                g_ptr_array_add (device->alt_uris, NULL);
+                value = g_strjoinv (" ", (char **) device->alt_uris->pdata);
+                g_ptr_array_remove_index (device->alt_uris,
+                                          device->alt_uris->len - 1);
+
+                _cph_device_builder_add (builder, "device-alt-uris", i, value);
+                g_free (value);
+        }
+
+        sources = g_string_new (NULL);
+        if (device->sources & CPH_DEVICE_SOURCE_CUPS)
+                g_string_append (sources, "cups,");
+        if (device->sources & CPH_DEVICE_SOURCE_AVAHI)
+                g_string_append (sources, "avahi,");
+        if (device->sources & CPH_DEVICE_SOURCE_PRINTER_APP)
+                g_string_append (sources, "printer-app,");
+        if (sources->len > 0)
+                g_string_truncate (sources, sources->len - 1);
+        _cph_device_builder_add (builder, "device-sources", i, sources->str);
+        g_string_free (sources, TRUE);
+
+        value = g_strdup_printf ("%" G_GINT64_FORMAT, device->last_seen);
+        _cph_device_builder_add (builder, "device-last-seen", i, value);
+        g_free (value);
+
+        if (stale)
+                _cph_device_builder_add (builder, "device-stale", i, "true");
+}
+
+static void
+_cph_device_table_build (CphDeviceTable  *table,
+                         GVariantBuilder *builder)
+{
+        guint i;
+
+        for (i = 0; i < table->devices->len; i++)
+                _cph_device_builder_add_device (builder,
+                                                g_ptr_array_index (table->devices, i),
+                                                i, FALSE);
+}
+
+/******************************************************
+ * Device snapshot
+ ******************************************************/
+
+/* The helper exits when idle, so without a snapshot every first DevicesGet
+ * would be a cold scan. The snapshot is a small binary file, in host byte
+ * order (it never leaves the machine):
+ *
+ *   header:  magic (8 bytes), byte order mark (guint32), number of devices
+ *            (guint32), time of the scan (gint64)
+ *   devices: last seen (gint64), sources (guint32), number of alternative
+ *            URIs (guint32), then the class, ID, info, make and model, URI,
+ *            location and alternative URIs as strings
+ *   strings: length (guint32, G_MAXUINT32 for NULL) followed by the bytes,
+ *            without nul terminator
+ */
+
+#define DEVICE_CACHE_MAGIC      "CPHDEVS1"
+#define DEVICE_CACHE_BYTE_ORDER 0x01020304
+
+typedef struct
+{
+        const char *data;
+        gsize       len;
+        gsize       pos;
+} CphDeviceCacheReader;
+
+static gboolean
+_cph_device_cache_read (CphDeviceCacheReader *reader,
+                        gpointer              value,
+                        gsize                 size)
+{
+        if (reader->len - reader->pos < size)
+                return FALSE;
+
+        memcpy (value, reader->data + reader->pos, size);
+        reader->pos += size;
+
+        return TRUE;
+}
+
+static gboolean
+_cph_device_cache_read_string (CphDeviceCacheReader  *reader,
+                               char                 **str)
+{
+        guint32 len;
+
+        *str = NULL;
+
+        if (!_cph_device_cache_read (reader, &len, sizeof (len)))
+                return FALSE;
+
+        if (len == G_MAXUINT32)
+                return TRUE;
+
+        if (reader->len - reader->pos < len)
+                return FALSE;
+
+        /* this ends up on the bus, so it has to be valid */
+        if (!g_utf8_validate (reader->data + reader->pos, len, NULL) ||
+            memchr (reader->data + reader->pos, '\0', len) != NULL)
+                return FALSE;
+
+        *str = g_strndup (reader->data + reader->pos, len);
+        reader->pos += len;
+
+        return TRUE;
+}
+
+static CphDevice *
+_cph_device_cache_read_device (CphDeviceCacheReader *reader)
+{
+        CphDevice *device;
+        guint32    sources;
+        guint32    n_alt_uris;
+        guint32    i;
+
+        device = g_new0 (CphDevice, 1);
+        device->alt_uris = g_ptr_array_new_with_free_func (g_free);
+
+        if (!_cph_device_cache_read (reader, &device->last_seen, sizeof (device->last_seen)) ||
+            !_cph_device_cache_read (reader, &sources, sizeof (sources)) ||
+            !_cph_device_cache_read (reader, &n_alt_uris, sizeof (n_alt_uris)) ||
+            !_cph_device_cache_read_string (reader, &device->device_class) ||
+            !_cph_device_cache_read_string (reader, &device->device_id) ||
+            !_cph_device_cache_read_string (reader, &device->device_info) ||
+            !_cph_device_cache_read_string (reader, &device->device_make_and_model) ||
+            !_cph_device_cache_read_string (reader, &device->device_uri) ||
+            !_cph_device_cache_read_string (reader, &device->device_location))
+                goto error;
+
+        device->sources = sources;
+
+        for (i = 0; i < n_alt_uris; i++) {
+                char *uri;
+
+                if (!_cph_device_cache_read_string (reader, &uri) || uri == NULL)
+                        goto error;
+
+                g_ptr_array_add (device->alt_uris, uri);
+        }
+
+        return device;
+
+error:
+        _cph_device_free (device);
+
+        return NULL;
+}
+
+/* Returns NULL if there is no usable snapshot */
+static CphDeviceTable *
+_cph_device_table_load (const char *filename,
+                        gint64      max_age)
+{
+        GMappedFile          *file;
+        CphDeviceCacheReader  reader;
+        CphDeviceTable       *table;
+        char                  magic[8];
+        guint32               byte_order;
+        guint32               n_devices;
+        gint64                saved_at;
+        gint64                now;
+        guint32               i;
+
+        file = g_mapped_file_new (filename, FALSE, NULL);
+        if (!file)
+                return NULL;
+
+        reader.data = g_mapped_file_get_contents (file);
+        reader.len = g_mapped_file_get_length (file);
+        reader.pos = 0;
+
+        now = g_get_real_time () / G_USEC_PER_SEC;
+
+        if (!_cph_device_cache_read (&reader, magic, sizeof (magic)) ||
+            memcmp (magic, DEVICE_CACHE_MAGIC, sizeof (magic)) != 0 ||
+            !_cph_device_cache_read (&reader, &byte_order, sizeof (byte_order)) ||
+            byte_order != DEVICE_CACHE_BYTE_ORDER ||
+            !_cph_device_cache_read (&reader, &n_devices, sizeof (n_devices)) ||
+            !_cph_device_cache_read (&reader, &saved_at, sizeof (saved_at)) ||
+            saved_at > now || now - saved_at > max_age) {
+                g_mapped_file_unref (file);
+                return NULL;
+        }
+
+        table = _cph_device_table_new (-1);
+
+        for (i = 0; i < n_devices; i++) {
+                CphDevice *device;
+                GPtrArray *keys;
+                char      *key;
+                guint      j;
+
+                device = _cph_device_cache_read_device (&reader);
+                if (!device) {
+                        _cph_device_table_free (table);
+                        table = NULL;
+                        break;
+                }
+
+                keys = g_ptr_array_new_with_free_func (g_free);
+                _cph_device_uri_keys (device->device_uri, keys);
+                for (j = 0; j < device->alt_uris->len; j++)
+                        _cph_device_uri_keys (g_ptr_array_index (device->alt_uris, j),
+                                              keys);
+                key = _cph_device_id_key (device->device_id);
+                if (key)
+                        g_ptr_array_add (keys, key);
+
+                g_ptr_array_add (table->devices, device);
+                _cph_device_table_link_keys (table, device, keys);
+                g_ptr_array_free (keys, TRUE);
+        }
+
+        g_mapped_file_unref (file);
+
+        return table;
+}
+
+static void
+_cph_device_cache_append_string (GByteArray *buffer,
+                                 const char *str)
+{
+        guint32 len;
+
+        len = str ? strlen (str) : G_MAXUINT32;
+        g_byte_array_append (buffer, (const guint8 *) &len, sizeof (len));
+        if (str)
+                g_byte_array_append (buffer, (const guint8 *) str, len);
+}
+
+/* Replaces filename with data atomically, like g_file_set_contents(), but
+ * the file is only readable by root: the snapshot lists the devices, which
+ * DevicesGet only gives to administrators. */
+static gboolean
+_cph_device_cache_write (const char    *filename,
+                         const guint8  *data,
+                         gsize          len,
+                         GError       **error)
+{
+        char     *tmp_filename;
+        int       fd;
+        int       saved_errno = 0;
+        gsize     written = 0;
+        gboolean  ok;
+
+        tmp_filename = g_strdup_printf ("%s.XXXXXX", filename);
+
+        fd = g_mkstemp_full (tmp_filename, O_WRONLY, 0600);
+        if (fd < 0) {
+                saved_errno = errno;
+                g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                             "%s: %s", tmp_filename, g_strerror (saved_errno));
+                g_free (tmp_filename);
+                return FALSE;
+        }
+
+        while (written < len) {
+                gssize ret;
+
+                ret = write (fd, data + written, len - written);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                if (ret < 0)
+                        break;
+
+                written += ret;
+        }
+
+        ok = written == len && fsync (fd) == 0;
+        if (!ok)
+                saved_errno = errno;
+
+        if (close (fd) != 0 && ok) {
+                ok = FALSE;
+                saved_errno = errno;
+        }
+
+        if (ok && g_rename (tmp_filename, filename) != 0) {
+                ok = FALSE;
+                saved_errno = errno;
+        }
+
+        if (!ok) {
+                g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                             "%s: %s", filename, g_strerror (saved_errno));
+                g_unlink (tmp_filename);
+        }
+
+        g_free (tmp_filename);
+
+        return ok;
+}
+
+static void
+_cph_device_table_save (CphDeviceTable *table,
+                        const char     *filename)
+{
+        GByteArray *buffer;
+        GError     *error = NULL;
+        char       *dirname;
+        guint32     value;
+        gint64      saved_at;
+        guint       i, j;
+
+        buffer = g_byte_array_new ();
+
+        g_byte_array_append (buffer, (const guint8 *) DEVICE_CACHE_MAGIC, 8);
+        value = DEVICE_CACHE_BYTE_ORDER;
+        g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+        value = table->devices->len;
+        g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+        saved_at = g_get_real_time () / G_USEC_PER_SEC;
+        g_byte_array_append (buffer, (const guint8 *) &saved_at, sizeof (saved_at));
+
+        for (i = 0; i < table->devices->len; i++) {
+                CphDevice *device = g_ptr_array_index (table->devices, i);
+
+                g_byte_array_append (buffer, (const guint8 *) &device->last_seen,
+                                     sizeof (device->last_seen));
+                value = device->sources;
+                g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+                value = device->alt_uris->len;
+                g_byte_array_append (buffer, (const guint8 *) &value, sizeof (value));
+
+                _cph_device_cache_append_string (buffer, device->device_class);
+                _cph_device_cache_append_string (buffer, device->device_id);
+                _cph_device_cache_append_string (buffer, device->device_info);
+                _cph_device_cache_append_string (buffer, device->device_make_and_model);
+                _cph_device_cache_append_string (buffer, device->device_uri);
+                _cph_device_cache_append_string (buffer, device->device_location);
+                for (j = 0; j < device->alt_uris->len; j++)
+                        _cph_device_cache_append_string (buffer,
+                                                         g_ptr_array_index (device->alt_uris, j));
+        }
+
+        /* a directory created by an older version was readable by all */
+        dirname = g_path_get_dirname (filename);
+        g_mkdir_with_parents (dirname, 0700);
+        g_chmod (dirname, 0700);
+        g_free (dirname);
+
+        /* the file is replaced atomically, so a snapshot being mapped by
+         * another instance is never seen half-written */
+        if (!_cph_device_cache_write (filename, buffer->data,
+                                      buffer->len, &error)) {
+                g_debug ("Cannot save device snapshot: %s", error->message);
+                g_error_free (error);
+        }
+
+        g_byte_array_free (buffer, TRUE);
+}
+
+/******************************************************
+ * Deadlines
+ ******************************************************/
+
+/* A deadline is a time on the monotonic clock by which a whole operation has
+ * to complete, or -1 if there is no such bound. Each stage of the operation
+ * derives its own timeout from what is left. */
+
+static gint64
+_cph_cups_deadline_new (int timeout)
+{
+        if (timeout <= 0)
+                return -1;
+
+        return g_get_monotonic_time () + (gint64) timeout * G_USEC_PER_SEC;
+}
+
+static gboolean
+_cph_cups_deadline_expired (gint64 deadline)
+{
+        return deadline >= 0 && g_get_monotonic_time () >= deadline;
+}
+
+/* Returns the time left before deadline in milliseconds, bounded by
+ * default_msec; default_msec itself is returned if there is no deadline. An
+ * expired deadline gives 1 and not 0, which often means "no timeout". */
+static int
+_cph_cups_deadline_msec (gint64 deadline,
+                         int    default_msec)
+{
+        gint64 remaining;
+
+        if (deadline < 0)
+                return default_msec;
+
+        remaining = (deadline - g_get_monotonic_time ()) / 1000;
+        if (default_msec > 0)
+                remaining = MIN (remaining, default_msec);
+
+        return CLAMP (remaining, 1, G_MAXINT);
+}
+
+/* Same as _cph_cups_deadline_msec(), in seconds rounded up. */
+static int
+_cph_cups_deadline_sec (gint64 deadline,
+                        int    default_sec)
+{
+        int msec;
+
+        if (deadline < 0)
+                return default_sec;
+
+        msec = _cph_cups_deadline_msec (deadline,
+                                        default_sec > 0 ? default_sec * 1000 : -1);
+
+        return (msec + 999) / 1000;
+}
+
+static void
+_cph_cups_cancel_http_cb (GCancellable *cancellable,
+                          gpointer      user_data)
+{
+        int *cancel = user_data;
+
+        *cancel = 1;
+}
+
+/******************************************************
+ * Connections to printer applications
+ ******************************************************/
+
+/* Printer applications get asked for their devices on each scan, and for
+ * drivers and queues when adding printers: the connections to them are
+ * kept open between requests, so that each request does not pay for
+ * connecting and for the TLS handshake. A connection serves one request at
+ * a time, and goes back to the cache once the request is done. */
+
+typedef struct
+{
+        /* host:port:encryption */
+        char   *key;
+        http_t *http;
+        /* when the connection went back to the cache, on the monotonic
+         * clock */
+        gint64  idle_since;
+        /* bound of the requests of the current user of the connection, and
+         * what aborts them */
+        gint64        deadline;
+        GCancellable *cancellable;
+} CphAppConnection;
+
+struct CphAppConnectionCache
+{
+        /* requests to printer applications can run in threads */
+        GMutex      lock;
+        /* key -> GQueue of idle CphAppConnection, the most recently used
+         * first */
+        GHashTable *idle;
+        guint       expire_id;
+};
+
+static void
+_cph_app_connection_close (CphAppConnection *connection)
+{
+        httpClose (connection->http);
+        if (connection->cancellable)
+                g_object_unref (connection->cancellable);
+        g_free (connection->key);
+        g_free (connection);
+}
+
+/* Called each time a request waited APP_CONNECTION_POLL_INTERVAL for the
+ * printer application; the request fails if this returns 0. */
+static int
+_cph_app_connection_timeout_cb (http_t *http,
+                                void   *user_data)
+{
+        CphAppConnection *connection = user_data;
+
+        if (g_cancellable_is_cancelled (connection->cancellable))
+                return 0;
+
+        return !_cph_cups_deadline_expired (connection->deadline);
+}
+
+static void
+_cph_app_connection_queue_free (GQueue *queue)
+{
+        g_queue_free_full (queue, (GDestroyNotify) _cph_app_connection_close);
+}
+
+static CphAppConnectionCache *
+_cph_app_connection_cache_new (void)
+{
+        CphAppConnectionCache *cache;
+
+        cache = g_new0 (CphAppConnectionCache, 1);
+        g_mutex_init (&cache->lock);
+        cache->idle = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free,
+                                             (GDestroyNotify) _cph_app_connection_queue_free);
+
+        return cache;
+}
+
+static void
+_cph_app_connection_cache_free (CphAppConnectionCache *cache)
+{
+        if (cache->expire_id)
+                g_source_remove (cache->expire_id);
+
+        g_hash_table_destroy (cache->idle);
+        g_mutex_clear (&cache->lock);
+        g_free (cache);
+}
+
+/* A connection that stayed idle is only worth reusing if the printer
+ * application did not close it meanwhile: it then becomes readable, while
+ * nothing else is expected on an idle HTTP connection. */
+static gboolean
+_cph_app_connection_is_healthy (CphAppConnection *connection,
+                                gint64            now)
+{
+        if (now - connection->idle_since >= (gint64) APP_CONNECTION_IDLE_TIMEOUT * G_USEC_PER_SEC)
+                return FALSE;
+
+        if (httpError (connection->http) != 0)
+                return FALSE;
+
+        return !httpWait (connection->http, 0);
+}
+
+static gboolean
+_cph_app_connection_expire_cb (gpointer user_data)
+{
+        CphAppConnectionCache *cache = user_data;
+        GHashTableIter         iter;
+        GQueue                *queue;
+        gint64                 now;
+        gboolean               empty;
+
+        now = g_get_monotonic_time ();
+
+        g_mutex_lock (&cache->lock);
+
+        g_hash_table_iter_init (&iter, cache->idle);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &queue)) {
+                CphAppConnection *connection;
+
+                /* the least recently used connections are at the tail */
+                while ((connection = g_queue_peek_tail (queue)) != NULL &&
+                       !_cph_app_connection_is_healthy (connection, now))
+                        _cph_app_connection_close (g_queue_pop_tail (queue));
+
+                if (g_queue_is_empty (queue))
+                        g_hash_table_iter_remove (&iter);
+        }
+
+        empty = g_hash_table_size (cache->idle) == 0;
+        if (empty)
+                cache->expire_id = 0;
+
+        g_mutex_unlock (&cache->lock);
+
+        return empty ? G_SOURCE_REMOVE : G_SOURCE_CONTINUE;
+}
+
+/* Bounds the next requests sent over connection by deadline, or by
+ * APP_CONNECTION_REQUEST_TIMEOUT from now if it is -1. A connection which
+ * sends several requests, each with its own bound, is rearmed before each
+ * of them. */
+static void
+_cph_app_connection_rearm (CphAppConnection *connection,
+                           gint64            deadline)
+{
+        connection->deadline = deadline >= 0 ? deadline
+                                             : g_get_monotonic_time () + (gint64) (APP_CONNECTION_REQUEST_TIMEOUT * G_USEC_PER_SEC);
+
+        /* the callback decides whether to keep waiting after each slice */
+        httpSetTimeout (connection->http,
+                        CLAMP (_cph_cups_deadline_msec (connection->deadline, -1) / 1000.0,
+                               0.1, APP_CONNECTION_POLL_INTERVAL),
+                        _cph_app_connection_timeout_cb, connection);
+}
+
+/* Returns a connection to host:port, reusing an idle one if possible. The
+ * requests sent over it fail once deadline passes or cancellable gets
+ * cancelled, even while they wait for an answer. Returns NULL if the
+ * printer application cannot be reached in time, or if cancellable gets
+ * cancelled. */
+static CphAppConnection *
+_cph_app_connection_get (CphCups           *cups,
+                         const char        *host,
+                         int                port,
+                         http_encryption_t  encryption,
+                         gint64             deadline,
+                         GCancellable      *cancellable)
+{
+        CphAppConnectionCache *cache = cups->priv->app_connections;
+        CphAppConnection      *connection = NULL;
+        GQueue                *queue;
+        char                  *key;
+        gint64                 now;
+        int                    cancel = 0;
+        gulong                 cancelled_id = 0;
+
+        if (!host || host[0] == '\0' || port <= 0)
+                return NULL;
+
+        key = g_strdup_printf ("%s:%d:%d", host, port, encryption);
+        now = g_get_monotonic_time ();
+
+        g_mutex_lock (&cache->lock);
+
+        queue = g_hash_table_lookup (cache->idle, key);
+        while (queue && (connection = g_queue_pop_head (queue)) != NULL) {
+                if (_cph_app_connection_is_healthy (connection, now))
+                        break;
+
+                _cph_app_connection_close (connection);
+                connection = NULL;
+        }
+        if (queue && g_queue_is_empty (queue))
+                g_hash_table_remove (cache->idle, key);
+
+        g_mutex_unlock (&cache->lock);
+
+        if (connection) {
+                g_free (key);
+        } else {
+                http_t *http;
+
+                if (cancellable)
+                        cancelled_id = g_cancellable_connect (cancellable,
+                                                              G_CALLBACK (_cph_cups_cancel_http_cb),
+                                                              &cancel, NULL);
+
+                http = httpConnect2 (host, port, NULL, AF_UNSPEC, encryption, 1,
+                                     _cph_cups_deadline_msec (deadline, 30000), &cancel);
+
+                if (cancelled_id)
+                        g_cancellable_disconnect (cancellable, cancelled_id);
+
+                if (http == NULL) {
+                        g_free (key);
+                        return NULL;
+                }
+
+                connection = g_new0 (CphAppConnection, 1);
+                connection->key = key;
+                connection->http = http;
+        }
+
+        connection->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+        _cph_app_connection_rearm (connection, deadline);
+
+        return connection;
+}
+
+/* Gives back a connection obtained with _cph_app_connection_get(). reuse
+ * tells whether the last request completed, so that the connection is in a
+ * known state. */
+static void
+_cph_app_connection_release (CphCups          *cups,
+                             CphAppConnection *connection,
+                             gboolean          reuse)
+{
+        CphAppConnectionCache *cache = cups->priv->app_connections;
+        GQueue                *queue;
+
+        if (!reuse || httpError (connection->http) != 0) {
+                _cph_app_connection_close (connection);
+                return;
+        }
+
+        if (connection->cancellable) {
+                g_object_unref (connection->cancellable);
+                connection->cancellable = NULL;
+        }
+
+        g_mutex_lock (&cache->lock);
+
+        queue = g_hash_table_lookup (cache->idle, connection->key);
+        if (queue == NULL) {
+                queue = g_queue_new ();
+                g_hash_table_insert (cache->idle, g_strdup (connection->key), queue);
+        }
+
+        if (g_queue_get_length (queue) < APP_CONNECTION_MAX_IDLE) {
+                connection->idle_since = g_get_monotonic_time ();
+                g_queue_push_head (queue, connection);
+                connection = NULL;
+        }
+
+        if (cache->expire_id == 0)
+                cache->expire_id = g_timeout_add_seconds (APP_CONNECTION_IDLE_TIMEOUT,
+                                                          _cph_app_connection_expire_cb,
+                                                          cache);
+
+        g_mutex_unlock (&cache->lock);
+
+        if (connection)
+                _cph_app_connection_close (connection);
+}
+
+/******************************************************
+ * Driver matching
+ ******************************************************/
+
+/* Drivers, from the catalogue of a printer application or from the PPDs
+ * cupsd knows, are matched to a device by its IEEE-1284 device ID (or its
+ * make and model). Both are split into tokens, and each catalogue has an
+ * inverted index from tokens to drivers, so that the candidates for a
+ * device are found without going through the whole catalogue. All tokens
+ * are qualified by the manufacturer: drivers of another make never match. */
+
+/* Score of a driver made for the very model of the device */
+#define DRIVER_SCORE_MODEL  100
+/* Score of a driver for the same compatible ID (CID) */
+#define DRIVER_SCORE_CID    60
+/* Score of each word of the model shared with the driver: words with
+ * digits are model numbers, and tell more than series names */
+#define DRIVER_SCORE_NUMBER 10
+#define DRIVER_SCORE_WORD   4
+/* Score of each command set (CMD) shared with the driver */
+#define DRIVER_SCORE_CMD    1
+
+typedef struct
+{
+        /* normalized manufacturer; NULL if unknown */
+        char  *mfg;
+        /* normalized model, without the manufacturer */
+        char  *mdl;
+        /* command sets, in lower case; NULL if none */
+        char **cmd;
+        /* normalized compatible ID; NULL if none */
+        char  *cid;
+} CphDeviceIdTokens;
+
+typedef struct
+{
+        char              *name;
+        char              *make_and_model;
+        char              *device_id;
+        CphDeviceIdTokens  tokens;
+} CphDriver;
+
+struct CphDriverIndex
+{
+        /* CphDriver */
+        GPtrArray  *drivers;
+        /* token -> GArray of positions in drivers */
+        GHashTable *postings;
+};
+
+typedef struct
+{
+        const CphDriver *driver;
+        /* the printer application the driver is from; NULL for a PPD */
+        CphPrinterApp   *app;
+        int              score;
+        /* the driver was made for the model or its compatible ID, rather
+         * than sharing words of the model with it */
+        gboolean         exact;
+} CphDriverMatch;
+
+/* Manufacturers which go by several names in device IDs and PPDs */
+static const struct {
+        const char *alias;
+        const char *mfg;
+} cph_mfg_aliases[] = {
+        { "hewlett-packard",       "hp" },
+        { "hewlett packard",       "hp" },
+        { "kyocera mita",          "kyocera" },
+        { "lexmark international", "lexmark" },
+        { "oki data",              "oki" },
+        { "okidata",               "oki" }
+};
+
+static char *
+_cph_device_id_normalize (const char *value,
+                          gssize      len)
+{
+        GString *normalized;
+
+        normalized = g_string_new (NULL);
+        _cph_device_key_append_normalized (normalized, value, len);
+
+        if (normalized->len == 0) {
+                g_string_free (normalized, TRUE);
+                return NULL;
+        }
+
+        return g_string_free (normalized, FALSE);
+}
+
+/* Returns the length of the manufacturer name model starts with, if it is
+ * mfg or one of its aliases, else 0. */
+static gsize
+_cph_device_id_mfg_prefix (const char *model,
+                           const char *mfg)
+{
+        guint i;
+
+        if (g_str_has_prefix (model, mfg) && model[strlen (mfg)] == ' ')
+                return strlen (mfg);
+
+        for (i = 0; i < G_N_ELEMENTS (cph_mfg_aliases); i++) {
+                gsize len = strlen (cph_mfg_aliases[i].alias);
+
+                if (strcmp (cph_mfg_aliases[i].mfg, mfg) == 0 &&
+                    strncmp (model, cph_mfg_aliases[i].alias, len) == 0 &&
+                    model[len] == ' ')
+                        return len;
+        }
+
+        return 0;
+}
+
+static void
+_cph_device_id_tokens_set_model (CphDeviceIdTokens *tokens,
+                                 char              *mfg,
+                                 const char        *mdl)
+{
+        gsize prefix;
+        guint i;
+
+        for (i = 0; i < G_N_ELEMENTS (cph_mfg_aliases); i++) {
+                if (strcmp (mfg, cph_mfg_aliases[i].alias) == 0) {
+                        g_free (mfg);
+                        mfg = g_strdup (cph_mfg_aliases[i].mfg);
+                        break;
+                }
+        }
+
+        /* "MFG:HP;MDL:HP LaserJet 1020;" is the same as
+         * "MFG:HP;MDL:LaserJet 1020;" */
+        prefix = _cph_device_id_mfg_prefix (mdl, mfg);
+        if (prefix > 0)
+                mdl += prefix + 1;
+
+        tokens->mfg = mfg;
+        tokens->mdl = g_strdup (mdl);
+}
+
+/* Splits an IEEE-1284 device ID into tokens; make_and_model, like
+ * "HP LaserJet 1020, hpcups 3.22", is used when the ID lacks the make or
+ * model. */
+static void
+_cph_device_id_tokens_init (CphDeviceIdTokens *tokens,
+                            const char        *device_id,
+                            const char        *make_and_model)
+{
+        const char *mfg, *mdl, *cmd, *cid;
+        gsize       mfg_len, mdl_len, cmd_len, cid_len;
+
+        memset (tokens, 0, sizeof (*tokens));
+
+        mfg = _cph_device_id_get_field (device_id, "MFG", "MANUFACTURER", &mfg_len);
+        mdl = _cph_device_id_get_field (device_id, "MDL", "MODEL", &mdl_len);
+        cmd = _cph_device_id_get_field (device_id, "CMD", "COMMAND SET", &cmd_len);
+        cid = _cph_device_id_get_field (device_id, "CID", NULL, &cid_len);
+
+        if (mfg && mdl && mfg_len > 0 && mdl_len > 0) {
+                char *normalized_mfg = _cph_device_id_normalize (mfg, mfg_len);
+                char *normalized_mdl = _cph_device_id_normalize (mdl, mdl_len);
+
+                if (normalized_mfg && normalized_mdl)
+                        _cph_device_id_tokens_set_model (tokens, normalized_mfg,
+                                                         normalized_mdl);
+                else
+                        g_free (normalized_mfg);
+
+                g_free (normalized_mdl);
+        } else if (make_and_model) {
+                const char *comma;
+                char       *normalized;
+                char       *slash;
+                char       *space;
+                gsize       len;
+                guint       i;
+
+                /* what follows a comma is the driver, not the model */
+                comma = strchr (make_and_model, ',');
+                normalized = _cph_device_id_normalize (make_and_model,
+                                                       comma ? comma - make_and_model : -1);
+
+                /* nor is what follows "Foomatic/" */
+                slash = normalized ? strchr (normalized, '/') : NULL;
+                if (slash) {
+                        while (slash > normalized && *slash != ' ')
+                                slash--;
+                        *slash = '\0';
+                }
+
+                if (normalized) {
+                        len = 0;
+                        for (i = 0; i < G_N_ELEMENTS (cph_mfg_aliases) && len == 0; i++)
+                                len = _cph_device_id_mfg_prefix (normalized,
+                                                                 cph_mfg_aliases[i].mfg);
+
+                        space = len > 0 ? normalized + len : strchr (normalized, ' ');
+                        if (space) {
+                                *space = '\0';
+                                _cph_device_id_tokens_set_model (tokens,
+                                                                 g_strdup (normalized),
+                                                                 space + 1);
+                        }
+                }
+
+                g_free (normalized);
+        }
+
+        if (cmd && cmd_len > 0) {
+                char *normalized = _cph_device_id_normalize (cmd, cmd_len);
+                int   i;
+
+                if (normalized) {
+                        tokens->cmd = g_strsplit (normalized, ",", -1);
+                        for (i = 0; tokens->cmd[i] != NULL; i++)
+                                g_strstrip (tokens->cmd[i]);
+                }
+
+                g_free (normalized);
+        }
+
+        if (cid && cid_len > 0)
+                tokens->cid = _cph_device_id_normalize (cid, cid_len);
+}
+
+static void
+_cph_device_id_tokens_clear (CphDeviceIdTokens *tokens)
+{
+        g_free (tokens->mfg);
+        g_free (tokens->mdl);
+        g_strfreev (tokens->cmd);
+        g_free (tokens->cid);
+}
+
+/* Fills keys with the index keys of tokens, and what matching each of them
+ * is worth. */
+static void
+_cph_device_id_tokens_get_keys (const CphDeviceIdTokens *tokens,
+                                GHashTable              *keys)
+{
+        char **words;
+        int    i;
+
+        if (!tokens->mfg)
+                return;
+
+        g_hash_table_insert (keys,
+                             g_strdup_printf ("model:%s;%s", tokens->mfg, tokens->mdl),
+                             GINT_TO_POINTER (DRIVER_SCORE_MODEL));
+
+        if (tokens->cid)
+                g_hash_table_insert (keys,
+                                     g_strdup_printf ("cid:%s;%s", tokens->mfg, tokens->cid),
+                                     GINT_TO_POINTER (DRIVER_SCORE_CID));
+
+        words = g_strsplit (tokens->mdl, " ", -1);
+        for (i = 0; words[i] != NULL; i++) {
+                const char *p;
+                int         score = DRIVER_SCORE_WORD;
+
+                /* "HP LaserJet Pro MFP series" */
+                if (words[i][0] == '\0' ||
+                    strcmp (words[i], "series") == 0 ||
+                    strchr (words[i], '/') != NULL)
+                        continue;
+
+                for (p = words[i]; *p != '\0'; p++) {
+                        if (g_ascii_isdigit (*p)) {
+                                score = DRIVER_SCORE_NUMBER;
+                                break;
+                        }
+                }
+
+                g_hash_table_insert (keys,
+                                     g_strdup_printf ("word:%s;%s", tokens->mfg, words[i]),
+                                     GINT_TO_POINTER (score));
+        }
+        g_strfreev (words);
+}
+
+static int
+_cph_device_id_tokens_cmd_score (const CphDeviceIdTokens *device,
+                                 const CphDeviceIdTokens *driver)
+{
+        int score = 0;
+        int i;
+        int j;
+
+        if (!device->cmd || !driver->cmd)
+                return 0;
+
+        for (i = 0; device->cmd[i] != NULL; i++) {
+                if (device->cmd[i][0] == '\0')
+                        continue;
+
+                for (j = 0; driver->cmd[j] != NULL; j++) {
+                        if (strcmp (device->cmd[i], driver->cmd[j]) == 0) {
+                                score += DRIVER_SCORE_CMD;
+                                break;
+                        }
+                }
+        }
+
+        return score;
+}
+
+static void
+_cph_driver_free (gpointer data)
+{
+        CphDriver *driver = data;
+
+        g_free (driver->name);
+        g_free (driver->make_and_model);
+        g_free (driver->device_id);
+        _cph_device_id_tokens_clear (&driver->tokens);
+        g_free (driver);
+}
+
+static CphDriverIndex *
+_cph_driver_index_new (void)
+{
+        CphDriverIndex *index;
+
+        index = g_new0 (CphDriverIndex, 1);
+        index->drivers = g_ptr_array_new_with_free_func (_cph_driver_free);
+        index->postings = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free,
+                                                 (GDestroyNotify) g_array_unref);
+
+        return index;
+}
+
+static void
+_cph_driver_index_free (CphDriverIndex *index)
+{
+        g_ptr_array_unref (index->drivers);
+        g_hash_table_destroy (index->postings);
+        g_free (index);
+}
+
+static void
+_cph_driver_index_add (CphDriverIndex *index,
+                       const char     *name,
+                       const char     *make_and_model,
+                       const char     *device_id)
+{
+        CphDriver      *driver;
+        GHashTable     *keys;
+        GHashTableIter  iter;
+        const char     *key;
+        guint           position;
+
+        if (!name || name[0] == '\0')
+                return;
+
+        driver = g_new0 (CphDriver, 1);
+        driver->name = g_strdup (name);
+        driver->make_and_model = g_strdup (make_and_model);
+        driver->device_id = g_strdup (device_id);
+        _cph_device_id_tokens_init (&driver->tokens, device_id, make_and_model);
+
+        position = index->drivers->len;
+        g_ptr_array_add (index->drivers, driver);
+
+        keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        _cph_device_id_tokens_get_keys (&driver->tokens, keys);
+
+        g_hash_table_iter_init (&iter, keys);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &key, NULL)) {
+                GArray *postings;
+
+                postings = g_hash_table_lookup (index->postings, key);
+                if (!postings) {
+                        postings = g_array_new (FALSE, FALSE, sizeof (guint));
+                        g_hash_table_insert (index->postings, g_strdup (key), postings);
+                }
+
+                g_array_append_val (postings, position);
+        }
+
+        g_hash_table_destroy (keys);
+}
+
+/* Appends to matches (of CphDriverMatch) the drivers of index which share
+ * a token with device, with their score. */
+static void
+_cph_driver_index_match (CphDriverIndex          *index,
+                         const CphDeviceIdTokens *device,
+                         CphPrinterApp           *app,
+                         GArray                  *matches)
+{
+        GHashTable     *keys;
+        GHashTable     *scores;
+        GHashTable     *exact;
+        GHashTableIter  iter;
+        const char     *key;
+        gpointer        value;
+        gpointer        position;
+
+        if (!index || !device->mfg)
+                return;
+
+        keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        _cph_device_id_tokens_get_keys (device, keys);
+
+        /* driver position -> score */
+        scores = g_hash_table_new (g_direct_hash, g_direct_equal);
+        /* positions of the drivers with the model or CID key */
+        exact = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+        g_hash_table_iter_init (&iter, keys);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &key, &value)) {
+                GArray *postings;
+                guint   i;
+
+                postings = g_hash_table_lookup (index->postings, key);
+                if (!postings)
+                        continue;
+
+                for (i = 0; i < postings->len; i++) {
+                        gpointer p = GUINT_TO_POINTER (g_array_index (postings, guint, i));
+                        int      score;
+
+                        score = GPOINTER_TO_INT (g_hash_table_lookup (scores, p));
+                        g_hash_table_insert (scores, p,
+                                             GINT_TO_POINTER (score + GPOINTER_TO_INT (value)));
+
+                        if (g_str_has_prefix (key, "model:") ||
+                            g_str_has_prefix (key, "cid:"))
+                                g_hash_table_add (exact, p);
+                }
+        }
+
+        g_hash_table_iter_init (&iter, scores);
+        while (g_hash_table_iter_next (&iter, &position, &value)) {
+                CphDriverMatch match;
+
+                match.driver = g_ptr_array_index (index->drivers,
+                                                  GPOINTER_TO_UINT (position));
+                match.app = app;
+                match.score = GPOINTER_TO_INT (value) +
+                              _cph_device_id_tokens_cmd_score (device,
+                                                               &match.driver->tokens);
+                match.exact = g_hash_table_contains (exact, position);
+
+                g_array_append_val (matches, match);
+        }
+
+        g_hash_table_destroy (exact);
+        g_hash_table_destroy (scores);
+        g_hash_table_destroy (keys);
+}
+
+/* Best match first */
+static gint
+_cph_driver_match_compare (gconstpointer a,
+                           gconstpointer b)
+{
+        const CphDriverMatch *match_a = a;
+        const CphDriverMatch *match_b = b;
+
+        if (match_a->score != match_b->score)
+                return match_b->score - match_a->score;
+
+        return g_strcmp0 (match_a->driver->name, match_b->driver->name);
+}
+
+/* Returns the name of the best driver of index for device_id among those
+ * made for the model or its compatible ID, else "auto": however many words
+ * of the model a driver shares, it can be for another model. */
+static const char *
+_cph_driver_index_best (CphDriverIndex *index,
+                        const char     *device_id)
+{
+        CphDeviceIdTokens  tokens;
+        CphDriverMatch    *best = NULL;
+        GArray            *matches;
+        const char        *driver = "auto";
+        guint              i;
+
+        _cph_device_id_tokens_init (&tokens, device_id, NULL);
+
+        matches = g_array_new (FALSE, FALSE, sizeof (CphDriverMatch));
+        _cph_driver_index_match (index, &tokens, NULL, matches);
+
+        for (i = 0; i < matches->len; i++) {
+                CphDriverMatch *match = &g_array_index (matches, CphDriverMatch, i);
+
+                if (match->exact &&
+                    (!best || _cph_driver_match_compare (match, best) < 0))
+                        best = match;
+        }
+
+        if (best)
+                driver = best->driver->name;
+
+        g_array_free (matches, TRUE);
+        _cph_device_id_tokens_clear (&tokens);
+
+        return driver;
+}
+
+/******************************************************
+ * Printer application registry
+ ******************************************************/
+
+/* The printer applications PrinterAdd can create queues on. They come from
+ * the configuration, and from DNS-SD once they are resolved; each one
+ * knows which devices it can drive, so that a queue gets created by the
+ * application that reported its device rather than by trial and error. */
+
+#define PRINTER_APP_GROUP_PREFIX "PrinterApp "
+
+typedef enum
+{
+        /* in use */
+        CPH_APP_BREAKER_CLOSED,
+        /* left out until its probe is due */
+        CPH_APP_BREAKER_OPEN,
+        /* being probed */
+        CPH_APP_BREAKER_HALF_OPEN
+} CphAppBreakerState;
+
+typedef struct
+{
+        /* wall clock times, 0 if never */
+        gint64             last_success;
+        gint64             last_failure;
+        /* moving averages: share of failed requests, and latency of the
+         * successful ones in milliseconds (-1 before the first) */
+        double             error_rate;
+        double             latency;
+        guint              consecutive_failures;
+        CphAppBreakerState state;
+        /* delay before the next probe, in seconds */
+        guint              cooldown;
+        guint              probe_id;
+} CphAppHealth;
+
+struct CphPrinterApp
+{
+        /* service name, or name of the configuration group */
+        char       *name;
+        char       *hostname;
+        int         port;
+        /* from the configuration; it stays when DNS-SD loses it */
+        gboolean    configured;
+        /* seen with DNS-SD */
+        gboolean    discovered;
+        /* URI schemes of the devices it drives, from the configuration; a
+         * configured application without any takes the devices no other
+         * application claims */
+        GHashTable *schemes;
+        /* URI schemes of the devices it reported to FIND_DEVICES */
+        GHashTable *learnt_schemes;
+        /* URIs of the devices it reported last, with their device IDs */
+        GHashTable *device_uris;
+        /* driver catalogue from FIND_DRIVERS, NULL until it is first
+         * needed */
+        CphDriverIndex *drivers;
+        /* system-config-change-time when the catalogue was fetched, -1 if
+         * the application does not report it */
+        int         drivers_config_time;
+        /* when the catalogue was last known to be current */
+        gint64      drivers_checked;
+        /* last answer to Get-System-Attributes for PrinterAppsDescribe, NULL
+         * until it is first asked, and its system-config-change-time (-1 if
+         * the application does not report it) */
+        ipp_t      *system_attrs;
+        int         system_config_time;
+        CphAppHealth health;
+};
+
+static void
+_cph_printer_app_free (CphPrinterApp *app)
+{
+        g_free (app->name);
+        g_free (app->hostname);
+        g_hash_table_destroy (app->schemes);
+        g_hash_table_destroy (app->learnt_schemes);
+        g_hash_table_destroy (app->device_uris);
+        if (app->drivers)
+                _cph_driver_index_free (app->drivers);
+        if (app->health.probe_id)
+                g_source_remove (app->health.probe_id);
+        ippDelete (app->system_attrs);
+        g_free (app);
+}
+
+static char *
+_cph_printer_app_key (const char *hostname,
+                      int         port)
+{
+        return g_strdup_printf ("%s:%d", hostname, port);
+}
+
+static CphPrinterApp *
+_cph_app_registry_get (CphCups    *cups,
+                       const char *hostname,
+                       int         port)
+{
+        CphPrinterApp *app;
+        char          *key;
+
+        key = _cph_printer_app_key (hostname, port);
+        app = g_hash_table_lookup (cups->priv->printer_apps, key);
+        g_free (key);
+
+        return app;
+}
+
+/* Returns the application at hostname:port, registering it if needed. */
+static CphPrinterApp *
+_cph_app_registry_ensure (CphCups    *cups,
+                          const char *name,
+                          const char *hostname,
+                          int         port)
+{
+        CphPrinterApp *app;
+        char          *key;
+
+        key = _cph_printer_app_key (hostname, port);
+
+        app = g_hash_table_lookup (cups->priv->printer_apps, key);
+        if (app) {
+                g_free (key);
+                return app;
+        }
+
+        app = g_new0 (CphPrinterApp, 1);
+        app->name = g_strdup (name ? name : hostname);
+        app->hostname = g_strdup (hostname);
+        app->port = port;
+        app->schemes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, NULL);
+        app->learnt_schemes = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     g_free, NULL);
+        app->device_uris = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+        app->drivers_config_time = -1;
+        app->system_config_time = -1;
+        app->health.latency = -1;
+
+        g_hash_table_insert (cups->priv->printer_apps, key, app);
+
+        return app;
+}
+
+/* Reads the [PrinterApp <name>] groups:
+ *   Host=localhost
+ *   Port=8001
+ *   Schemes=usb;snmp
+ */
+static void
+_cph_app_registry_load_config (CphCups  *cups,
+                               GKeyFile *keyfile)
+{
+        char  **groups;
+        int     i;
+
+        groups = g_key_file_get_groups (keyfile, NULL);
+
+        for (i = 0; groups[i] != NULL; i++) {
+                CphPrinterApp  *app;
+                char           *host;
+                char          **schemes;
+                int             port = 0;
+                int             j;
+
+                if (!g_str_has_prefix (groups[i], PRINTER_APP_GROUP_PREFIX))
+                        continue;
+
+                _cph_cups_config_get_positive (keyfile, groups[i], "Port", &port);
+                if (port <= 0 || port > 65535) {
+                        g_warning ("Ignoring [%s] of %s: no valid Port",
+                                   groups[i], CPH_CONFIG_FILE);
+                        continue;
+                }
+
+                host = g_key_file_get_string (keyfile, groups[i], "Host", NULL);
+                if (host)
+                        g_strstrip (host);
+
+                app = _cph_app_registry_ensure (cups,
+                                                groups[i] + strlen (PRINTER_APP_GROUP_PREFIX),
+                                                host && host[0] != '\0' ? host : "localhost",
+                                                port);
+                app->configured = TRUE;
+
+                schemes = g_key_file_get_string_list (keyfile, groups[i], "Schemes",
+                                                      NULL, NULL);
+                for (j = 0; schemes && schemes[j] != NULL; j++) {
+                        g_strstrip (schemes[j]);
+                        if (schemes[j][0] != '\0')
+                                g_hash_table_add (app->schemes,
+                                                  g_ascii_strdown (schemes[j], -1));
+                }
+
+                g_strfreev (schemes);
+                g_free (host);
+        }
+
+        g_strfreev (groups);
+}
+
+/* Without any configured application, queues go to the one PrinterAdd has
+ * always used. */
+static void
+_cph_app_registry_add_default (CphCups *cups)
+{
+        GHashTableIter  iter;
+        CphPrinterApp  *app;
+
+        g_hash_table_iter_init (&iter, cups->priv->printer_apps);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &app))
+                if (app->configured)
+                        return;
+
+        app = _cph_app_registry_ensure (cups, NULL,
+                                        DEFAULT_PRINTER_APP_HOST,
+                                        DEFAULT_PRINTER_APP_PORT);
+        app->configured = TRUE;
+}
+
+static void
+_cph_app_registry_add_discovered (CphCups    *cups,
+                                  const char *name,
+                                  const char *hostname,
+                                  int         port)
+{
+        CphPrinterApp *app;
+
+        if (!hostname || hostname[0] == '\0' || port <= 0)
+                return;
+
+        app = _cph_app_registry_ensure (cups, name, hostname, port);
+        app->discovered = TRUE;
+}
+
+static void
+_cph_app_registry_remove_discovered (CphCups    *cups,
+                                     const char *hostname,
+                                     int         port)
+{
+        CphPrinterApp *app;
+        char          *key;
+
+        if (!hostname || port <= 0)
+                return;
+
+        key = _cph_printer_app_key (hostname, port);
+
+        app = g_hash_table_lookup (cups->priv->printer_apps, key);
+        if (app) {
+                app->discovered = FALSE;
+                if (!app->configured)
+                        g_hash_table_remove (cups->priv->printer_apps, key);
+        }
+
+        g_free (key);
+}
+
+static void
+_cph_printer_app_add_device_uri (CphPrinterApp *app,
+                                 const char    *uri,
+                                 const char    *device_id)
+{
+        const char *colon;
+
+        if (!uri || (colon = strchr (uri, ':')) == NULL)
+                return;
+
+        g_hash_table_insert (app->device_uris, g_strdup (uri),
+                             device_id && device_id[0] != '\0' ? g_strdup (device_id) : NULL);
+        g_hash_table_add (app->learnt_schemes, g_ascii_strdown (uri, colon - uri));
+}
+
+/* Remembers the devices a printer application reported to FIND_DEVICES:
+ * those are the devices it can create queues for. complete tells whether
+ * the query was not filtered, so that table has all of them. */
+static void
+_cph_app_registry_set_devices (CphCups        *cups,
+                               const char     *hostname,
+                               int             port,
+                               CphDeviceTable *table,
+                               gboolean        complete)
+{
+        CphPrinterApp *app;
+        guint          i;
+        guint          j;
+
+        app = _cph_app_registry_get (cups, hostname, port);
+        if (!app)
+                return;
+
+        if (complete)
+                g_hash_table_remove_all (app->device_uris);
+
+        for (i = 0; i < table->devices->len; i++) {
+                CphDevice *device = g_ptr_array_index (table->devices, i);
+
+                _cph_printer_app_add_device_uri (app, device->device_uri,
+                                                 device->device_id);
+                for (j = 0; j < device->alt_uris->len; j++)
+                        _cph_printer_app_add_device_uri (app,
+                                                         g_ptr_array_index (device->alt_uris, j),
+                                                         device->device_id);
+        }
+}
+
+/* Finds the printer application to create a queue for device_uri on: the
+ * one which reported this very device, else one which drives devices of
+ * the same kind, else a configured one which takes any device. */
+static CphPrinterApp *
+_cph_app_registry_lookup (CphCups    *cups,
+                          const char *device_uri)
+{
+        GHashTableIter  iter;
+        CphPrinterApp  *app;
+        CphPrinterApp  *found = NULL;
+        CphPrinterApp  *by_scheme = NULL;
+        CphPrinterApp  *fallback = NULL;
+        const char     *colon;
+        char           *scheme = NULL;
+
+        if (device_uri && (colon = strchr (device_uri, ':')) != NULL)
+                scheme = g_ascii_strdown (device_uri, colon - device_uri);
+
+        g_hash_table_iter_init (&iter, cups->priv->printer_apps);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &app)) {
+                if (device_uri && g_hash_table_contains (app->device_uris, device_uri)) {
+                        found = app;
+                        break;
+                }
+
+                if (!by_scheme && scheme &&
+                    (g_hash_table_contains (app->schemes, scheme) ||
+                     g_hash_table_contains (app->learnt_schemes, scheme)))
+                        by_scheme = app;
+
+                if (!fallback && app->configured &&
+                    g_hash_table_size (app->schemes) == 0)
+                        fallback = app;
+        }
+
+        g_free (scheme);
+
+        if (found)
+                return found;
+
+        return by_scheme ? by_scheme : fallback;
+}
+
+/* Returns the system-uri operation attribute for the application at
+ * hostname:port. */
+static char *
+_cph_printer_app_system_uri (const char *hostname,
+                             int         port)
+{
+        char uri[HTTP_MAX_URI];
+
+        if (httpAssembleURI (HTTP_URI_CODING_ALL, uri, sizeof (uri),
+                             "ipp", NULL, hostname, port,
+                             "/ipp/system") != HTTP_URI_STATUS_OK)
+                return NULL;
+
+        return g_strdup (uri);
+}
+
+/* Members of the collections of FIND_DEVICES and FIND_DRIVERS. Applications
+ * with many devices or drivers answer with large collections, so they are
+ * read in a single pass over their members rather than looked up by name
+ * one after the other. */
+enum
+{
+        APP_COL_DEVICE_ID,
+        APP_COL_DEVICE_INFO,
+        APP_COL_DEVICE_URI,
+        APP_COL_DRIVER,
+        APP_COL_DRIVER_INFO,
+        APP_COL_N_MEMBERS
+};
+
+static const char * const app_col_members[APP_COL_N_MEMBERS] = {
+        "smi55357-device-id",
+        "smi55357-device-info",
+        "smi55357-device-uri",
+        "smi55357-driver",
+        "smi55357-driver-info"
+};
+
+/* Fills values, indexed by APP_COL_*, with the string values of the
+ * members of col; members which are missing are NULL. */
+static void
+_cph_printer_app_decode_col (ipp_t       *col,
+                             const char **values)
+{
+        ipp_attribute_t *attr;
+        const char      *name;
+        int              i;
+
+        for (i = 0; i < APP_COL_N_MEMBERS; i++)
+                values[i] = NULL;
+
+        for (attr = ippFirstAttribute (col); attr != NULL;
+             attr = ippNextAttribute (col)) {
+                name = ippGetName (attr);
+                if (!name || !g_str_has_prefix (name, "smi55357-"))
+                        continue;
+
+                for (i = 0; i < APP_COL_N_MEMBERS; i++) {
+                        if (values[i] == NULL &&
+                            strcmp (name, app_col_members[i]) == 0) {
+                                values[i] = ippGetString (attr, 0, NULL);
+                                break;
+                        }
+                }
+        }
+}
+
+/* Sends Get-System-Attributes for the n_requested attributes of
+ * requested. Returns the response, or NULL if the request failed. */
+static ipp_t *
+_cph_printer_app_get_system_attributes (CphAppConnection  *connection,
+                                        const char        *system_uri,
+                                        const char *const *requested,
+                                        int                n_requested)
+{
+        ipp_t *request;
+        ipp_t *response;
+
+        request = ippNewRequest (IPP_OP_GET_SYSTEM_ATTRIBUTES);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "system-uri", NULL, system_uri);
+        ippAddStrings (request, IPP_TAG_OPERATION, IPP_CONST_TAG (IPP_TAG_KEYWORD),
+                       "requested-attributes", n_requested,
+                       NULL, requested);
+
+        response = cupsDoRequest (connection->http, request, "/ipp/system");
+        if (response && ippGetStatusCode (response) > IPP_OK_CONFLICT) {
+                ippDelete (response);
+                return NULL;
+        }
+
+        return response;
+}
+
+/* Returns the system-config-change-time of a Get-System-Attributes
+ * response, or -1. */
+static int
+_cph_printer_app_config_time (ipp_t *response)
+{
+        ipp_attribute_t *attr;
+
+        attr = ippFindAttribute (response, "system-config-change-time",
+                                 IPP_TAG_INTEGER);
+
+        return attr ? ippGetInteger (attr, 0) : -1;
+}
+
+/* Asks a printer application for its system-config-change-time, which
+ * changes when drivers are added or removed. Returns -1 if it does not
+ * tell. */
+static int
+_cph_printer_app_get_config_time (CphAppConnection *connection,
+                                  const char       *system_uri)
+{
+        static const char * const requested[] = { "system-config-change-time" };
+        ipp_t *response;
+        int    config_time = -1;
+
+        response = _cph_printer_app_get_system_attributes (connection, system_uri,
+                                                           requested,
+                                                           G_N_ELEMENTS (requested));
+        if (response)
+                config_time = _cph_printer_app_config_time (response);
+
+        ippDelete (response);
+
+        return config_time;
+}
+
+static CphDriverIndex *
+_cph_printer_app_fetch_drivers (CphAppConnection *connection,
+                                const char       *system_uri)
+{
+        ipp_t           *request;
+        ipp_t           *response;
+        ipp_attribute_t *attr;
+        CphDriverIndex  *drivers;
+        const char      *values[APP_COL_N_MEMBERS];
+        int              count;
+        int              i;
+
+        request = ippNewRequest (IPP_OP_PAPPL_FIND_DRIVERS);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "system-uri", NULL, system_uri);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_CONST_TAG (IPP_TAG_KEYWORD),
+                      "requested-attributes", NULL, "smi55357-driver-col");
+
+        response = cupsDoRequest (connection->http, request, "/ipp/system");
+        if (!response || ippGetStatusCode (response) > IPP_OK_CONFLICT) {
+                ippDelete (response);
+                return NULL;
+        }
+
+        drivers = _cph_driver_index_new ();
+
+        attr = ippFindAttribute (response, "smi55357-driver-col",
+                                 IPP_TAG_BEGIN_COLLECTION);
+        count = attr ? ippGetCount (attr) : 0;
+
+        for (i = 0; i < count; i++) {
+                _cph_printer_app_decode_col (ippGetCollection (attr, i), values);
+
+                _cph_driver_index_add (drivers,
+                                       values[APP_COL_DRIVER],
+                                       values[APP_COL_DRIVER_INFO],
+                                       values[APP_COL_DEVICE_ID]);
+        }
+
+        ippDelete (response);
+
+        return drivers;
+}
+
+/* Whether the catalogue of app was checked recently enough to be used
+ * without asking the application. */
+static gboolean
+_cph_printer_app_drivers_are_fresh (CphPrinterApp *app,
+                                    gint64         now)
+{
+        return app->drivers &&
+               now - app->drivers_checked < DRIVER_CATALOGUE_CHECK_INTERVAL * G_USEC_PER_SEC;
+}
+
+/* Records the outcome of checking the catalogue of app at now: drivers is
+ * the new catalogue, which app takes, or NULL to keep the old one, which is
+ * only known to be current if config_time is unchanged. */
+static void
+_cph_printer_app_update_drivers (CphPrinterApp  *app,
+                                 CphDriverIndex *drivers,
+                                 int             config_time,
+                                 gint64          now)
+{
+        if (!drivers) {
+                if (app->drivers && config_time >= 0 &&
+                    config_time == app->drivers_config_time)
+                        app->drivers_checked = now;
+                return;
+        }
+
+        if (app->drivers)
+                _cph_driver_index_free (app->drivers);
+
+        app->drivers = drivers;
+        app->drivers_config_time = config_time;
+        app->drivers_checked = now;
+}
+
+/* Returns the driver catalogue of app. It is only fetched again once the
+ * application reports a configuration change, and that is asked at most
+ * every DRIVER_CATALOGUE_CHECK_INTERVAL seconds, so that adding many
+ * queues does not transfer the whole catalogue each time. connection is
+ * one to app, or NULL to get one, bound by deadline, only if the catalogue
+ * needs checking. */
+static CphDriverIndex *
+_cph_printer_app_get_drivers (CphCups          *cups,
+                              CphPrinterApp    *app,
+                              CphAppConnection *connection,
+                              gint64            deadline)
+{
+        CphAppConnection *own_connection = NULL;
+        CphDriverIndex   *drivers;
+        char             *system_uri;
+        gint64            now;
+        int               config_time;
+
+        now = g_get_monotonic_time ();
+
+        if (_cph_printer_app_drivers_are_fresh (app, now))
+                return app->drivers;
+
+        system_uri = _cph_printer_app_system_uri (app->hostname, app->port);
+        if (!system_uri)
+                return app->drivers;
+
+        if (!connection) {
+                own_connection = _cph_app_connection_get (cups, app->hostname, app->port,
+                                                          HTTP_ENCRYPTION_IF_REQUESTED,
+                                                          deadline, NULL);
+                connection = own_connection;
+        }
+
+        if (!connection) {
+                g_free (system_uri);
+                return app->drivers;
+        }
+
+        config_time = _cph_printer_app_get_config_time (connection, system_uri);
+        if (app->drivers && config_time >= 0 &&
+            config_time == app->drivers_config_time)
+                drivers = NULL;
+        else
+                drivers = _cph_printer_app_fetch_drivers (connection, system_uri);
+
+        /* keep using the old catalogue if a new one cannot be had */
+        _cph_printer_app_update_drivers (app, drivers, config_time, now);
+
+        if (own_connection)
+                _cph_app_connection_release (cups, own_connection,
+                                             httpError (own_connection->http) == 0);
+        g_free (system_uri);
+
+        return app->drivers;
+}
+
+/* Picks the driver for a device from the catalogue of app, or "auto" to
+ * let the application decide. */
+static const char *
+_cph_printer_app_resolve_driver (CphCups          *cups,
+                                 CphPrinterApp    *app,
+                                 CphAppConnection *connection,
+                                 const char       *device_id)
+{
+        if (!app || !device_id || device_id[0] == '\0')
+                return "auto";
+
+        return _cph_driver_index_best (_cph_printer_app_get_drivers (cups, app,
+                                                                     connection, -1),
+                                       device_id);
+}
+
+/* Checks the catalogue of a printer application in the pool of threads, as
+ * _cph_printer_app_get_drivers() does, for the calls which must not block
+ * the main loop. The outcome is applied to the registry in the main loop,
+ * before done_cb is called. */
+
+typedef void (*CphDriverCheckDone) (gpointer user_data);
+
+typedef struct
+{
+        CphAppJob           job;
+        CphCups            *cups;
+        char               *hostname;
+        int                 port;
+        gint64              deadline;
+        GCancellable       *cancellable;
+        /* system-config-change-time of the catalogue known when the check
+         * started, -1 if there was none */
+        int                 known_config_time;
+        /* the catalogue if it changed, and the current
+         * system-config-change-time */
+        CphDriverIndex     *drivers;
+        int                 config_time;
+        CphDriverCheckDone  done_cb;
+        gpointer            user_data;
+} CphDriverCheck;
+
+static void
+_cph_driver_check_run (gpointer job)
+{
+        CphDriverCheck   *check = job;
+        CphAppConnection *connection;
+        char             *system_uri;
+
+        system_uri = _cph_printer_app_system_uri (check->hostname, check->port);
+        if (!system_uri)
+                return;
+
+        connection = _cph_app_connection_get (check->cups,
+                                              check->hostname, check->port,
+                                              HTTP_ENCRYPTION_IF_REQUESTED,
+                                              check->deadline,
+                                              check->cancellable);
+        if (connection) {
+                check->config_time = _cph_printer_app_get_config_time (connection,
+                                                                       system_uri);
+                if (check->known_config_time < 0 ||
+                    check->config_time != check->known_config_time)
+                        check->drivers = _cph_printer_app_fetch_drivers (connection,
+                                                                         system_uri);
+
+                _cph_app_connection_release (check->cups, connection,
+                                             httpError (connection->http) == 0);
+        }
+
+        g_free (system_uri);
+}
+
+static gboolean
+_cph_driver_check_done (gpointer user_data)
+{
+        CphDriverCheck *check = user_data;
+        CphPrinterApp  *app;
+
+        /* the application can be gone meanwhile */
+        app = _cph_app_registry_get (check->cups, check->hostname, check->port);
+        if (app) {
+                _cph_printer_app_update_drivers (app, check->drivers,
+                                                 check->config_time,
+                                                 g_get_monotonic_time ());
+                check->drivers = NULL;
+        }
+
+        check->done_cb (check->user_data);
+
+        if (check->drivers)
+                _cph_driver_index_free (check->drivers);
+        if (check->cancellable)
+                g_object_unref (check->cancellable);
+        g_object_unref (check->cups);
+        g_free (check->hostname);
+        g_free (check);
+
+        return G_SOURCE_REMOVE;
+}
+
+/* Starts checking the catalogue of app; requests are bound by deadline. */
+static void
+_cph_printer_app_check_drivers (CphCups            *cups,
+                                CphPrinterApp      *app,
+                                gint64              deadline,
+                                GCancellable       *cancellable,
+                                CphDriverCheckDone  done_cb,
+                                gpointer            user_data)
+{
+        CphDriverCheck *check;
+
+        check = g_new0 (CphDriverCheck, 1);
+        check->job.run = _cph_driver_check_run;
+        check->job.done = _cph_driver_check_done;
+        check->cups = g_object_ref (cups);
+        check->hostname = g_strdup (app->hostname);
+        check->port = app->port;
+        check->deadline = deadline;
+        check->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+        check->known_config_time = app->drivers ? app->drivers_config_time : -1;
+        check->config_time = -1;
+        check->done_cb = done_cb;
+        check->user_data = user_data;
+
+        _cph_app_job_push (cups, &check->job);
+}
+
+/* A printer application which fails APP_BREAKER_THRESHOLD times in a row
+ * is left out of discovery, so that a hung one does not hold every scan up
+ * until the timeout. It is probed in the background, less and less often,
+ * until it answers again. */
+
+typedef struct
+{
+        CphCups       *cups;
+        CphPrinterApp *app;
+} CphAppProbeTimer;
+
+static void _cph_printer_app_record (CphCups       *cups,
+                                     CphPrinterApp *app,
+                                     gboolean       success,
+                                     gint64         latency);
+
+typedef struct
+{
+        CphAppJob  job;
+        CphCups   *cups;
+        char      *hostname;
+        int        port;
+        gboolean   ok;
+        gint64     latency;
+} CphAppProbe;
+
+static void
+_cph_app_probe_run (gpointer job)
+{
+        CphAppProbe      *probe = job;
+        CphAppConnection *connection;
+        ipp_t            *response;
+        char             *system_uri;
+        gint64            start;
+        static const char * const requested[] = { "system-state" };
+
+        start = g_get_monotonic_time ();
+
+        system_uri = _cph_printer_app_system_uri (probe->hostname, probe->port);
+        connection = _cph_app_connection_get (probe->cups,
+                                              probe->hostname, probe->port,
+                                              HTTP_ENCRYPTION_IF_REQUESTED,
+                                              start + APP_PROBE_TIMEOUT * G_USEC_PER_SEC,
+                                              NULL);
+
+        if (connection && system_uri) {
+                response = _cph_printer_app_get_system_attributes (connection, system_uri,
+                                                                   requested,
+                                                                   G_N_ELEMENTS (requested));
+                probe->ok = response != NULL;
+
+                _cph_app_connection_release (probe->cups, connection,
+                                             httpError (connection->http) == 0);
+                ippDelete (response);
+        } else if (connection) {
+                _cph_app_connection_release (probe->cups, connection, TRUE);
+        }
+
+        probe->latency = g_get_monotonic_time () - start;
+
+        g_free (system_uri);
+}
+
+static gboolean
+_cph_app_probe_done (gpointer user_data)
+{
+        CphAppProbe   *probe = user_data;
+        CphPrinterApp *app;
+
+        /* the application can be gone, or have answered a request
+         * meanwhile */
+        app = _cph_app_registry_get (probe->cups, probe->hostname, probe->port);
+        if (app && app->health.state == CPH_APP_BREAKER_HALF_OPEN)
+                _cph_printer_app_record (probe->cups, app, probe->ok, probe->latency);
+
+        g_object_unref (probe->cups);
+        g_free (probe->hostname);
+        g_free (probe);
+
+        return G_SOURCE_REMOVE;
+}
+
+static gboolean
+_cph_printer_app_probe_cb (gpointer user_data)
+{
+        CphAppProbeTimer *timer = user_data;
+        CphPrinterApp    *app = timer->app;
+        CphAppProbe      *probe;
+
+        app->health.probe_id = 0;
+        app->health.state = CPH_APP_BREAKER_HALF_OPEN;
+
+        probe = g_new0 (CphAppProbe, 1);
+        probe->job.run = _cph_app_probe_run;
+        probe->job.done = _cph_app_probe_done;
+        probe->cups = g_object_ref (timer->cups);
+        probe->hostname = g_strdup (app->hostname);
+        probe->port = app->port;
+
+        _cph_app_job_push (timer->cups, &probe->job);
+
+        return G_SOURCE_REMOVE;
+}
+
+/* Updates the health of app with the outcome of a request; latency is in
+ * microseconds, or -1 if it is not known. */
+static void
+_cph_printer_app_record (CphCups       *cups,
+                         CphPrinterApp *app,
+                         gboolean       success,
+                         gint64         latency)
+{
+        CphAppHealth     *health = &app->health;
+        CphAppProbeTimer *timer;
+
+        health->error_rate += APP_HEALTH_EWMA_WEIGHT *
+                              ((success ? 0.0 : 1.0) - health->error_rate);
+
+        if (success) {
+                if (latency >= 0 && health->latency < 0)
+                        health->latency = latency / 1000.0;
+                else if (latency >= 0)
+                        health->latency += APP_HEALTH_EWMA_WEIGHT *
+                                           (latency / 1000.0 - health->latency);
+
+                health->last_success = g_get_real_time ();
+                health->consecutive_failures = 0;
+                health->cooldown = 0;
+                health->state = CPH_APP_BREAKER_CLOSED;
+
+                if (health->probe_id) {
+                        g_source_remove (health->probe_id);
+                        health->probe_id = 0;
+                }
+
+                return;
+        }
+
+        health->last_failure = g_get_real_time ();
+        health->consecutive_failures++;
+
+        if (health->state == CPH_APP_BREAKER_OPEN ||
+            (health->state == CPH_APP_BREAKER_CLOSED &&
+             health->consecutive_failures < APP_BREAKER_THRESHOLD))
+                return;
+
+        /* a failed probe waits twice as long before the next one */
+        health->cooldown = health->cooldown == 0 ? APP_BREAKER_COOLDOWN
+                                                 : MIN (health->cooldown * 2,
+                                                        APP_BREAKER_MAX_COOLDOWN);
+        health->state = CPH_APP_BREAKER_OPEN;
+
+        g_debug ("Printer application %s:%d failed %u times, probing it again in %u seconds",
+                 app->hostname, app->port,
+                 health->consecutive_failures, health->cooldown);
+
+        timer = g_new0 (CphAppProbeTimer, 1);
+        timer->cups = cups;
+        timer->app = app;
+        health->probe_id = g_timeout_add_seconds_full (G_PRIORITY_DEFAULT,
+                                                       health->cooldown,
+                                                       _cph_printer_app_probe_cb,
+                                                       timer, g_free);
+}
+
+/* Whether the application at hostname:port is worth asking for devices;
+ * unknown applications are. */
+static gboolean
+_cph_app_registry_is_available (CphCups    *cups,
+                                const char *hostname,
+                                int         port)
+{
+        CphPrinterApp *app;
+
+        app = _cph_app_registry_get (cups, hostname, port);
+
+        return app == NULL || app->health.state == CPH_APP_BREAKER_CLOSED;
+}
+
+typedef struct {
+        CphDeviceTable     table;
+        /* NULL when there is no filter */
+        const char *const *include_schemes;
+        const char *const *exclude_schemes;
+        GPtrArray         *app_device_types;
+        /* bound for the whole scan; -1 and NULL when there is none */
+        gint64             deadline;
+        GCancellable      *cancellable;
+        /* for the connections to printer applications; NULL when only the
+         * CUPS backends are scanned */
+        CphCups           *cups;
+} CphCupsGetDevices;
+
+typedef struct {
+        int                  iter;
+        GVariantBuilder     *builder;
+        CphPrinterAppBrowse *browse;
+} CphCupsGetPrinterApps;
+
+static void
+_cph_cups_get_devices_cb (const char *device_class,
+                          const char *device_id,
+                          const char *device_info,
+                          const char *device_make_and_model,
+                          const char *device_uri,
+                          const char *device_location,
+                          void       *user_data)
+{
+        CphCupsGetDevices *data = user_data;
+
+        g_return_if_fail (data != NULL);
+
+        _cph_device_table_add (&data->table,
+                               CPH_DEVICE_SOURCE_CUPS,
+                               device_class,
+                               device_id,
+                               device_info,
+                               device_make_and_model,
+                               device_uri,
+                               device_location,
+                               NULL);
+}
+
+/******************************************************
+ * Scheme filters
+ ******************************************************/
+
+static gboolean
+_cph_cups_scheme_list_contains (const char *const *schemes,
+                                const char        *scheme,
+                                gsize              len)
+{
+        int i;
+
+        for (i = 0; schemes[i] != NULL; i++) {
+                if (strlen (schemes[i]) == len &&
+                    g_ascii_strncasecmp (schemes[i], scheme, len) == 0)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+/* Same semantics as the include_schemes and exclude_schemes arguments of
+ * cupsGetDevices(). scheme does not need to be nul-terminated. */
+static gboolean
+_cph_cups_is_scheme_wanted (CphCupsGetDevices *data,
+                            const char        *scheme,
+                            gsize              len)
+{
+        if (data->include_schemes &&
+            !_cph_cups_scheme_list_contains (data->include_schemes, scheme, len))
+                return FALSE;
+
+        if (data->exclude_schemes &&
+            _cph_cups_scheme_list_contains (data->exclude_schemes, scheme, len))
+                return FALSE;
+
+        return TRUE;
+}
+
+static gboolean
+_cph_cups_is_uri_wanted (CphCupsGetDevices *data,
+                         const char        *uri)
+{
+        const char *colon;
+
+        if (!uri)
+                return FALSE;
+
+        colon = strchr (uri, ':');
+        if (!colon)
+                return FALSE;
+
+        return _cph_cups_is_scheme_wanted (data, uri, colon - uri);
+}
+
+/* Printer applications discover devices themselves, and FIND_DEVICES lets us
+ * restrict the kind of discovery they do with the smi55357-device-type
+ * operation attribute. This maps the schemes of their device URIs to those
+ * types; schemes that are not listed are reported by drivers ("other") unless
+ * they are only ever handled by cups backends. */
+static const struct {
+        const char *scheme;
+        const char *device_type;
+} cph_pappl_device_types[] = {
+        { "dnssd", "dns-sd" },
+        { "snmp",  "snmp" },
+        { "usb",   "usb" },
+        { "http",  NULL },
+        { "https", NULL },
+        { "ipp",   NULL },
+        { "ipps",  NULL },
+        { "lpd",   NULL },
+        { "smb",   NULL }
+};
+
+static void
+_cph_cups_add_printer_app_device_type (GPtrArray  *types,
+                                       const char *device_type)
+{
+        guint i;
+
+        for (i = 0; i < types->len; i++) {
+                if (g_strcmp0 (g_ptr_array_index (types, i), device_type) == 0)
+                        return;
+        }
+
+        g_ptr_array_add (types, (gpointer) device_type);
+}
+
+/* Returns the values for smi55357-device-type matching the scheme filters, or
+ * NULL if no printer application device can match them, in which case there
+ * is no need to look for printer applications at all. */
+static GPtrArray *
+_cph_cups_get_printer_app_device_types (CphCupsGetDevices *data)
+{
+        GPtrArray *types;
+        gboolean   custom;
+        guint      i;
+
+        types = g_ptr_array_new ();
+        custom = FALSE;
+
+        if (!data->include_schemes) {
+                custom = TRUE;
+                for (i = 0; i < G_N_ELEMENTS (cph_pappl_device_types); i++) {
+                        const char *scheme = cph_pappl_device_types[i].scheme;
+
+                        if (cph_pappl_device_types[i].device_type &&
+                            _cph_cups_is_scheme_wanted (data, scheme, strlen (scheme)))
+                                _cph_cups_add_printer_app_device_type (types,
+                                                                       cph_pappl_device_types[i].device_type);
+                }
+        } else {
+                int j;
+
+                for (j = 0; data->include_schemes[j] != NULL; j++) {
+                        const char *scheme = data->include_schemes[j];
+                        gboolean    known = FALSE;
+
+                        if (!_cph_cups_is_scheme_wanted (data, scheme, strlen (scheme)))
+                                continue;
+
+                        for (i = 0; i < G_N_ELEMENTS (cph_pappl_device_types); i++) {
+                                const char *device_type = cph_pappl_device_types[i].device_type;
+
+                                if (g_ascii_strcasecmp (cph_pappl_device_types[i].scheme, scheme) != 0)
+                                        continue;
+
+                                known = TRUE;
+                                if (device_type)
+                                        _cph_cups_add_printer_app_device_type (types, device_type);
+                        }
+
+                        if (!known)
+                                custom = TRUE;
+                }
+        }
+
+        if (custom) {
+                g_ptr_array_add (types, (gpointer) "other-local");
+                g_ptr_array_add (types, (gpointer) "other-network");
+        }
+
+        if (types->len == 0) {
+                g_ptr_array_free (types, TRUE);
+                return NULL;
+        }
+
+        return types;
+}
+
+typedef struct
+{
+
+	ipp_t *response;
+	gchar *buff;
+	int buff_size;
+        cups_dest_t* service;
+
+} add_attribute_data;
+
+/* A browser for one service type. Browsers are owned by the discovery
+ * manager and shared by all the discovery calls: Avahi keeps the services
+ * they know about up-to-date between calls. */
+typedef struct 
+{
+        CphDiscoveryManager *manager;
+        char                *avahi_service_browser_path;
+        /* subscription to the signals of avahi_service_browser_path, unless
+         * the manager dispatches them */
+        guint                avahi_service_browser_subscription_id;
+        GCancellable        *avahi_cancellable;
+        /* services reported by Avahi, resolved or not (AvahiData with only
+         * the key of the service set) */
+        GQueue               items;
+        /* AvahiData -> its link in items */
+        GHashTable          *item_index;
+        /* whether services get resolved as they come: only once a browse
+         * operation needs them resolved */
+        gboolean             resolve;
+        /* resolved services (AvahiData), in the order they were found */
+        GQueue               system_objects;
+        /* AvahiData -> its link in system_objects */
+        GHashTable          *system_object_index;
+        char                *service_type;
+        CphCups             *cups;
+        /* browse operations following this browser (AvahiWatcher) */
+        GList               *watchers;
+        /* services waiting for a resolver call (AvahiResolveRequest) */
+        GQueue               pending_resolutions;
+        int                  resolutions_in_flight;
+        gboolean             all_for_now;
+        /* idle callback freeing the browser once it failed */
+        guint                free_id;
+        /* its ServiceBrowserNew call is in flight, and counted in the
+         * creating field of the manager */
+        gboolean             creating;
+} Avahi;
+
+/* Owns the connection to the system bus and the browsers, so that the
+ * discovery calls do not set them up again each time. */
+struct CphDiscoveryManager
+{
+        CphCups             *cups;
+        GDBusConnection     *connection;
+        /* service type -> Avahi */
+        GHashTable          *browsers;
+        /* browsers which failed, waiting to be freed */
+        GList               *failed;
+        /* ServiceBrowserPrepare only exists since Avahi 0.8: before that,
+         * a browser can emit signals before its path is known */
+        gboolean             no_prepare;
+        /* without ServiceBrowserPrepare, a single subscription gets the
+         * signals of all the browsers, and dispatches them by path */
+        guint                fallback_subscription_id;
+        /* object path -> Avahi, for the fallback subscription */
+        GHashTable          *browsers_by_path;
+        /* ServiceBrowserNew calls in flight */
+        int                  creating;
+        /* signals for paths which are not known yet (AvahiSignal) */
+        GQueue               early_signals;
+        /* services resolved on demand (AvahiData -> the same AvahiData),
+         * as long as their browser knows about them */
+        GHashTable          *resolved;
+};
+
+static const char *const printer_app_service_types[] = {
+        "_ipps-system._tcp",
+        "_ipp-system._tcp",
+        NULL
+};
+
+typedef void (*CphPrinterAppBrowseDone) (CphPrinterAppBrowse *browse,
+                                         gpointer             user_data);
+
+/* A browse operation following one of the browsers of the manager. */
+typedef struct
+{
+        /* NULL if there is no browser for the service type */
+        Avahi               *backend;
+        CphPrinterAppBrowse *browse;
+        /* the browser reported all its services to the browse */
+        gboolean             done;
+} AvahiWatcher;
+
+/* Browsing for printer applications, or printers, with all the service
+ * types at the same time, in the main loop. */
+struct CphPrinterAppBrowse
+{
+        /* one per service type */
+        AvahiWatcher            *watchers;
+        int                      n_watchers;
+        printer_app_cb          *added_cb;
+        printer_app_cb          *removed_cb;
+        gpointer                 data;
+        /* whether the callbacks get resolved services, or only their key */
+        gboolean                 resolve;
+        /* browsers that did not report all their services yet */
+        int                      browsing;
+        guint                    deadline_id;
+        guint                    done_id;
+        GCancellable            *cancellable;
+        gulong                   cancelled_id;
+        CphPrinterAppBrowseDone  done_cb;
+        gpointer                 done_data;
+};
+
+/* A service seen by Avahi: either only its key, for the items of a
+ * browser, or resolved. Records are reference counted, and their strings
+ * live in the same allocation, right after the structure. */
+typedef struct
+{
+        volatile int          ref_count;
+        /* size of the allocation, structure and strings */
+        gsize                 size;
+        const char           *name;
+        const char           *type;
+        const char           *domain;
+        const char           *hostname;
+        const char           *address;
+        const char           *resource_path;
+        const char           *location;
+        const char           *UUID;
+        const char           *admin_url;
+        /* ty, product, pdl, URF, usb_MFG, usb_MDL and usb_CMD keys of
+         * printers */
+        const char           *make_and_model;
+        const char           *product;
+        const char           *pdl;
+        const char           *urf;
+        const char           *usb_mfg;
+        const char           *usb_mdl;
+        const char           *usb_cmd;
+        /* a static string, not part of the string block */
+        const char           *object_type;
+        gint64               printer_type,
+                             printer_state;
+        gboolean             got_printer_state,
+                             got_printer_type;
+        gboolean             color,
+                             got_color;
+        gboolean             duplex,
+                             got_duplex;
+        int                  port;
+        int                  interface;
+        int                  family;
+        /* for the items of a browser: a resolution was started */
+        gboolean             resolving;
+} AvahiData;
+
+/* The strings of a record, in the order of the string block. */
+typedef enum
+{
+        AVAHI_DATA_NAME,
+        AVAHI_DATA_TYPE,
+        AVAHI_DATA_DOMAIN,
+        AVAHI_DATA_HOSTNAME,
+        AVAHI_DATA_ADDRESS,
+        AVAHI_DATA_RESOURCE_PATH,
+        AVAHI_DATA_LOCATION,
+        AVAHI_DATA_UUID,
+        AVAHI_DATA_ADMIN_URL,
+        AVAHI_DATA_MAKE_AND_MODEL,
+        AVAHI_DATA_PRODUCT,
+        AVAHI_DATA_PDL,
+        AVAHI_DATA_URF,
+        AVAHI_DATA_USB_MFG,
+        AVAHI_DATA_USB_MDL,
+        AVAHI_DATA_USB_CMD,
+        AVAHI_DATA_N_STRINGS
+} AvahiDataString;
+
+static const glong avahi_data_string_offsets[AVAHI_DATA_N_STRINGS] = {
+        G_STRUCT_OFFSET (AvahiData, name),
+        G_STRUCT_OFFSET (AvahiData, type),
+        G_STRUCT_OFFSET (AvahiData, domain),
+        G_STRUCT_OFFSET (AvahiData, hostname),
+        G_STRUCT_OFFSET (AvahiData, address),
+        G_STRUCT_OFFSET (AvahiData, resource_path),
+        G_STRUCT_OFFSET (AvahiData, location),
+        G_STRUCT_OFFSET (AvahiData, UUID),
+        G_STRUCT_OFFSET (AvahiData, admin_url),
+        G_STRUCT_OFFSET (AvahiData, make_and_model),
+        G_STRUCT_OFFSET (AvahiData, product),
+        G_STRUCT_OFFSET (AvahiData, pdl),
+        G_STRUCT_OFFSET (AvahiData, urf),
+        G_STRUCT_OFFSET (AvahiData, usb_mfg),
+        G_STRUCT_OFFSET (AvahiData, usb_mdl),
+        G_STRUCT_OFFSET (AvahiData, usb_cmd)
+};
+
+/* A string that is not nul-terminated, typically pointing into a D-Bus
+ * message; value is NULL if the string is not set. */
+typedef struct
+{
+        const char *value;
+        gsize       length;
+} AvahiString;
+
+typedef struct
+{
+        CphCupsGetDevices *data;
+        gint              signal_pappl;      
+}
+pappl_data_callback;
+
+int
+pappl_timeout_cb (gpointer      user_data)
+{
+        ((pappl_data_callback*)(user_data))->signal_pappl = 1;
+
+        return 0;
+}
+
+/* A service is identified by (interface, protocol, name, type, domain): the
+ * same name can be seen on several interfaces, or for both protocols. */
+static guint
+avahi_data_hash (gconstpointer key)
+{
+        const AvahiData *data = key;
+        guint            hash;
+
+        hash = data->name ? g_str_hash (data->name) : 0;
+        hash = hash * 31 + (data->type ? g_str_hash (data->type) : 0);
+        hash = hash * 31 + (data->domain ? g_str_hash (data->domain) : 0);
+        hash = hash * 31 + (guint) data->interface;
+        hash = hash * 31 + (guint) data->family;
+
+        return hash;
+}
+
+static gboolean
+avahi_data_equal (gconstpointer a,
+                  gconstpointer b)
+{
+        const AvahiData *data_1 = a;
+        const AvahiData *data_2 = b;
+
+        return data_1->interface == data_2->interface &&
+               data_1->family == data_2->family &&
+               g_strcmp0 (data_1->name, data_2->name) == 0 &&
+               g_strcmp0 (data_1->type, data_2->type) == 0 &&
+               g_strcmp0 (data_1->domain, data_2->domain) == 0;
+}
+
+/* Creates a record with the fields of template, and a copy of the strings.
+ * Records come from the slice allocator, so that services coming and going
+ * reuse the same memory. */
+static AvahiData *
+avahi_data_new (const AvahiData   *template,
+                const AvahiString *strings)
+{
+        AvahiData *data;
+        gsize      size;
+        char      *block;
+        int        i;
+
+        size = sizeof (AvahiData);
+        for (i = 0; i < AVAHI_DATA_N_STRINGS; i++)
+                if (strings[i].value)
+                        size += strings[i].length + 1;
+
+        data = g_slice_alloc (size);
+        *data = *template;
+        data->ref_count = 1;
+        data->size = size;
+
+        block = (char *) (data + 1);
+        for (i = 0; i < AVAHI_DATA_N_STRINGS; i++) {
+                const char **field;
+
+                field = &G_STRUCT_MEMBER (const char *, data, avahi_data_string_offsets[i]);
+
+                if (!strings[i].value) {
+                        *field = NULL;
+                        continue;
+                }
+
+                memcpy (block, strings[i].value, strings[i].length);
+                block[strings[i].length] = '\0';
+                *field = block;
+                block += strings[i].length + 1;
+        }
+
+        return data;
+}
+
+/* Creates the record for the key of a service, as used by the items of a
+ * browser. */
+static AvahiData *
+avahi_data_new_key (int         interface,
+                    int         protocol,
+                    const char *name,
+                    const char *type,
+                    const char *domain)
+{
+        AvahiString strings[AVAHI_DATA_N_STRINGS];
+        AvahiData   template;
+
+        memset (&template, 0, sizeof (template));
+        template.interface = interface;
+        template.family = protocol;
+
+        memset (strings, 0, sizeof (strings));
+        strings[AVAHI_DATA_NAME].value = name;
+        strings[AVAHI_DATA_NAME].length = strlen (name);
+        strings[AVAHI_DATA_TYPE].value = type;
+        strings[AVAHI_DATA_TYPE].length = strlen (type);
+        strings[AVAHI_DATA_DOMAIN].value = domain;
+        strings[AVAHI_DATA_DOMAIN].length = strlen (domain);
+
+        return avahi_data_new (&template, strings);
+}
+
+static AvahiData *
+avahi_data_ref (AvahiData *data)
+{
+        g_atomic_int_inc (&data->ref_count);
+
+        return data;
+}
+
+static void
+avahi_data_unref (AvahiData *data)
+{
+        if (g_atomic_int_dec_and_test (&data->ref_count))
+                g_slice_free1 (data->size, data);
+}
+
+/* Tells the browse operations about a service; resolved tells whether data
+ * is a resolved service, or an item which only has the key of the
+ * service. */
+static void
+avahi_browser_service_added (Avahi     *backend,
+                             AvahiData *data,
+                             gboolean   resolved)
+{
+        GList *l;
+
+        for (l = backend->watchers; l != NULL; l = l->next) {
+                CphPrinterAppBrowse *browse = ((AvahiWatcher *) l->data)->browse;
+
+                if (browse->added_cb && browse->resolve == resolved)
+                        browse->added_cb (data, browse->data);
+        }
+}
+
+static void
+avahi_browser_service_removed (Avahi     *backend,
+                               AvahiData *data,
+                               gboolean   resolved)
+{
+        GList *l;
+
+        for (l = backend->watchers; l != NULL; l = l->next) {
+                CphPrinterAppBrowse *browse = ((AvahiWatcher *) l->data)->browse;
+
+                if (browse->removed_cb && browse->resolve == resolved)
+                        browse->removed_cb (data, browse->data);
+        }
+}
+
+/* Returns whether the TXT entry (length bytes, not nul-terminated) is
+ * key=value; value then points into the entry. Keys are case-insensitive. */
+static gboolean
+avahi_txt_entry_value (const char  *entry,
+                       gsize        length,
+                       const char  *key,
+                       const char **value,
+                       gsize       *value_length)
+{
+        gsize key_length = strlen (key);
+
+        if (length <= key_length ||
+            entry[key_length] != '=' ||
+            g_ascii_strncasecmp (entry, key, key_length) != 0)
+                return FALSE;
+
+        *value = entry + key_length + 1;
+        *value_length = length - key_length - 1;
+
+        return TRUE;
+}
+
+/* Only the first occurrence of a key counts (RFC 6763, section 6.4). */
+static void
+avahi_txt_set_string (AvahiString *field,
+                      const char  *value,
+                      gsize        value_length)
+{
+        if (field->value == NULL && value_length > 0) {
+                field->value = value;
+                field->length = value_length;
+        }
+}
+
+static gboolean
+avahi_txt_parse_number (const char *value,
+                        gsize       value_length,
+                        guint       base,
+                        gint64     *number)
+{
+        char  buf[32];
+        char *endptr;
+
+        if (value_length == 0 || value_length >= sizeof (buf))
+                return FALSE;
+
+        memcpy (buf, value, value_length);
+        buf[value_length] = '\0';
+
+        *number = g_ascii_strtoull (buf, &endptr, base);
+
+        return endptr != buf;
+}
+
+static gboolean
+avahi_txt_parse_boolean (const char *value,
+                         gsize       value_length)
+{
+        return value_length == 1 && (value[0] == 'T' || value[0] == 't');
+}
+
+/* Parses the TXT record in place: strings only point to the values which
+ * are kept, inside txt, until the record gets built. */
+static void
+avahi_data_parse_txt (AvahiData   *data,
+                      AvahiString *strings,
+                      GVariant    *txt)
+{
+        gsize n_entries;
+        gsize i;
+
+        n_entries = g_variant_n_children (txt);
+
+        for (i = 0; i < n_entries; i++) {
+                GVariant   *child;
+                const char *entry;
+                const char *value;
+                gsize       length;
+                gsize       value_length;
+
+                /* the children of a serialized variant share its data, so
+                 * entry stays valid after child goes away */
+                child = g_variant_get_child_value (txt, i);
+                entry = g_variant_get_fixed_array (child, &length, sizeof (guchar));
+                g_variant_unref (child);
+
+                if (length == 0)
+                        continue;
+
+                if (avahi_txt_entry_value (entry, length, "rp", &value, &value_length)) {
+                        if (strings[AVAHI_DATA_RESOURCE_PATH].value == NULL) {
+                                strings[AVAHI_DATA_RESOURCE_PATH].value = value;
+                                strings[AVAHI_DATA_RESOURCE_PATH].length = value_length;
+                        }
+                } else if (avahi_txt_entry_value (entry, length, "note", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_LOCATION], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "printer-type", &value, &value_length)) {
+                        if (!data->got_printer_type)
+                                data->got_printer_type = avahi_txt_parse_number (value, value_length, 16,
+                                                                                 &data->printer_type);
+                } else if (avahi_txt_entry_value (entry, length, "printer-state", &value, &value_length)) {
+                        if (!data->got_printer_state)
+                                data->got_printer_state = avahi_txt_parse_number (value, value_length, 10,
+                                                                                  &data->printer_state);
+                } else if (avahi_txt_entry_value (entry, length, "UUID", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_UUID], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "adminurl", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_ADMIN_URL], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "ty", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_MAKE_AND_MODEL], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "product", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_PRODUCT], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "pdl", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_PDL], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "URF", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_URF], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "usb_MFG", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_USB_MFG], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "usb_MDL", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_USB_MDL], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "usb_CMD", &value, &value_length)) {
+                        avahi_txt_set_string (&strings[AVAHI_DATA_USB_CMD], value, value_length);
+                } else if (avahi_txt_entry_value (entry, length, "Color", &value, &value_length)) {
+                        if (!data->got_color) {
+                                data->color = avahi_txt_parse_boolean (value, value_length);
+                                data->got_color = TRUE;
+                        }
+                } else if (avahi_txt_entry_value (entry, length, "Duplex", &value, &value_length)) {
+                        if (!data->got_duplex) {
+                                data->duplex = avahi_txt_parse_boolean (value, value_length);
+                                data->got_duplex = TRUE;
+                        }
+                }
+        }
+}
+
+static void
+avahi_string_set (AvahiString *string,
+                  const char  *value)
+{
+        string->value = value;
+        string->length = strlen (value);
+}
+
+/* Builds the service from the reply to ResolveService. */
+static AvahiData *
+avahi_data_new_from_reply (GVariant *output)
+{
+        AvahiString              strings[AVAHI_DATA_N_STRINGS];
+        AvahiData                template;
+        AvahiData               *data;
+        const char              *name;
+        const char              *hostname;
+        const char              *type;
+        const char              *domain;
+        const char              *address;
+        GVariant                *txt;
+        guint32                  flags;
+        guint16                  port;
+        int                      interface;
+        int                      protocol;
+        int                      aprotocol;
+
+        g_variant_get (output, "(ii&s&s&s&si&sq@aayu)",
+                       &interface,
+                       &protocol,
+                       &name,
+                       &type,
+                       &domain,
+                       &hostname,
+                       &aprotocol,
+                       &address,
+                       &port,
+                       &txt,
+                       &flags);
+
+        memset (&template, 0, sizeof (template));
+        memset (strings, 0, sizeof (strings));
+
+        if (g_strcmp0 (type, "_ipps-system._tcp") == 0 ||
+            g_strcmp0 (type, "_ipp-system._tcp") == 0)
+                template.object_type = "SYSTEM_OBJECT";
+        else
+                template.object_type = "PRINTER_OBJECT";
+
+        avahi_data_parse_txt (&template, strings, txt);
+
+        avahi_string_set (&strings[AVAHI_DATA_NAME], name);
+        avahi_string_set (&strings[AVAHI_DATA_TYPE], type);
+        avahi_string_set (&strings[AVAHI_DATA_DOMAIN], domain);
+        avahi_string_set (&strings[AVAHI_DATA_HOSTNAME], hostname);
+        avahi_string_set (&strings[AVAHI_DATA_ADDRESS], address);
+        template.port = port;
+        template.interface = interface;
+        template.family = protocol;
+
+        data = avahi_data_new (&template, strings);
+
+        g_variant_unref (txt);
+
+        return data;
+}
+
+static void
+avahi_service_resolver_cb (GVariant*     output,
+                           gpointer      user_data)
+{
+        AvahiData               *data;
+        Avahi                   *backend;
+
+        backend = user_data;
+
+        data = avahi_data_new_from_reply (output);
+        g_variant_unref (output);
+
+        if (!g_hash_table_lookup (backend->system_object_index, data))
+          {
+             g_queue_push_tail (&backend->system_objects, data);
+             g_hash_table_insert (backend->system_object_index, data,
+                                  backend->system_objects.tail);
+             if (g_strcmp0 (data->object_type, "SYSTEM_OBJECT") == 0)
+                     _cph_app_registry_add_discovered (backend->cups, data->name,
+                                                       data->hostname, data->port);
+             avahi_browser_service_added (backend, data, TRUE);
+             g_debug ("Resolved %s", data->hostname);
+          }
+        else 
+         {
+             avahi_data_unref (data);
+         }
+}
+
+typedef struct
+{
+        Avahi               *backend;
+        /* the backend is gone once this is cancelled */
+        GCancellable        *cancellable;
+        int                  interface;
+        int                  protocol;
+        char                *name;
+        char                *type;
+        char                *domain;
+} AvahiResolveRequest;
+
+static void
+avahi_resolve_request_free (AvahiResolveRequest *request)
+{
+        if (request->cancellable)
+                g_object_unref (request->cancellable);
+        g_free (request->name);
+        g_free (request->type);
+        g_free (request->domain);
+        g_free (request);
+}
+
+/* Pending call of a browser; the browser is gone once cancellable got
+ * cancelled. */
+typedef struct
+{
+        Avahi               *backend;
+        GCancellable        *cancellable;
+} AvahiCall;
+
+static AvahiCall *
+avahi_call_new (Avahi *backend)
+{
+        AvahiCall *call;
+
+        call = g_new0 (AvahiCall, 1);
+        call->backend = backend;
+        call->cancellable = g_object_ref (backend->avahi_cancellable);
+
+        return call;
+}
+
+static void
+avahi_call_free (AvahiCall *call)
+{
+        g_object_unref (call->cancellable);
+        g_free (call);
+}
+
+/* A signal received before the path of its browser was known. */
+typedef struct
+{
+        char                *object_path;
+        char                *signal_name;
+        GVariant            *parameters;
+} AvahiSignal;
+
+static void
+avahi_signal_free (AvahiSignal *early)
+{
+        g_free (early->object_path);
+        g_free (early->signal_name);
+        g_variant_unref (early->parameters);
+        g_free (early);
+}
+
+static void _cph_printer_app_browse_backend_done (CphPrinterAppBrowse *browse);
+
+/* Stops waiting for the browser on behalf of a browse: what was found so
+ * far is all the browse will get. */
+static void
+avahi_watcher_done (AvahiWatcher *watcher)
+{
+        if (watcher->done)
+                return;
+
+        watcher->done = TRUE;
+        _cph_printer_app_browse_backend_done (watcher->browse);
+}
+
+static void
+avahi_browser_stop_waiting (Avahi *backend)
+{
+        GList *l;
+
+        for (l = backend->watchers; l != NULL; l = l->next)
+                avahi_watcher_done (l->data);
+}
+
+/* Browsing is complete once Avahi reported all the services it knows about
+ * and, if they are wanted resolved, all of them got resolved. */
+static gboolean
+avahi_browser_is_complete (Avahi    *backend,
+                           gboolean  resolve)
+{
+        if (!backend->all_for_now)
+                return FALSE;
+
+        return !resolve ||
+               (backend->resolutions_in_flight == 0 &&
+                g_queue_is_empty (&backend->pending_resolutions));
+}
+
+static void
+avahi_browser_check_done (Avahi *backend)
+{
+        GList *l;
+
+        for (l = backend->watchers; l != NULL; l = l->next) {
+                AvahiWatcher *watcher = l->data;
+
+                if (avahi_browser_is_complete (backend, watcher->browse->resolve))
+                        avahi_watcher_done (watcher);
+        }
+}
+
+static void
+avahi_service_browser_free_path (GDBusConnection *connection,
+                                 const char      *path)
+{
+        g_dbus_connection_call (connection,
+                                AVAHI_BUS,
+                                path,
+                                AVAHI_SERVICE_BROWSER_IFACE,
+                                "Free",
+                                NULL,
+                                NULL,
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                NULL,
+                                NULL,
+                                NULL);
+}
+
+static void
+avahi_browser_free (Avahi *backend)
+{
+        CphDiscoveryManager *manager = backend->manager;
+        GList               *l;
+
+        for (l = backend->watchers; l != NULL; l = l->next)
+                ((AvahiWatcher *) l->data)->backend = NULL;
+        g_list_free (backend->watchers);
+
+        if (backend->avahi_service_browser_subscription_id)
+                g_dbus_connection_signal_unsubscribe (manager->connection,
+                                                      backend->avahi_service_browser_subscription_id);
+
+        /* only when the manager goes away: a failed browser stops being
+         * created in avahi_browser_fail() */
+        if (backend->creating)
+                manager->creating--;
+
+        if (backend->avahi_service_browser_path) {
+                if (g_hash_table_lookup (manager->browsers_by_path,
+                                         backend->avahi_service_browser_path) == backend)
+                        g_hash_table_remove (manager->browsers_by_path,
+                                             backend->avahi_service_browser_path);
+
+                avahi_service_browser_free_path (manager->connection,
+                                                 backend->avahi_service_browser_path);
+        }
+
+        g_cancellable_cancel (backend->avahi_cancellable);
+        g_object_unref (backend->avahi_cancellable);
+
+        /* cancelling avahi_cancellable above detached the calls in
+         * flight from the backend */
+        g_list_free_full (backend->pending_resolutions.head,
+                          (GDestroyNotify) avahi_resolve_request_free);
+        g_hash_table_destroy (backend->item_index);
+        g_list_free_full (backend->items.head,
+                          (GDestroyNotify) avahi_data_unref);
+        g_hash_table_destroy (backend->system_object_index);
+        g_list_free_full (backend->system_objects.head,
+                          (GDestroyNotify) avahi_data_unref);
+        g_free (backend->avahi_service_browser_path);
+        g_free (backend->service_type);
+        g_free (backend);
+}
+
+static gboolean
+avahi_browser_free_idle (gpointer user_data)
+{
+        Avahi               *backend = user_data;
+        CphDiscoveryManager *manager = backend->manager;
+
+        backend->free_id = 0;
+        manager->failed = g_list_remove (manager->failed, backend);
+        avahi_browser_free (backend);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void avahi_manager_dispatch_early_signals (CphDiscoveryManager *manager);
+
+/* Gives up on a browser: the next browse for its service type gets a new
+ * one. It is freed from an idle callback, since this happens in its own
+ * callbacks. */
+static void
+avahi_browser_fail (Avahi *backend)
+{
+        CphDiscoveryManager *manager = backend->manager;
+
+        if (backend->free_id)
+                return;
+
+        g_hash_table_steal (manager->browsers, backend->service_type);
+        manager->failed = g_list_prepend (manager->failed, backend);
+        backend->free_id = g_idle_add (avahi_browser_free_idle, backend);
+
+        /* the reply to ServiceBrowserNew is dropped once the call is
+         * cancelled: the early signals must not wait for it */
+        if (backend->creating) {
+                backend->creating = FALSE;
+                manager->creating--;
+                avahi_manager_dispatch_early_signals (manager);
+        }
+
+        g_cancellable_cancel (backend->avahi_cancellable);
+
+        avahi_browser_stop_waiting (backend);
+}
+
+static void avahi_resolve_pending (Avahi *backend);
+static void avahi_browser_item_released (Avahi     *backend,
+                                         AvahiData *item);
+
+static void
+avahi_service_resolve_done (GObject      *source_object,
+                            GAsyncResult *result,
+                            gpointer      user_data)
+{
+        AvahiResolveRequest *request = user_data;
+        Avahi               *backend;
+        GVariant            *output;
+        GError              *error = NULL;
+
+        output = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object),
+                                                result, &error);
+
+        if (g_cancellable_is_cancelled (request->cancellable)) {
+                if (output)
+                        g_variant_unref (output);
+                g_clear_error (&error);
+                avahi_resolve_request_free (request);
+                return;
+        }
+
+        backend = request->backend;
+        backend->resolutions_in_flight--;
+
+        if (output)
+                avahi_service_resolver_cb (output, backend);
+        else {
+                AvahiData  key;
+                GList     *link;
+
+                g_debug ("Cannot resolve %s: %s", request->name, error->message);
+                g_error_free (error);
+
+                memset (&key, 0, sizeof (key));
+                key.interface = request->interface;
+                key.family = request->protocol;
+                key.name = request->name;
+                key.type = request->type;
+                key.domain = request->domain;
+
+                link = g_hash_table_lookup (backend->item_index, &key);
+                if (link)
+                        avahi_browser_item_released (backend, link->data);
+        }
+
+        avahi_resolve_request_free (request);
+
+        avahi_resolve_pending (backend);
+        avahi_browser_check_done (backend);
+}
+
+/* Starts resolver calls for the pending services, without going over the
+ * configured number of calls in flight. */
+static void
+avahi_resolve_pending (Avahi *backend)
+{
+        AvahiResolveRequest *request;
+
+        while (backend->resolutions_in_flight < backend->cups->priv->max_resolver_calls &&
+               (request = g_queue_pop_head (&backend->pending_resolutions)) != NULL) {
+                backend->resolutions_in_flight++;
+
+                g_dbus_connection_call (backend->manager->connection,
+                                        AVAHI_BUS,
+                                        "/",
+                                        AVAHI_SERVER_IFACE,
+                                        "ResolveService",
+                                        g_variant_new ("(iisssiu)",
+                                                       request->interface,
+                                                       request->protocol,
+                                                       request->name,
+                                                       request->type,
+                                                       request->domain,
+                                                       AVAHI_PROTO_UNSPEC,
+                                                       0),
+                                        G_VARIANT_TYPE ("(iissssisqaayu)"),
+                                        G_DBUS_CALL_FLAGS_NONE,
+                                        -1,
+                                        request->cancellable,
+                                        avahi_service_resolve_done,
+                                        request);
+        }
+}
+
+static void
+avahi_resolve_service (Avahi      *backend,
+                       int         interface,
+                       int         protocol,
+                       const char *name,
+                       const char *type,
+                       const char *domain)
+{
+        AvahiResolveRequest *request;
+
+        request = g_new0 (AvahiResolveRequest, 1);
+        request->backend = backend;
+        request->cancellable = g_object_ref (backend->avahi_cancellable);
+        request->interface = interface;
+        request->protocol = protocol;
+        request->name = g_strdup (name);
+        request->type = g_strdup (type);
+        request->domain = g_strdup (domain);
+
+        g_queue_push_tail (&backend->pending_resolutions, request);
+
+        avahi_resolve_pending (backend);
+}
+
+/* Forgets about a service that went away before it could be resolved. */
+static void
+avahi_unqueue_service (Avahi      *backend,
+                       int         interface,
+                       int         protocol,
+                       const char *name)
+{
+        GList *l;
+
+        for (l = backend->pending_resolutions.head; l != NULL; l = l->next) {
+                AvahiResolveRequest *request = l->data;
+
+                if (request->interface == interface &&
+                    request->protocol == protocol &&
+                    g_strcmp0 (request->name, name) == 0) {
+                        g_queue_delete_link (&backend->pending_resolutions, l);
+                        avahi_resolve_request_free (request);
+                        return;
+                }
+        }
+}
+
+/* Returns the item for the same service over the other IP protocol, if
+ * any. */
+static AvahiData *
+avahi_browser_lookup_sibling (Avahi     *backend,
+                              AvahiData *item)
+{
+        AvahiData  key;
+        GList     *link;
+
+        if (item->family != AVAHI_PROTO_INET &&
+            item->family != AVAHI_PROTO_INET6)
+                return NULL;
+
+        key = *item;
+        key.family = item->family == AVAHI_PROTO_INET ? AVAHI_PROTO_INET6
+                                                      : AVAHI_PROTO_INET;
+
+        link = g_hash_table_lookup (backend->item_index, &key);
+
+        return link ? link->data : NULL;
+}
+
+/* Services are usually announced over both IPv4 and IPv6, and the address
+ * of the printer can be resolved with either: only one of them is
+ * resolved. */
+static void
+avahi_browser_resolve_item (Avahi     *backend,
+                            AvahiData *item)
+{
+        AvahiData *sibling;
+
+        if (item->resolving)
+                return;
+
+        sibling = avahi_browser_lookup_sibling (backend, item);
+        if (sibling && sibling->resolving)
+                return;
+
+        item->resolving = TRUE;
+        avahi_resolve_service (backend, item->interface, item->family,
+                               item->name, item->type, item->domain);
+}
+
+/* Lets the other protocol resolve a service, once the item that was
+ * resolved went away or could not be resolved. */
+static void
+avahi_browser_item_released (Avahi     *backend,
+                             AvahiData *item)
+{
+        AvahiData *sibling;
+
+        if (!item->resolving || !backend->resolve)
+                return;
+
+        item->resolving = FALSE;
+
+        sibling = avahi_browser_lookup_sibling (backend, item);
+        if (sibling)
+                avahi_browser_resolve_item (backend, sibling);
+}
+
+static void
+avahi_browser_item_new (Avahi      *backend,
+                        int         interface,
+                        int         protocol,
+                        const char *name,
+                        const char *type,
+                        const char *domain)
+{
+        AvahiData  key;
+        AvahiData *item;
+
+        if (!_cph_cups_is_interface_wanted (backend->cups, interface))
+                return;
+
+        memset (&key, 0, sizeof (key));
+        key.interface = interface;
+        key.family = protocol;
+        key.name = name;
+        key.type = type;
+        key.domain = domain;
+
+        if (g_hash_table_lookup (backend->item_index, &key))
+                return;
+
+        item = avahi_data_new_key (interface, protocol, name, type, domain);
+        g_queue_push_tail (&backend->items, item);
+        g_hash_table_insert (backend->item_index, item, backend->items.tail);
+
+        avahi_browser_service_added (backend, item, FALSE);
+
+        if (backend->resolve)
+                avahi_browser_resolve_item (backend, item);
+}
+
+/* Starts resolving services as they come, and resolves those the browser
+ * already knows about. */
+static void
+avahi_browser_resolve_all (Avahi *backend)
+{
+        GList *l;
+
+        if (backend->resolve)
+                return;
+
+        backend->resolve = TRUE;
+
+        for (l = backend->items.head; l != NULL; l = l->next)
+                avahi_browser_resolve_item (backend, l->data);
+}
+
+static void
+avahi_browser_handle_signal (Avahi      *backend,
+                             const char *signal_name,
+                             GVariant   *parameters)
+{
+        char                *name;
+        char                *type;
+        char                *domain;
+        guint                flags;
+        int                  interface;
+        int                  protocol;
+
+        /* the browser failed, and is about to be freed */
+        if (backend->free_id)
+                return;
+
+        if (g_strcmp0 (signal_name, "ItemNew") == 0)
+          {
+            g_variant_get (parameters, "(ii&s&s&su)",
+                           &interface,
+                           &protocol,
+                           &name,
+                           &type,
+                           &domain,
+                           &flags);
+
+            avahi_browser_item_new (backend, interface, protocol,
+                                    name, type, domain);
+              
+          }
+        else if (g_strcmp0 (signal_name, "ItemRemove") == 0)
+          {
+            g_variant_get (parameters, "(ii&s&s&su)",
+                           &interface,
+                           &protocol,
+                           &name,
+                           &type,
+                           &domain,
+                           &flags);
+
+
+                AvahiData  key;
+                GList     *iter;
+
+                avahi_unqueue_service (backend, interface, protocol, name);
+
+                memset (&key, 0, sizeof (key));
+                key.interface = interface;
+                key.family = protocol;
+                key.name = name;
+                key.type = type;
+                key.domain = domain;
+
+                iter = g_hash_table_lookup (backend->system_object_index, &key);
+                if (iter != NULL)
+                  {
+                    AvahiData *removed = iter->data;
+
+                    g_hash_table_remove (backend->system_object_index, removed);
+                    g_queue_delete_link (&backend->system_objects, iter);
+                    if (g_strcmp0 (removed->object_type, "SYSTEM_OBJECT") == 0)
+                            _cph_app_registry_remove_discovered (backend->cups,
+                                                                 removed->hostname,
+                                                                 removed->port);
+                    avahi_browser_service_removed (backend, removed, TRUE);
+                    avahi_data_unref (removed);
+                  }
+
+                iter = g_hash_table_lookup (backend->item_index, &key);
+                if (iter != NULL)
+                  {
+                    AvahiData *removed = iter->data;
+
+                    g_hash_table_remove (backend->item_index, removed);
+                    g_queue_delete_link (&backend->items, iter);
+                    avahi_browser_service_removed (backend, removed, FALSE);
+                    avahi_browser_item_released (backend, removed);
+                    avahi_data_unref (removed);
+                  }
+
+                g_hash_table_remove (backend->manager->resolved, &key);
+
+            /* a service going away can complete the browsing */
+            avahi_browser_check_done (backend);
+          }
+        else if (g_strcmp0 (signal_name, "AllForNow") == 0)
+          {
+                backend->all_for_now = TRUE;
+                avahi_browser_check_done (backend);
+          }
+        else if (g_strcmp0 (signal_name, "Failure") == 0)
+          {
+                avahi_browser_fail (backend);
+          }
+
+   return;
+}
+
+static void
+avahi_service_browser_signal_handler (GDBusConnection *connection,
                                       const char      *sender_name,
                                       const char      *object_path,
                                       const char      *interface_name,
@@ -1802,633 +5991,3975 @@ avahi_service_browser_signal_handler (GDBusConnection *connection,
                                       GVariant        *parameters,
                                       gpointer         user_data)
 {
-        Avahi               *backend;
-        char                *name;
-        char                *type;
-        char                *domain;
-        guint                flags;
-        int                  interface;
-        int                  protocol;
+        avahi_browser_handle_signal (user_data, signal_name, parameters);
+}
+
+/* Dispatches the signals of all the browsers created without
+ * ServiceBrowserPrepare. */
+static void
+avahi_manager_signal_handler (GDBusConnection *connection,
+                              const char      *sender_name,
+                              const char      *object_path,
+                              const char      *interface_name,
+                              const char      *signal_name,
+                              GVariant        *parameters,
+                              gpointer         user_data)
+{
+        CphDiscoveryManager *manager = user_data;
+        Avahi               *backend;
+        AvahiSignal         *early;
+
+        backend = g_hash_table_lookup (manager->browsers_by_path, object_path);
+        if (backend) {
+                avahi_browser_handle_signal (backend, signal_name, parameters);
+                return;
+        }
+
+        /* the browser can emit signals before ServiceBrowserNew returns its
+         * path; signals of browsers of other clients are dropped once no
+         * browser is being created anymore */
+        if (manager->creating == 0)
+                return;
+
+        early = g_new0 (AvahiSignal, 1);
+        early->object_path = g_strdup (object_path);
+        early->signal_name = g_strdup (signal_name);
+        early->parameters = g_variant_ref (parameters);
+        g_queue_push_tail (&manager->early_signals, early);
+}
+
+static void
+avahi_manager_dispatch_early_signals (CphDiscoveryManager *manager)
+{
+        GList *l;
+        GList *next;
+
+        for (l = manager->early_signals.head; l != NULL; l = next) {
+                AvahiSignal *early = l->data;
+                Avahi       *backend;
+
+                next = l->next;
+
+                backend = g_hash_table_lookup (manager->browsers_by_path,
+                                               early->object_path);
+                if (backend == NULL && manager->creating > 0)
+                        continue;
+
+                g_queue_delete_link (&manager->early_signals, l);
+                if (backend)
+                        avahi_browser_handle_signal (backend,
+                                                     early->signal_name,
+                                                     early->parameters);
+                avahi_signal_free (early);
+        }
+}
+
+/* Takes care of the reply to a call creating a browser which got cancelled:
+ * nobody is interested in the browser anymore. */
+static void
+avahi_service_browser_drop (GDBusConnection *connection,
+                            GVariant        *output)
+{
+        char *path;
+
+        if (output == NULL)
+                return;
+
+        g_variant_get (output, "(o)", &path);
+        avahi_service_browser_free_path (connection, path);
+        g_free (path);
+        g_variant_unref (output);
+}
+
+static void
+avahi_service_browser_new_cb (GObject      *source_object,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+        AvahiCall           *call = user_data;
+        CphDiscoveryManager *manager;
+        Avahi               *backend;
+        GVariant            *output;
+        GError              *error = NULL;
+
+        output = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object),
+                                                result, &error);
+
+        if (g_cancellable_is_cancelled (call->cancellable)) {
+                avahi_service_browser_drop (G_DBUS_CONNECTION (source_object),
+                                            output);
+                g_clear_error (&error);
+                avahi_call_free (call);
+                return;
+        }
+
+        backend = call->backend;
+        manager = backend->manager;
+        avahi_call_free (call);
+
+        backend->creating = FALSE;
+        manager->creating--;
+
+        if (output) {
+                g_variant_get (output, "(o)", &backend->avahi_service_browser_path);
+                g_hash_table_insert (manager->browsers_by_path,
+                                     backend->avahi_service_browser_path,
+                                     backend);
+                g_variant_unref (output);
+        } else {
+                /*
+                 * The creation of ServiceBrowser fails with G_IO_ERROR_DBUS_ERROR
+                 * if Avahi is disabled. No signal will ever come then, so do not
+                 * wait for one.
+                 */
+                g_debug ("Cannot browse for %s: %s",
+                         backend->service_type, error->message);
+                g_error_free (error);
+                avahi_browser_fail (backend);
+        }
+
+        avahi_manager_dispatch_early_signals (manager);
+}
+
+static void
+avahi_service_browser_start_cb (GObject      *source_object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+        AvahiCall           *call = user_data;
+        GVariant            *output;
+        GError              *error = NULL;
+
+        output = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object),
+                                                result, &error);
+
+        if (output)
+                g_variant_unref (output);
+        else if (!g_cancellable_is_cancelled (call->cancellable)) {
+                g_debug ("Cannot browse for %s: %s",
+                         call->backend->service_type, error->message);
+                avahi_browser_fail (call->backend);
+        }
+
+        g_clear_error (&error);
+        avahi_call_free (call);
+}
+
+static gboolean
+avahi_error_is_unknown_method (GError *error)
+{
+        char     *remote;
+        gboolean  unknown;
+
+        if (g_error_matches (error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+                return TRUE;
+
+        remote = g_dbus_error_get_remote_error (error);
+        unknown = g_strcmp0 (remote, "org.freedesktop.DBus.Error.UnknownInterface") == 0;
+        g_free (remote);
+
+        return unknown;
+}
+
+static void avahi_browser_create (Avahi *backend);
+
+static void
+avahi_service_browser_prepare_cb (GObject      *source_object,
+                                  GAsyncResult *result,
+                                  gpointer      user_data)
+{
+        AvahiCall           *call = user_data;
+        Avahi               *backend;
+        GVariant            *output;
+        GError              *error = NULL;
+
+        output = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object),
+                                                result, &error);
+
+        if (g_cancellable_is_cancelled (call->cancellable)) {
+                avahi_service_browser_drop (G_DBUS_CONNECTION (source_object),
+                                            output);
+                g_clear_error (&error);
+                avahi_call_free (call);
+                return;
+        }
+
+        backend = call->backend;
+        avahi_call_free (call);
+
+        if (output == NULL) {
+                if (avahi_error_is_unknown_method (error)) {
+                        backend->manager->no_prepare = TRUE;
+                        avahi_browser_create (backend);
+                } else {
+                        g_debug ("Cannot browse for %s: %s",
+                                 backend->service_type, error->message);
+                        avahi_browser_fail (backend);
+                }
+                g_error_free (error);
+                return;
+        }
+
+        g_variant_get (output, "(o)", &backend->avahi_service_browser_path);
+        g_variant_unref (output);
+
+        /* The browser does not emit anything before it is started, so
+         * subscribing to its path only cannot miss a signal */
+        backend->avahi_service_browser_subscription_id =
+          g_dbus_connection_signal_subscribe (backend->manager->connection,
+                                              AVAHI_BUS,
+                                              AVAHI_SERVICE_BROWSER_IFACE,
+                                              NULL,
+                                              backend->avahi_service_browser_path,
+                                              NULL,
+                                              G_DBUS_SIGNAL_FLAGS_NONE,
+                                              avahi_service_browser_signal_handler,
+                                              backend,
+                                              NULL);
+
+        g_dbus_connection_call (backend->manager->connection,
+                                AVAHI_BUS,
+                                backend->avahi_service_browser_path,
+                                AVAHI_SERVICE_BROWSER_IFACE,
+                                "Start",
+                                NULL,
+                                NULL,
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                backend->avahi_cancellable,
+                                avahi_service_browser_start_cb,
+                                avahi_call_new (backend));
+}
+
+static void
+avahi_browser_create (Avahi *backend)
+{ 
+        CphDiscoveryManager *manager = backend->manager;
+
+        if (!manager->no_prepare) {
+                g_dbus_connection_call (manager->connection,
+                                        AVAHI_BUS,
+                                        "/",
+                                        AVAHI_SERVER2_IFACE,
+                                        "ServiceBrowserPrepare",
+                                        g_variant_new ("(iissu)",
+                                                       AVAHI_IF_UNSPEC,
+                                                       backend->cups->priv->discovery_protocol,
+                                                       backend->service_type,
+                                                       "",
+                                                       0),
+                                        G_VARIANT_TYPE ("(o)"),
+                                        G_DBUS_CALL_FLAGS_NONE,
+                                        -1,
+                                        backend->avahi_cancellable,
+                                        avahi_service_browser_prepare_cb,
+                                        avahi_call_new (backend));
+                return;
+        }
+
+        if (manager->fallback_subscription_id == 0)
+                manager->fallback_subscription_id =
+                  g_dbus_connection_signal_subscribe (manager->connection,
+                                                      AVAHI_BUS,
+                                                      AVAHI_SERVICE_BROWSER_IFACE,
+                                                      NULL,
+                                                      NULL,
+                                                      NULL,
+                                                      G_DBUS_SIGNAL_FLAGS_NONE,
+                                                      avahi_manager_signal_handler,
+                                                      manager,
+                                                      NULL);
+
+        backend->creating = TRUE;
+        manager->creating++;
+
+        g_dbus_connection_call (manager->connection,
+                                AVAHI_BUS,
+                                "/",
+                                AVAHI_SERVER_IFACE,
+                                "ServiceBrowserNew",
+                                g_variant_new ("(iissu)",
+                                               AVAHI_IF_UNSPEC,
+                                               backend->cups->priv->discovery_protocol,
+                                               backend->service_type,
+                                               "",
+                                               0),
+                                G_VARIANT_TYPE ("(o)"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                -1,
+                                backend->avahi_cancellable,
+                                avahi_service_browser_new_cb,
+                                avahi_call_new (backend));
+}
+
+/******************************************************
+ * Discovery manager
+ ******************************************************/
+
+static CphDiscoveryManager *
+_cph_discovery_manager_new (CphCups *cups)
+{
+        CphDiscoveryManager *manager;
+
+        manager = g_new0 (CphDiscoveryManager, 1);
+        manager->cups = cups;
+        /* the keys belong to the browsers */
+        manager->browsers = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   NULL,
+                                                   (GDestroyNotify) avahi_browser_free);
+        manager->browsers_by_path = g_hash_table_new (g_str_hash, g_str_equal);
+        manager->resolved = g_hash_table_new_full (avahi_data_hash, avahi_data_equal,
+                                                   NULL,
+                                                   (GDestroyNotify) avahi_data_unref);
+
+        return manager;
+}
+
+static void
+_cph_discovery_manager_free (CphDiscoveryManager *manager)
+{
+        GList *l;
+
+        g_hash_table_destroy (manager->browsers);
+
+        for (l = manager->failed; l != NULL; l = l->next) {
+                Avahi *backend = l->data;
+
+                g_source_remove (backend->free_id);
+                avahi_browser_free (backend);
+        }
+        g_list_free (manager->failed);
+
+        g_hash_table_destroy (manager->browsers_by_path);
+        g_hash_table_destroy (manager->resolved);
+        g_list_free_full (manager->early_signals.head,
+                          (GDestroyNotify) avahi_signal_free);
+
+        if (manager->fallback_subscription_id)
+                g_dbus_connection_signal_unsubscribe (manager->connection,
+                                                      manager->fallback_subscription_id);
+
+        if (manager->connection)
+                g_object_unref (manager->connection);
+
+        g_free (manager);
+}
+
+static gboolean
+_cph_discovery_manager_connect (CphDiscoveryManager *manager)
+{
+        GError *error = NULL;
+
+        if (manager->connection)
+                return TRUE;
+
+        manager->connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+        if (manager->connection == NULL) {
+                g_debug ("Cannot connect to the system bus: %s", error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Returns the resolved service matching the key of key, if any browser or
+ * an earlier call resolved it already. */
+static AvahiData *
+_cph_discovery_manager_lookup_resolved (CphDiscoveryManager *manager,
+                                        AvahiData           *key)
+{
+        Avahi *backend;
+        GList *link;
+
+        backend = g_hash_table_lookup (manager->browsers, key->type);
+        if (backend &&
+            (link = g_hash_table_lookup (backend->system_object_index, key)) != NULL)
+                return link->data;
+
+        return g_hash_table_lookup (manager->resolved, key);
+}
+
+/* Returns the browser for service_type, creating it if there is none yet;
+ * NULL if the system bus cannot be reached. If resolve is TRUE, the browser
+ * resolves the services it finds. */
+static Avahi *
+_cph_discovery_manager_get_browser (CphDiscoveryManager *manager,
+                                    const char          *service_type,
+                                    gboolean             resolve)
+{
+        Avahi  *backend;
+
+        if (!_cph_discovery_manager_connect (manager))
+                return NULL;
+
+        backend = g_hash_table_lookup (manager->browsers, service_type);
+        if (backend) {
+                if (resolve)
+                        avahi_browser_resolve_all (backend);
+                return backend;
+        }
+
+        backend = g_new0 (Avahi, 1);
+        backend->manager = manager;
+        backend->cups = manager->cups;
+        backend->service_type = g_strdup (service_type);
+        backend->avahi_cancellable = g_cancellable_new ();
+        backend->resolve = resolve;
+        backend->item_index = g_hash_table_new (avahi_data_hash,
+                                                avahi_data_equal);
+        backend->system_object_index = g_hash_table_new (avahi_data_hash,
+                                                         avahi_data_equal);
+
+        g_hash_table_insert (manager->browsers, backend->service_type, backend);
+
+        avahi_browser_create (backend);
+
+        return backend;
+}
+
+static void 
+_cph_cups_pappl_device_err_cb (const char        *message,
+                               void              *data)
+{        
+        CphCups *cups = data;
+        _cph_cups_set_internal_status ( cups, 
+                          g_strdup_printf ("%s",message));
+        
+        return;
+}
+
+static bool
+_cph_cups_pappl_device_cb (const char    *device_info,
+                          const char    *device_uri,
+                          const char    *device_id,
+                          void          *user_data)
+{
+        CphCupsGetDevices *data = user_data;
+
+        if (data == NULL) 
+        {
+                return FALSE;
+        }
+
+        _cph_cups_get_devices_cb (NULL, device_id, device_info, NULL, device_uri, NULL, data);
+   
+   return TRUE;
+}
+
+int _parse_app_devices (CphCups                 *cups,
+                        CphCupsGetDevices       *data,
+                        FILE                    *fp)
+{
+        char     buf[2048];
+        char     device_uri[1024];
+        char	 device_id[1024];
+
+        while (fgets (buf, sizeof (buf), fp))
+          {
+
+	         strcpy (device_uri,buf);
+
+                 device_uri[strlen (device_uri) - 1] = '\0';                
+                _cph_cups_get_devices_cb ( NULL, device_id, NULL, NULL, device_uri, NULL, NULL);
+          }
+
+          return 0;     
+}
+
+typedef enum
+{
+        /* not asked, as the scan was over or the application is left out */
+        CPH_APP_QUERY_SKIPPED,
+        CPH_APP_QUERY_OK,
+        CPH_APP_QUERY_FAILED
+} CphAppQueryStatus;
+
+/* Asks a printer application for the devices it can drive, adding them to
+ * the table of data. */
+static CphAppQueryStatus
+_cph_cups_printer_app_query_devices (AvahiData         *printer_app,
+                                     CphCupsGetDevices *data)
+{
+        
+        ipp_t		        *request,		
+		                *response;		
+        ipp_attribute_t         *attr;		
+        CphAppConnection        *connection;
+        CphAppQueryStatus        status;
+        const char              *values[APP_COL_N_MEMBERS];
+        char                    *system_uri;
+        int                      count;
+        int                      i;
+
+        if (_cph_cups_deadline_expired (data->deadline) ||
+            g_cancellable_is_cancelled (data->cancellable))
+                return CPH_APP_QUERY_SKIPPED;
+
+        connection = _cph_app_connection_get (data->cups,
+                                              printer_app->hostname,
+                                              printer_app->port,
+                                              HTTP_ENCRYPTION_IF_REQUESTED,
+                                              data->deadline,
+                                              data->cancellable);
+        if (connection == NULL)
+                return g_cancellable_is_cancelled (data->cancellable) ? CPH_APP_QUERY_SKIPPED
+                                                                      : CPH_APP_QUERY_FAILED;
+
+        system_uri = _cph_printer_app_system_uri (printer_app->hostname,
+                                                  printer_app->port);
+        if (system_uri == NULL) {
+                _cph_app_connection_release (data->cups, connection, TRUE);
+                return CPH_APP_QUERY_FAILED;
+        }
+
+        request = ippNewRequest(IPP_OP_PAPPL_FIND_DEVICES);
+        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_CHARSET, "attributes-charset", NULL, "utf-8");
+        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_LANGUAGE, "attributes-natural-language", NULL, "en-GB");
+        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, system_uri);
+        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
+        ippAddStrings(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "smi55357-device-type",
+                      data->app_device_types->len, NULL,
+                      (const char **) data->app_device_types->pdata);
+        /* only the devices are of interest */
+        ippAddString(request, IPP_TAG_OPERATION, IPP_CONST_TAG (IPP_TAG_KEYWORD),
+                     "requested-attributes", NULL, "smi55357-device-col");
+        response = cupsDoRequest(connection->http, request, "/ipp/system");         
+        _cph_app_connection_release (data->cups, connection, response != NULL);
+        g_free (system_uri);
+
+        if (response && ippGetStatusCode (response) <= IPP_OK_CONFLICT)
+                status = CPH_APP_QUERY_OK;
+        else if (g_cancellable_is_cancelled (data->cancellable))
+                status = CPH_APP_QUERY_SKIPPED;
+        else
+                status = CPH_APP_QUERY_FAILED;
+
+        attr = ippFindAttribute (response, "smi55357-device-col",
+                                 IPP_TAG_BEGIN_COLLECTION);
+        count = attr ? ippGetCount (attr) : 0;
+
+        for (i = 0; i < count; i++) {
+                _cph_printer_app_decode_col (ippGetCollection (attr, i), values);
+
+                if (!values[APP_COL_DEVICE_URI] ||
+                    !_cph_cups_is_uri_wanted (data, values[APP_COL_DEVICE_URI]))
+                        continue;
+
+                _cph_device_table_add (&data->table,
+                                       CPH_DEVICE_SOURCE_PRINTER_APP,
+                                       NULL,
+                                       values[APP_COL_DEVICE_ID],
+                                       values[APP_COL_DEVICE_INFO],
+                                       NULL,
+                                       values[APP_COL_DEVICE_URI],
+                                       NULL,
+                                       NULL);
+        }
+
+        ippDelete (response);
+
+        return status;
+}
+
+/* FIND_DEVICES blocks until the printer application answers: the queries
+ * run in a pool of threads, so that a scan takes as long as the slowest
+ * printer application, and not as long as all of them. */
+
+static void
+_cph_app_job_thread (gpointer data,
+                     gpointer pool_data)
+{
+        CphAppJob *job = data;
+
+        job->run (job);
+
+        /* the results are handled in the main loop */
+        g_idle_add (job->done, job);
+}
+
+static void
+_cph_app_job_push (CphCups   *cups,
+                   CphAppJob *job)
+{
+        if (cups->priv->app_query_pool == NULL)
+                cups->priv->app_query_pool = g_thread_pool_new (_cph_app_job_thread,
+                                                                NULL,
+                                                                cups->priv->max_app_queries,
+                                                                FALSE,
+                                                                NULL);
+
+        g_thread_pool_push (cups->priv->app_query_pool, job, NULL);
+}
+
+typedef void (*CphAppQueryDone) (CphDeviceTable *table,
+                                 AvahiData      *printer_app,
+                                 gpointer        user_data);
+
+typedef struct
+{
+        CphAppJob          job;
+        CphCups           *cups;
+        /* the filters of the scan, and the devices of this printer
+         * application */
+        CphCupsGetDevices  data;
+        AvahiData         *printer_app;
+        CphAppQueryStatus  status;
+        gint64             latency;
+        CphAppQueryDone    done_cb;
+        gpointer           done_data;
+} CphAppQuery;
+
+static gboolean
+_cph_app_query_done_idle (gpointer user_data)
+{
+        CphAppQuery   *query = user_data;
+        CphPrinterApp *app;
+
+        app = _cph_app_registry_get (query->cups,
+                                     query->printer_app->hostname,
+                                     query->printer_app->port);
+
+        if (app && query->status != CPH_APP_QUERY_SKIPPED)
+                _cph_printer_app_record (query->cups, app,
+                                         query->status == CPH_APP_QUERY_OK,
+                                         query->latency);
+
+        /* a failed query says nothing about the devices */
+        if (query->status == CPH_APP_QUERY_OK)
+                _cph_app_registry_set_devices (query->cups,
+                                               query->printer_app->hostname,
+                                               query->printer_app->port,
+                                               &query->data.table,
+                                               query->data.include_schemes == NULL &&
+                                               query->data.exclude_schemes == NULL);
+
+        query->done_cb (&query->data.table, query->printer_app, query->done_data);
+
+        _cph_device_table_clear (&query->data.table);
+        avahi_data_unref (query->printer_app);
+        if (query->data.cancellable)
+                g_object_unref (query->data.cancellable);
+        g_object_unref (query->cups);
+        g_free (query);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+_cph_app_query_run (gpointer job)
+{
+        CphAppQuery *query = job;
+        gint64       start;
+
+        start = g_get_monotonic_time ();
+        query->status = _cph_cups_printer_app_query_devices (query->printer_app,
+                                                             &query->data);
+        query->latency = g_get_monotonic_time () - start;
+}
+
+/* Asks printer_app for its devices in the worker pool. data gives the
+ * filters, and must stay valid until done_cb gets called, in the main loop,
+ * with the devices that were found. */
+static void
+_cph_cups_printer_app_query_devices_async (CphCups                 *cups,
+                                           AvahiData               *printer_app,
+                                           const CphCupsGetDevices *data,
+                                           CphAppQueryDone          done_cb,
+                                           gpointer                 done_data)
+{
+        CphAppQuery *query;
+
+        query = g_new0 (CphAppQuery, 1);
+        query->job.run = _cph_app_query_run;
+        query->job.done = _cph_app_query_done_idle;
+        query->cups = g_object_ref (cups);
+        query->data = *data;
+        query->data.cups = cups;
+        if (query->data.cancellable)
+                g_object_ref (query->data.cancellable);
+        _cph_device_table_init (&query->data.table, -1);
+        query->printer_app = avahi_data_ref (printer_app);
+        query->done_cb = done_cb;
+        query->done_data = done_data;
+
+        /* an application which keeps failing is only probed, and the scan
+         * does not wait for it */
+        if (!_cph_app_registry_is_available (cups, printer_app->hostname,
+                                             printer_app->port)) {
+                query->status = CPH_APP_QUERY_SKIPPED;
+                g_idle_add (query->job.done, query);
+                return;
+        }
+
+        _cph_app_job_push (cups, &query->job);
+}
+
+static void 
+discover_printer_app_devices_cb (gpointer  cb_data,
+                                gpointer user_data)
+{
+        AvahiData *printer_app = cb_data;
+        char                *key;
+        CphCupsGetPrinterApps  *data = user_data;
+
+        if (printer_app->hostname && printer_app->hostname[0] != '\0') {
+                        key  = g_strdup_printf ("hostname:%d", data->iter);
+                        g_debug ("Found printer application %s", printer_app->hostname);
+                        g_variant_builder_add (data->builder, "{ss}",
+                                               key, printer_app->hostname);
+                        g_free (key);
+        }
+        
+        if (printer_app->port > 0) {
+                char *port;
+
+                key  = g_strdup_printf ("port:%d", data->iter);
+                port = g_strdup_printf ("%i", printer_app->port);
+                g_variant_builder_add (data->builder, "{ss}",
+                                       key, port);
+                g_free (port);
+                g_free (key);
+        }
+        data->iter++;
+}
+
+/* Returns the URI the dnssd backend of CUPS reports for a printer service,
+ * or NULL. */
+static char *
+_cph_cups_dnssd_uri (AvahiData *printer)
+{
+        char  fullname[1024];
+        char  uri[1024];
+        http_uri_status_t status;
+
+        g_snprintf (fullname, sizeof (fullname), "%s.%s.%s",
+                    printer->name, printer->type, printer->domain);
+
+        /* printer-type is only announced by CUPS queues */
+        if (printer->UUID)
+                status = httpAssembleURIf (HTTP_URI_CODING_ALL, uri, sizeof (uri),
+                                           "dnssd", NULL, fullname, 0,
+                                           printer->got_printer_type ? "/cups?uuid=%s" : "/?uuid=%s",
+                                           printer->UUID);
+        else
+                status = httpAssembleURI (HTTP_URI_CODING_ALL, uri, sizeof (uri),
+                                          "dnssd", NULL, fullname, 0,
+                                          printer->got_printer_type ? "/cups" : "/");
+
+        if (status != HTTP_URI_STATUS_OK)
+                return NULL;
+
+        return g_strdup (uri);
+}
+
+/* Returns the IEEE-1284 device ID the dnssd backend of CUPS derives from
+ * the TXT record of a printer, or NULL: the usb_* keys if there are, else
+ * the make and model from product or ty, with the command set from the
+ * document formats in pdl. */
+static char *
+_cph_cups_dnssd_device_id (AvahiData *printer)
+{
+        static const struct {
+                const char *mime_type;
+                const char *command;
+        } pdl_commands[] = {
+                { "application/postscript",   "POSTSCRIPT" },
+                { "application/pdf",          "PDF" },
+                { "application/vnd.hp-pclxl", "PCLXL" },
+                { "application/vnd.hp-pcl",   "PCL" },
+                { "image/pwg-raster",         "PWG" },
+                { "image/urf",                "URF" },
+                { "image/jpeg",               "JPEG" }
+        };
+        GString    *device_id;
+        char       *model = NULL;
+        char       *make = NULL;
+        const char *mdl;
+        char       *space;
+        guint       i;
+
+        if (printer->usb_mfg && printer->usb_mdl) {
+                device_id = g_string_new (NULL);
+                g_string_append_printf (device_id, "MFG:%s;MDL:%s;",
+                                        printer->usb_mfg, printer->usb_mdl);
+                if (printer->usb_cmd)
+                        g_string_append_printf (device_id, "CMD:%s;", printer->usb_cmd);
+
+                return g_string_free (device_id, FALSE);
+        }
+
+        /* product is the model in parentheses; ty can be followed by the
+         * version of the driver */
+        if (printer->product && printer->product[0] == '(' &&
+            !strstr (printer->product, "Ghostscript")) {
+                model = g_strdup (printer->product + 1);
+                if (model[0] != '\0' && model[strlen (model) - 1] == ')')
+                        model[strlen (model) - 1] = '\0';
+        } else if (printer->make_and_model) {
+                model = g_strndup (printer->make_and_model,
+                                   strcspn (printer->make_and_model, ","));
+        }
+
+        if (!model || g_strstrip (model)[0] == '\0' ||
+            g_ascii_strcasecmp (model, "Unknown") == 0) {
+                g_free (model);
+                return NULL;
+        }
+
+        mdl = model;
+
+        /* the make is the first word, a few models leave it out */
+        if (g_ascii_strncasecmp (model, "designjet ", 10) == 0) {
+                make = g_strdup ("HP");
+        } else if (g_ascii_strncasecmp (model, "stylus ", 7) == 0) {
+                make = g_strdup ("EPSON");
+        } else if (printer->make_and_model &&
+                   (space = strchr (printer->make_and_model, ' ')) != NULL) {
+                make = g_strndup (printer->make_and_model,
+                                  space - printer->make_and_model);
+        } else if ((space = strchr (model, ' ')) != NULL) {
+                make = g_strndup (model, space - model);
+                mdl = space + 1;
+        }
+
+        if (!make) {
+                g_free (model);
+                return NULL;
+        }
+
+        device_id = g_string_new (NULL);
+        g_string_append_printf (device_id, "MFG:%s;MDL:%s;", make, mdl);
+
+        if (printer->pdl) {
+                gboolean first = TRUE;
+
+                for (i = 0; i < G_N_ELEMENTS (pdl_commands); i++) {
+                        const char *found;
+                        gsize       len = strlen (pdl_commands[i].mime_type);
+
+                        /* application/vnd.hp-pcl is a prefix of -pclxl */
+                        found = strstr (printer->pdl, pdl_commands[i].mime_type);
+                        while (found && found[len] != '\0' && found[len] != ',')
+                                found = strstr (found + len, pdl_commands[i].mime_type);
+                        if (!found)
+                                continue;
+
+                        g_string_append (device_id, first ? "CMD:" : ",");
+                        g_string_append (device_id, pdl_commands[i].command);
+                        first = FALSE;
+                }
+
+                if (!first)
+                        g_string_append_c (device_id, ';');
+        }
+
+        g_free (make);
+        g_free (model);
+
+        return g_string_free (device_id, FALSE);
+}
+
+/* Adds the device the dnssd backend of CUPS would report for a printer
+ * service to table. The services of a printer with the same name and
+ * domain end up in one record; see _cph_device_prefer_service(). */
+static void
+_cph_cups_dnssd_device_add (CphDeviceTable *table,
+                            AvahiData      *printer)
+{
+        char *uri;
+        char *device_id;
+
+        uri = _cph_cups_dnssd_uri (printer);
+        if (uri == NULL)
+                return;
+
+        device_id = _cph_cups_dnssd_device_id (printer);
+
+        _cph_device_table_add (table,
+                               CPH_DEVICE_SOURCE_AVAHI,
+                               "network",
+                               device_id,
+                               printer->name,
+                               printer->make_and_model,
+                               uri,
+                               printer->location,
+                               printer->UUID);
+
+
+        g_free (device_id);
+        g_free (uri);
+}
+
+static void
+get_dnssd_printer_devices (gpointer cb_data,
+                           gpointer user_data)
+{
+        CphCupsGetDevices *data = user_data;
+
+        _cph_cups_dnssd_device_add (&data->table, cb_data);
+}
+
+static gboolean
+_cph_printer_app_browse_done_idle (gpointer user_data)
+{
+        CphPrinterAppBrowse *browse = user_data;
+
+        browse->done_id = 0;
+        browse->done_cb (browse, browse->done_data);
+
+        return G_SOURCE_REMOVE;
+}
+
+/* Called when one of the browsers completed. The owner is told from an idle
+ * callback since this happens deep in the callbacks of the browser. */
+static void
+_cph_printer_app_browse_backend_done (CphPrinterAppBrowse *browse)
+{
+        browse->browsing--;
+
+        if (browse->browsing == 0 && browse->done_cb && browse->done_id == 0)
+                browse->done_id = g_idle_add (_cph_printer_app_browse_done_idle,
+                                              browse);
+}
+
+/* The browsers are shared with the other browse operations: only this one
+ * stops waiting for them. */
+static void
+_cph_printer_app_browse_stop (CphPrinterAppBrowse *browse)
+{
+        int i;
+
+        for (i = 0; i < browse->n_watchers; i++)
+                avahi_watcher_done (&browse->watchers[i]);
+}
+
+static gboolean
+_cph_printer_app_browse_deadline_cb (gpointer user_data)
+{
+        CphPrinterAppBrowse *browse = user_data;
+
+        browse->deadline_id = 0;
+        _cph_printer_app_browse_stop (browse);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+_cph_printer_app_browse_cancelled_cb (GCancellable *cancellable,
+                                      gpointer      user_data)
+{
+        _cph_printer_app_browse_stop (user_data);
+}
+
+static void
+_cph_printer_app_browse_free (CphPrinterAppBrowse *browse)
+{
+        int i;
+
+        if (browse->deadline_id)
+                g_source_remove (browse->deadline_id);
+
+        if (browse->done_id)
+                g_source_remove (browse->done_id);
+
+        if (browse->cancelled_id)
+                g_cancellable_disconnect (browse->cancellable,
+                                          browse->cancelled_id);
+        if (browse->cancellable)
+                g_object_unref (browse->cancellable);
+
+        for (i = 0; i < browse->n_watchers; i++) {
+                Avahi *backend = browse->watchers[i].backend;
+
+                if (backend)
+                        backend->watchers = g_list_remove (backend->watchers,
+                                                           &browse->watchers[i]);
+        }
+
+        g_free (browse->watchers);
+        g_free (browse);
+}
+
+/* Starts browsing for the services of service_types (a NULL-terminated
+ * array): cb is called for each service found, and remove_cb (if not NULL)
+ * for each one that goes away. If resolve is FALSE, the services are not
+ * resolved: the callbacks only get their key (interface, protocol, name,
+ * type and domain). The browsers of the discovery manager are reused, so cb
+ * is called right away for the services they already know about.
+ * If done_cb is not NULL, it is called once Avahi reported all the services
+ * it knows about, or once deadline passed or cancellable got cancelled; cb
+ * and remove_cb otherwise keep being called until
+ * _cph_printer_app_browse_free() is called. */
+static CphPrinterAppBrowse *
+_cph_cups_browse (CphCups                 *cups,
+                  const char *const       *service_types,
+                  gboolean                 resolve,
+                  gpointer                 data,
+                  printer_app_cb          *cb,
+                  printer_app_cb          *remove_cb,
+                  gint64                   deadline,
+                  GCancellable            *cancellable,
+                  CphPrinterAppBrowseDone  done_cb,
+                  gpointer                 done_data)
+{
+        CphPrinterAppBrowse *browse;
+        int                  i;
+
+        if (cups->priv->discovery == NULL)
+                cups->priv->discovery = _cph_discovery_manager_new (cups);
+
+        browse = g_new0 (CphPrinterAppBrowse, 1);
+        browse->added_cb = cb;
+        browse->removed_cb = remove_cb;
+        browse->data = data;
+        browse->resolve = resolve;
+        browse->done_cb = done_cb;
+        browse->done_data = done_data;
+        browse->n_watchers = g_strv_length ((char **) service_types);
+        browse->watchers = g_new0 (AvahiWatcher, browse->n_watchers);
+        browse->browsing = browse->n_watchers;
+
+        for (i = 0; i < browse->n_watchers; i++)
+                browse->watchers[i].browse = browse;
+
+        if (deadline >= 0)
+                browse->deadline_id = g_timeout_add (_cph_cups_deadline_msec (deadline, -1),
+                                                     _cph_printer_app_browse_deadline_cb,
+                                                     browse);
+
+        if (cancellable) {
+                browse->cancellable = g_object_ref (cancellable);
+                browse->cancelled_id = g_cancellable_connect (cancellable,
+                                                              G_CALLBACK (_cph_printer_app_browse_cancelled_cb),
+                                                              browse, NULL);
+        }
+
+        for (i = 0; i < browse->n_watchers; i++) {
+                AvahiWatcher *watcher = &browse->watchers[i];
+                Avahi        *backend;
+                GList        *l;
+
+                backend = _cph_discovery_manager_get_browser (cups->priv->discovery,
+                                                              service_types[i],
+                                                              resolve);
+                if (backend == NULL) {
+                        avahi_watcher_done (watcher);
+                        continue;
+                }
+
+                watcher->backend = backend;
+                backend->watchers = g_list_prepend (backend->watchers, watcher);
+
+                if (cb) {
+                        l = resolve ? backend->system_objects.head : backend->items.head;
+                        for (; l != NULL; l = l->next)
+                                cb (l->data, data);
+                }
+
+                if (avahi_browser_is_complete (backend, resolve))
+                        avahi_watcher_done (watcher);
+        }
+
+        return browse;
+}
+
+/* Starts browsing for printer applications; see _cph_cups_browse(). */
+static CphPrinterAppBrowse *
+_cph_cups_printer_app_browse (CphCups                 *cups,
+                              gpointer                 data,
+                              printer_app_cb          *cb,
+                              printer_app_cb          *remove_cb,
+                              gint64                   deadline,
+                              GCancellable            *cancellable,
+                              CphPrinterAppBrowseDone  done_cb,
+                              gpointer                 done_data)
+{
+        return _cph_cups_browse (cups, printer_app_service_types, TRUE,
+                                 data, cb, remove_cb, deadline, cancellable,
+                                 done_cb, done_data);
+}
+
+/* Whether the browse got a browser for any of its service types, that is
+ * whether the system bus could be reached. */
+static gboolean
+_cph_printer_app_browse_is_active (CphPrinterAppBrowse *browse)
+{
+        int i;
+
+        for (i = 0; i < browse->n_watchers; i++) {
+                if (browse->watchers[i].backend)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+/* Asks cupsd for the devices found by its backends. This does not use the
+ * connection of cups, so that it can run in a thread. */
+static ipp_status_t
+_cph_cups_get_backend_devices (CphCupsGetDevices *data,
+                               const char        *include_schemes,
+                               const char        *exclude_schemes)
+{
+        http_t       *http;
+        ipp_status_t  status;
+        int           cancel = 0;
+        gulong        cancelled_id = 0;
+
+        if (data->cancellable)
+                cancelled_id = g_cancellable_connect (data->cancellable,
+                                                      G_CALLBACK (_cph_cups_cancel_http_cb),
+                                                      &cancel, NULL);
+
+        http = httpConnect2 (cupsServer (), ippPort (), NULL, AF_UNSPEC,
+                             cupsEncryption (), 1,
+                             _cph_cups_deadline_msec (data->deadline, 30000),
+                             &cancel);
+
+        if (cancelled_id)
+                g_cancellable_disconnect (data->cancellable, cancelled_id);
+
+        if (http == NULL)
+                return IPP_STATUS_ERROR_SERVICE_UNAVAILABLE;
+
+        status = cupsGetDevices (http,
+                                 _cph_cups_deadline_sec (data->deadline,
+                                                         CUPS_TIMEOUT_DEFAULT),
+                                 include_schemes,
+                                 exclude_schemes,
+                                 _cph_cups_get_devices_cb,
+                                 data);
+
+        httpClose (http);
+
+        return status;
+}
+
+typedef struct
+{
+        CphCupsGetDevices  data;
+        char              *include_schemes;
+        char              *exclude_schemes;
+        ipp_status_t       status;
+} CphCupsBackendScan;
+
+static void
+_cph_cups_backend_scan_thread (GTask        *task,
+                               gpointer      source_object,
+                               gpointer      task_data,
+                               GCancellable *cancellable)
+{
+        CphCupsBackendScan *scan = task_data;
+
+        scan->status = _cph_cups_get_backend_devices (&scan->data,
+                                                      scan->include_schemes,
+                                                      scan->exclude_schemes);
+
+        g_task_return_boolean (task, TRUE);
+}
+
+/* A DevicesGet in progress: the CUPS backends are queried in a thread while
+ * the printers and the printer applications are browsed in the main loop, so
+ * that all share the time allowed by data.deadline. */
+typedef struct
+{
+        CphCupsGetDevices    data;
+        /* copies of the filters of the request, data points to them */
+        char               **include_schemes;
+        char               **exclude_schemes;
+        CphCupsBackendScan   scan;
+        CphCupsGetDevices    dnssd_data;
+        CphPrinterAppBrowse *dnssd_browse;
+        CphCupsGetDevices    app_data;
+        CphPrinterAppBrowse *browse;
+        /* stages that did not complete yet */
+        int                  pending;
+        /* an unfiltered and unlimited scan is worth keeping for next time */
+        gboolean             complete;
+} CphCupsDevicesGetOp;
+
+static void
+_cph_cups_devices_get_op_free (CphCupsDevicesGetOp *op)
+{
+        if (op->browse)
+                _cph_printer_app_browse_free (op->browse);
+
+        if (op->dnssd_browse)
+                _cph_printer_app_browse_free (op->dnssd_browse);
+
+        if (op->app_data.app_device_types)
+                g_ptr_array_free (op->app_data.app_device_types, TRUE);
+
+        _cph_device_table_clear (&op->data.table);
+        _cph_device_table_clear (&op->scan.data.table);
+        _cph_device_table_clear (&op->dnssd_data.table);
+        _cph_device_table_clear (&op->app_data.table);
+
+        g_free (op->scan.include_schemes);
+        g_free (op->scan.exclude_schemes);
+        g_strfreev (op->include_schemes);
+        g_strfreev (op->exclude_schemes);
+
+        if (op->data.cancellable)
+                g_object_unref (op->data.cancellable);
+
+        g_free (op);
+}
+
+/* Called when a stage of the scan completed; the last one answers. The
+ * devices of the CUPS backends come first, then the printers found with
+ * DNS-SD. */
+static void
+_cph_cups_devices_get_stage_done (GTask *task)
+{
+        CphCupsDevicesGetOp *op = g_task_get_task_data (task);
+        GVariantBuilder     *builder;
+        GVariant            *devices;
+        guint                i;
+
+        op->pending--;
+        if (op->pending > 0)
+                return;
+
+        if (op->scan.status != IPP_OK)
+                g_debug ("Cannot get devices from the CUPS backends: %s",
+                         ippErrorString (op->scan.status));
+
+        for (i = 0; i < op->scan.data.table.devices->len; i++)
+                _cph_device_table_merge (&op->data.table,
+                                         g_ptr_array_index (op->scan.data.table.devices, i),
+                                         NULL);
+        for (i = 0; i < op->dnssd_data.table.devices->len; i++)
+                _cph_device_table_merge (&op->data.table,
+                                         g_ptr_array_index (op->dnssd_data.table.devices, i),
+                                         NULL);
+        for (i = 0; i < op->app_data.table.devices->len; i++)
+                _cph_device_table_merge (&op->data.table,
+                                         g_ptr_array_index (op->app_data.table.devices, i),
+                                         NULL);
+
+        builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+        _cph_device_table_build (&op->data.table, builder);
+        devices = g_variant_builder_end (builder);
+        g_variant_builder_unref (builder);
+
+        if (op->complete)
+                _cph_device_table_save (&op->data.table, DEVICE_CACHE_FILE);
+
+        g_task_return_pointer (task, g_variant_ref_sink (devices),
+                               (GDestroyNotify) g_variant_unref);
+        g_object_unref (task);
+}
+
+static void
+_cph_cups_backend_scan_done (GObject      *source_object,
+                             GAsyncResult *result,
+                             gpointer      user_data)
+{
+        _cph_cups_devices_get_stage_done (user_data);
+}
+
+/* The devices of each printer application are merged as soon as it
+ * answers. */
+static void
+_cph_cups_devices_get_app_done (CphDeviceTable *table,
+                                AvahiData      *printer_app,
+                                gpointer        user_data)
+{
+        GTask               *task = user_data;
+        CphCupsDevicesGetOp *op = g_task_get_task_data (task);
+        guint                i;
+
+        for (i = 0; i < table->devices->len; i++)
+                _cph_device_table_merge (&op->app_data.table,
+                                         g_ptr_array_index (table->devices, i),
+                                         NULL);
+
+        _cph_cups_devices_get_stage_done (task);
+}
+
+static void
+get_printer_app_devices (gpointer cb_data,
+                         gpointer user_data)
+{
+        GTask               *task = user_data;
+        CphCupsDevicesGetOp *op = g_task_get_task_data (task);
+
+        /* each query is a stage of the scan */
+        op->pending++;
+        _cph_cups_printer_app_query_devices_async (g_task_get_source_object (task),
+                                                   cb_data,
+                                                   &op->app_data,
+                                                   _cph_cups_devices_get_app_done,
+                                                   task);
+}
+
+static void
+_cph_cups_devices_get_browse_done (CphPrinterAppBrowse *browse,
+                                   gpointer             user_data)
+{
+        GTask               *task = user_data;
+        CphCupsDevicesGetOp *op = g_task_get_task_data (task);
+
+        if (browse == op->browse)
+                op->browse = NULL;
+        else
+                op->dnssd_browse = NULL;
+        _cph_printer_app_browse_free (browse);
+
+        _cph_cups_devices_get_stage_done (task);
+}
+
+/* Starts all the stages of the scan; task holds a CphCupsDevicesGetOp. */
+static void
+_cph_cups_devices_get_start (CphCups *cups,
+                             GTask   *task)
+{
+        CphCupsDevicesGetOp *op = g_task_get_task_data (task);
+        GTask               *scan_task;
+
+        /* the stages own this reference until the last one completes */
+        g_object_ref (task);
+
+        // Discovering printers in our process, unless dnssd devices are
+        // not wanted
+        op->dnssd_data = op->data;
+        _cph_device_table_init (&op->dnssd_data.table, -1);
+        if (_cph_cups_is_scheme_wanted (&op->data, "dnssd", strlen ("dnssd"))) {
+                op->pending++;
+                op->dnssd_browse = _cph_cups_browse (cups,
+                                                     printer_service_types,
+                                                     TRUE,
+                                                     &op->dnssd_data,
+                                                     get_dnssd_printer_devices,
+                                                     NULL,
+                                                     op->data.deadline,
+                                                     op->data.cancellable,
+                                                     _cph_cups_devices_get_browse_done,
+                                                     task);
+        }
+
+        // Discovering devices via lpinfo   
+
+        op->scan.data = op->data;
+        _cph_device_table_init (&op->scan.data.table, -1);
+        if (op->include_schemes)
+                op->scan.include_schemes = g_strjoinv (",", op->include_schemes);
+        else
+                op->scan.include_schemes = g_strdup (CUPS_INCLUDE_ALL);
+        if (op->exclude_schemes)
+                op->scan.exclude_schemes = g_strjoinv (",", op->exclude_schemes);
+        else
+                op->scan.exclude_schemes = g_strdup (CUPS_EXCLUDE_NONE);
+        /* the dnssd backend would only browse again for the same
+         * services, in another process */
+        if (op->dnssd_browse && _cph_printer_app_browse_is_active (op->dnssd_browse)) {
+                char *exclude_schemes;
+
+                if (op->scan.exclude_schemes)
+                        exclude_schemes = g_strconcat (op->scan.exclude_schemes, ",dnssd", NULL);
+                else
+                        exclude_schemes = g_strdup ("dnssd");
+                g_free (op->scan.exclude_schemes);
+                op->scan.exclude_schemes = exclude_schemes;
+        }
+        op->scan.status = IPP_OK;
+
+        op->pending++;
+        scan_task = g_task_new (cups, NULL, _cph_cups_backend_scan_done, task);
+        g_task_set_task_data (scan_task, &op->scan, NULL);
+        g_task_run_in_thread (scan_task, _cph_cups_backend_scan_thread);
+        g_object_unref (scan_task);
+
+        // Polling devices from available Printer Apps, unless none of
+        // the devices they can report is wanted
+        op->app_data = op->data;
+        _cph_device_table_init (&op->app_data.table, -1);
+        op->app_data.app_device_types = _cph_cups_get_printer_app_device_types (&op->app_data);
+        if (op->app_data.app_device_types) {
+                op->pending++;
+                op->browse = _cph_cups_printer_app_browse (cups,
+                                                           task,
+                                                           get_printer_app_devices,
+                                                           NULL,
+                                                           op->data.deadline,
+                                                           op->data.cancellable,
+                                                           _cph_cups_devices_get_browse_done,
+                                                           task);
+        }
+}
+
+static void
+_cph_cups_refresh_devices_done (GObject      *source_object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+        GVariant *devices;
+
+        if (cph_cups_devices_get_finish (CPH_CUPS (source_object), result, &devices))
+                g_variant_unref (devices);
+}
+
+static gboolean
+_cph_cups_refresh_devices_idle (gpointer user_data)
+{
+        CphCups *cups = user_data;
+
+        cups->priv->device_refresh_id = 0;
+
+        /* a complete scan replaces the snapshot */
+        cph_cups_devices_get_async (cups, 0, -1, NULL, NULL, NULL,
+                                    _cph_cups_refresh_devices_done, NULL);
+
+        return G_SOURCE_REMOVE;
+}
+
+static gboolean
+_cph_cups_is_device_wanted (CphCupsGetDevices *data,
+                            CphDevice         *device)
+{
+        guint i;
+
+        if (_cph_cups_is_uri_wanted (data, device->device_uri))
+                return TRUE;
+
+        for (i = 0; i < device->alt_uris->len; i++) {
+                if (_cph_cups_is_uri_wanted (data, g_ptr_array_index (device->alt_uris, i)))
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+/* Builds the answer to DevicesGet from a table that was filled without the
+ * filters and limit of the request. */
+static GVariant *
+_cph_cups_build_wanted_devices (CphDeviceTable    *table,
+                                CphCupsGetDevices *data,
+                                gboolean           stale)
+{
+        GVariantBuilder *builder;
+        GVariant        *devices;
+        guint            i;
+        int              n;
+
+        builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+
+        n = 0;
+        for (i = 0; i < table->devices->len; i++) {
+                CphDevice *device = g_ptr_array_index (table->devices, i);
+
+                if (data->table.limit > 0 && n >= data->table.limit)
+                        break;
+
+                if (!_cph_cups_is_device_wanted (data, device))
+                        continue;
+
+                _cph_device_builder_add_device (builder, device, n, stale);
+                n++;
+        }
+
+        devices = g_variant_builder_end (builder);
+        g_variant_builder_unref (builder);
+
+        return devices;
+}
+
+/* Answers with the snapshot of the last scan, marking every device as stale,
+ * and schedules a fresh scan that will replace the snapshot. The snapshot is
+ * only used once: it is only meant to hide the cold scan after activation. */
+static GVariant *
+_cph_cups_devices_get_from_snapshot (CphCups           *cups,
+                                     CphCupsGetDevices *data)
+{
+        CphDeviceTable  *snapshot;
+        GVariant        *devices;
+
+        snapshot = cups->priv->device_snapshot;
+        cups->priv->device_snapshot = NULL;
+
+        devices = _cph_cups_build_wanted_devices (snapshot, data, TRUE);
+
+        _cph_device_table_free (snapshot);
+
+        /* in resident mode, a scan is already under way */
+        if (cups->priv->device_refresh_id == 0 && cups->priv->resident == NULL)
+                cups->priv->device_refresh_id = g_idle_add (_cph_cups_refresh_devices_idle,
+                                                            cups);
+
+        return devices;
+}
+
+/******************************************************
+ * Resident discovery
+ ******************************************************/
+
+/* In resident mode, the printer and printer application browsers are kept
+ * alive and the devices are tracked as they come and go, while the CUPS
+ * backends are polled on a schedule. DevicesGet is then answered from memory.
+ *
+ * The devices are kept per origin (one table for the CUPS backends, and one
+ * per printer or printer application service) so that the devices of a
+ * service can be dropped when it goes away; the tables are merged when
+ * answering. */
+
+struct CphResidentDiscovery
+{
+        int             refresh_interval;
+        guint           refresh_id;
+        gboolean        refreshing;
+        /* NULL until the first scan of the CUPS backends completed */
+        CphDeviceTable *cups_devices;
+        /* service key of the printer or printer application ->
+         * CphDeviceTable */
+        GHashTable     *app_devices;
+        /* service keys of the printer applications being queried */
+        GHashTable     *querying;
+        /* the filter of the queries: every kind of device */
+        CphCupsGetDevices app_data;
+        CphPrinterAppBrowse *browse;
+        CphPrinterAppBrowse *printer_browse;
+};
+
+static void
+_cph_resident_discovery_free (CphResidentDiscovery *resident)
+{
+        if (resident->refresh_id)
+                g_source_remove (resident->refresh_id);
+
+        if (resident->browse)
+                _cph_printer_app_browse_free (resident->browse);
+
+        if (resident->printer_browse)
+                _cph_printer_app_browse_free (resident->printer_browse);
+
+        if (resident->cups_devices)
+                _cph_device_table_free (resident->cups_devices);
+
+        g_hash_table_destroy (resident->app_devices);
+        g_hash_table_destroy (resident->querying);
+
+        if (resident->app_data.app_device_types)
+                g_ptr_array_free (resident->app_data.app_device_types, TRUE);
+
+        g_free (resident);
+}
+
+/* Merges the devices of all origins in a new table. */
+static CphDeviceTable *
+_cph_resident_discovery_collect (CphResidentDiscovery *resident)
+{
+        CphDeviceTable *table;
+        GHashTableIter  iter;
+        gpointer        value;
+        guint           i;
+
+        table = _cph_device_table_new (-1);
+
+        if (resident->cups_devices) {
+                for (i = 0; i < resident->cups_devices->devices->len; i++)
+                        _cph_device_table_merge (table,
+                                                 g_ptr_array_index (resident->cups_devices->devices, i),
+                                                 NULL);
+        }
+
+        g_hash_table_iter_init (&iter, resident->app_devices);
+        while (g_hash_table_iter_next (&iter, NULL, &value)) {
+                CphDeviceTable *app_table = value;
+
+                for (i = 0; i < app_table->devices->len; i++)
+                        _cph_device_table_merge (table,
+                                                 g_ptr_array_index (app_table->devices, i),
+                                                 NULL);
+        }
+
+        return table;
+}
+
+static char *
+_cph_resident_discovery_app_key (AvahiData *printer_app)
+{
+        return g_strdup_printf ("%d.%d.%s.%s.%s",
+                                printer_app->interface,
+                                printer_app->family,
+                                printer_app->name,
+                                printer_app->type,
+                                printer_app->domain);
+}
+
+static void
+_cph_resident_discovery_app_done (CphDeviceTable *table,
+                                  AvahiData      *printer_app,
+                                  gpointer        user_data)
+{
+        CphCups              *cups = user_data;
+        CphResidentDiscovery *resident = cups->priv->resident;
+        CphDeviceTable       *copy;
+        char                 *key;
+        guint                 i;
+
+        key = _cph_resident_discovery_app_key (printer_app);
+        g_hash_table_remove (resident->querying, key);
+
+        /* the printer application went away while it was queried */
+        if (_cph_discovery_manager_lookup_resolved (cups->priv->discovery,
+                                                    printer_app) == NULL) {
+                g_free (key);
+                return;
+        }
+
+        copy = _cph_device_table_new (-1);
+        for (i = 0; i < table->devices->len; i++)
+                _cph_device_table_merge (copy,
+                                         g_ptr_array_index (table->devices, i),
+                                         NULL);
+
+        g_hash_table_replace (resident->app_devices, key, copy);
+}
+
+static void
+_cph_resident_discovery_query_app (CphCups   *cups,
+                                   AvahiData *printer_app)
+{
+        CphResidentDiscovery *resident = cups->priv->resident;
+        char                 *key;
+
+        if (resident->app_data.app_device_types == NULL)
+                return;
+
+        /* a slow printer application can outlast the refresh interval */
+        key = _cph_resident_discovery_app_key (printer_app);
+        if (g_hash_table_contains (resident->querying, key)) {
+                g_free (key);
+                return;
+        }
+        g_hash_table_add (resident->querying, key);
+
+        _cph_cups_printer_app_query_devices_async (cups, printer_app,
+                                                   &resident->app_data,
+                                                   _cph_resident_discovery_app_done,
+                                                   cups);
+}
+
+static void
+_cph_resident_discovery_app_added_cb (gpointer cb_data,
+                                      gpointer user_data)
+{
+        CphCups *cups = user_data;
+
+        _cph_resident_discovery_query_app (cups, cb_data);
+}
+
+static void
+_cph_resident_discovery_printer_added_cb (gpointer cb_data,
+                                          gpointer user_data)
+{
+        CphCups        *cups = user_data;
+        CphDeviceTable *table;
+
+        table = _cph_device_table_new (-1);
+        _cph_cups_dnssd_device_add (table, cb_data);
+
+        g_hash_table_replace (cups->priv->resident->app_devices,
+                              _cph_resident_discovery_app_key (cb_data),
+                              table);
+}
+
+static void
+_cph_resident_discovery_app_removed_cb (gpointer cb_data,
+                                        gpointer user_data)
+{
+        CphCups *cups = user_data;
+        char    *key;
+
+        key = _cph_resident_discovery_app_key (cb_data);
+        g_hash_table_remove (cups->priv->resident->app_devices, key);
+        g_free (key);
+}
+
+/* Runs in a thread, with its own connection to cupsd: the backends can take
+ * several seconds to answer, and the main loop must keep serving requests
+ * meanwhile. task_data is the list of schemes to exclude. */
+static void
+_cph_resident_discovery_scan_thread (GTask        *task,
+                                     gpointer      source_object,
+                                     gpointer      task_data,
+                                     GCancellable *cancellable)
+{
+        CphCupsGetDevices  data;
+        CphDeviceTable    *table;
+        ipp_status_t       status;
+        const char        *exclude_schemes = task_data;
+
+        _cph_device_table_init (&data.table, -1);
+        data.include_schemes = NULL;
+        data.exclude_schemes = NULL;
+        data.app_device_types = NULL;
+        data.deadline = -1;
+        data.cancellable = NULL;
+        data.cups = NULL;
+
+        status = _cph_cups_get_backend_devices (&data,
+                                                CUPS_INCLUDE_ALL,
+                                                exclude_schemes);
+
+        if (status != IPP_OK) {
+                _cph_device_table_clear (&data.table);
+                g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                         "Cannot get devices: %s",
+                                         cupsLastErrorString ());
+                return;
+        }
+
+        table = g_new (CphDeviceTable, 1);
+        *table = data.table;
+
+        g_task_return_pointer (task, table,
+                               (GDestroyNotify) _cph_device_table_free);
+}
+
+static void
+_cph_resident_discovery_scan_done (GObject      *source_object,
+                                   GAsyncResult *result,
+                                   gpointer      user_data)
+{
+        CphCups              *cups = CPH_CUPS (source_object);
+        CphResidentDiscovery *resident = cups->priv->resident;
+        CphDeviceTable       *table;
+        GError               *error = NULL;
+
+        resident->refreshing = FALSE;
+
+        table = g_task_propagate_pointer (G_TASK (result), &error);
+        if (table == NULL) {
+                g_debug ("Cannot refresh devices: %s", error->message);
+                g_error_free (error);
+                return;
+        }
+
+        if (resident->cups_devices)
+                _cph_device_table_free (resident->cups_devices);
+        resident->cups_devices = table;
+
+        /* keep the snapshot current for the next start */
+        table = _cph_resident_discovery_collect (resident);
+        _cph_device_table_save (table, DEVICE_CACHE_FILE);
+        _cph_device_table_free (table);
+}
+
+static gboolean
+_cph_resident_discovery_refresh_cb (gpointer user_data)
+{
+        CphCups              *cups = user_data;
+        CphResidentDiscovery *resident = cups->priv->resident;
+        GTask                *task;
+        GList                *l;
+        int                   i;
+
+        /* a slow backend can make a scan outlast the interval */
+        if (!resident->refreshing) {
+                resident->refreshing = TRUE;
+
+                task = g_task_new (cups, NULL,
+                                   _cph_resident_discovery_scan_done, NULL);
+                /* the printers are tracked with the browser already */
+                if (_cph_printer_app_browse_is_active (resident->printer_browse))
+                        g_task_set_task_data (task, (gpointer) "dnssd", NULL);
+                g_task_run_in_thread (task, _cph_resident_discovery_scan_thread);
+                g_object_unref (task);
+        }
+
+        /* printer applications do not announce changes in their devices */
+        for (i = 0; i < resident->browse->n_watchers; i++) {
+                Avahi *backend = resident->browse->watchers[i].backend;
+
+                if (backend == NULL)
+                        continue;
+
+                for (l = backend->system_objects.head; l != NULL; l = l->next)
+                        _cph_resident_discovery_query_app (cups, l->data);
+        }
+
+        return G_SOURCE_CONTINUE;
+}
+
+void
+cph_cups_start_resident_discovery (CphCups *cups,
+                                   int      refresh_interval)
+{
+        CphResidentDiscovery *resident;
+
+        g_return_if_fail (CPH_IS_CUPS (cups));
+        g_return_if_fail (refresh_interval > 0);
+
+        if (cups->priv->resident)
+                return;
+
+        resident = g_new0 (CphResidentDiscovery, 1);
+        resident->refresh_interval = refresh_interval;
+        resident->app_devices = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                       g_free,
+                                                       (GDestroyNotify) _cph_device_table_free);
+        resident->querying = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    g_free, NULL);
+
+        resident->app_data.include_schemes = NULL;
+        resident->app_data.exclude_schemes = NULL;
+        resident->app_data.app_device_types = _cph_cups_get_printer_app_device_types (&resident->app_data);
+        resident->app_data.deadline = -1;
+        resident->app_data.cancellable = NULL;
+        resident->app_data.cups = cups;
+
+        cups->priv->resident = resident;
+
+        resident->browse = _cph_cups_printer_app_browse (cups, cups,
+                                                         _cph_resident_discovery_app_added_cb,
+                                                         _cph_resident_discovery_app_removed_cb,
+                                                         -1, NULL, NULL, NULL);
+        resident->printer_browse = _cph_cups_browse (cups, printer_service_types, TRUE, cups,
+                                                     _cph_resident_discovery_printer_added_cb,
+                                                     _cph_resident_discovery_app_removed_cb,
+                                                     -1, NULL, NULL, NULL);
+
+        _cph_resident_discovery_refresh_cb (cups);
+        resident->refresh_id = g_timeout_add_seconds (refresh_interval,
+                                                      _cph_resident_discovery_refresh_cb,
+                                                      cups);
+}
+
+void
+cph_cups_devices_get_async (CphCups             *cups,
+                            int                  timeout,
+                            int                  limit,
+                            const char *const   *include_schemes,
+                            const char *const   *exclude_schemes,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+        CphCupsDevicesGetOp *op;
+        GTask               *task;
+        int                  len_include;
+        int                  len_exclude;
+
+        g_return_if_fail (CPH_IS_CUPS (cups));
+
+        task = g_task_new (cups, cancellable, callback, user_data);
+
+        /* check the validity of values */
+        len_include = 0;
+        if (include_schemes) {
+                while (include_schemes[len_include] != NULL) {
+                        if (!_cph_cups_is_scheme_valid (cups, include_schemes[len_include]))
+                                goto invalid;
+                        len_include++;
+                }
+        }
+
+        len_exclude = 0;
+        if (exclude_schemes) {
+                while (exclude_schemes[len_exclude] != NULL) {
+                        if (!_cph_cups_is_scheme_valid (cups, exclude_schemes[len_exclude]))
+                                goto invalid;
+                        len_exclude++;
+                }
+        }
+
+        op = g_new0 (CphCupsDevicesGetOp, 1);
+        g_task_set_task_data (task, op,
+                              (GDestroyNotify) _cph_cups_devices_get_op_free);
+
+        /* the arrays of the caller do not live as long as the scan */
+        if (len_include > 0)
+                op->include_schemes = g_strdupv ((char **) include_schemes);
+        if (len_exclude > 0)
+                op->exclude_schemes = g_strdupv ((char **) exclude_schemes);
+        op->complete = len_include == 0 && len_exclude == 0 && limit <= 0;
+
+        _cph_device_table_init (&op->data.table, limit > 0 ? limit : -1);
+        op->data.include_schemes = (const char *const *) op->include_schemes;
+        op->data.exclude_schemes = (const char *const *) op->exclude_schemes;
+        op->data.app_device_types = NULL;
+        op->data.deadline = _cph_cups_deadline_new (timeout);
+        op->data.cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+        op->data.cups = cups;
+
+        /* until the first scan completed, the resident table is not worth
+         * more than the snapshot or a regular scan */
+        if (cups->priv->resident && cups->priv->resident->cups_devices) {
+                CphDeviceTable *table;
+
+                table = _cph_resident_discovery_collect (cups->priv->resident);
+                g_task_return_pointer (task,
+                                       g_variant_ref_sink (_cph_cups_build_wanted_devices (table, &op->data, FALSE)),
+                                       (GDestroyNotify) g_variant_unref);
+                _cph_device_table_free (table);
+        } else if (cups->priv->device_snapshot) {
+                g_task_return_pointer (task,
+                                       g_variant_ref_sink (_cph_cups_devices_get_from_snapshot (cups, &op->data)),
+                                       (GDestroyNotify) g_variant_unref);
+        } else {
+                _cph_cups_devices_get_start (cups, task);
+        }
+
+        g_object_unref (task);
+
+        return;
+
+invalid:
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                                 "%s", cph_cups_last_status_to_string (cups));
+        g_object_unref (task);
+}
+
+gboolean
+cph_cups_devices_get_finish (CphCups       *cups,
+                             GAsyncResult  *result,
+                             GVariant     **devices)
+{
+        GError *error = NULL;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+        g_return_val_if_fail (g_task_is_valid (result, cups), FALSE);
+        g_return_val_if_fail (devices != NULL, FALSE);
+
+        *devices = g_task_propagate_pointer (G_TASK (result), &error);
+
+        if (*devices == NULL) {
+                _cph_cups_set_internal_status (cups, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+static void
+_cph_cups_printer_app_get_done (CphPrinterAppBrowse *browse,
+                                gpointer             user_data)
+{
+        GTask                 *task = user_data;
+        CphCupsGetPrinterApps *data = g_task_get_task_data (task);
+
+        _cph_printer_app_browse_free (data->browse);
+        data->browse = NULL;
+
+        g_task_return_pointer (task,
+                               g_variant_ref_sink (g_variant_builder_end (data->builder)),
+                               (GDestroyNotify) g_variant_unref);
+        g_object_unref (task);
+}
+
+static void
+_cph_cups_get_printer_apps_free (CphCupsGetPrinterApps *data)
+{
+        if (data->browse)
+                _cph_printer_app_browse_free (data->browse);
+
+        g_variant_builder_unref (data->builder);
+
+        g_free (data);
+}
+
+void
+cph_cups_printer_app_get_async (CphCups             *cups,
+                                int                  timeout,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+        CphCupsGetPrinterApps *data;
+        GTask                 *task;
+
+        g_return_if_fail (CPH_IS_CUPS (cups));
+
+        task = g_task_new (cups, cancellable, callback, user_data);
+
+        data = g_new0 (CphCupsGetPrinterApps, 1);
+        data->iter    = 0;
+        data->builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+        g_task_set_task_data (task, data,
+                              (GDestroyNotify) _cph_cups_get_printer_apps_free);
+
+        /* the task is given to the browse, until it completes */
+        data->browse = _cph_cups_printer_app_browse (cups,
+                                                     data,
+                                                     discover_printer_app_devices_cb,
+                                                     NULL,
+                                                     _cph_cups_deadline_new (timeout),
+                                                     cancellable,
+                                                     _cph_cups_printer_app_get_done,
+                                                     task);
+}
+
+gboolean
+cph_cups_printer_app_get_finish (CphCups       *cups,
+                                 GAsyncResult  *result,
+                                 GVariant     **apps)
+{
+        GError *error = NULL;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+        g_return_val_if_fail (g_task_is_valid (result, cups), FALSE);
+        g_return_val_if_fail (apps != NULL, FALSE);
+
+        *apps = g_task_propagate_pointer (G_TASK (result), &error);
+
+        if (*apps == NULL) {
+                _cph_cups_set_internal_status (cups, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/******************************************************
+ * Describing printer applications
+ ******************************************************/
+
+/* PrinterAppsDescribe asks every known printer application for its system
+ * attributes at the same time, in the pool of threads. The answers are
+ * kept in the registry: as long as system-config-change-time does not
+ * move, only the state is asked again. */
+
+static const char * const describe_attributes[] = {
+        "system-config-change-time",
+        "system-configured-printers",
+        "system-info",
+        "system-location",
+        "system-make-and-model",
+        "system-name",
+        "system-state",
+        "system-state-reasons",
+        "system-uuid"
+};
+
+/* what changes without a configuration change */
+static const char * const describe_status_attributes[] = {
+        "system-config-change-time",
+        "system-state",
+        "system-state-reasons"
+};
+
+typedef struct
+{
+        GTask               *task;
+        CphPrinterAppBrowse *browse;
+        gint64               deadline;
+        /* keys of the applications in the registry, in the order of the
+         * result */
+        GPtrArray           *keys;
+        /* keys of those which answered */
+        GHashTable          *refreshed;
+        int                  pending;
+} CphCupsDescribeApps;
+
+typedef struct
+{
+        CphAppJob            job;
+        CphCupsDescribeApps *data;
+        CphCups             *cups;
+        GCancellable        *cancellable;
+        char                *key;
+        char                *hostname;
+        int                  port;
+        /* from the registry: system-config-change-time of the cached
+         * attributes (-1 if none), and whether the driver catalogue needs
+         * checking */
+        int                  config_time;
+        gboolean             check_drivers;
+        int                  drivers_config_time;
+        /* results */
+        CphAppQueryStatus    status;
+        gint64               latency;
+        /* all the attributes if they changed, else only the status */
+        ipp_t               *attrs;
+        ipp_t               *status_attrs;
+        CphDriverIndex      *drivers;
+        gboolean             drivers_current;
+} CphAppDescribe;
+
+static void
+_cph_app_describe_run (gpointer job)
+{
+        CphAppDescribe   *describe = job;
+        CphAppConnection *connection;
+        char             *system_uri;
+        gint64            start;
+        int               config_time;
+
+        describe->status = CPH_APP_QUERY_SKIPPED;
+
+        if (_cph_cups_deadline_expired (describe->data->deadline) ||
+            g_cancellable_is_cancelled (describe->cancellable))
+                return;
+
+        start = g_get_monotonic_time ();
+
+        system_uri = _cph_printer_app_system_uri (describe->hostname, describe->port);
+        if (!system_uri) {
+                describe->status = CPH_APP_QUERY_FAILED;
+                return;
+        }
+
+        connection = _cph_app_connection_get (describe->cups,
+                                              describe->hostname, describe->port,
+                                              HTTP_ENCRYPTION_IF_REQUESTED,
+                                              describe->data->deadline,
+                                              describe->cancellable);
+        if (!connection) {
+                if (!g_cancellable_is_cancelled (describe->cancellable))
+                        describe->status = CPH_APP_QUERY_FAILED;
+                g_free (system_uri);
+                return;
+        }
+
+        /* with a description at hand, only ask whether it is still
+         * current */
+        if (describe->config_time >= 0)
+                describe->status_attrs = _cph_printer_app_get_system_attributes (connection,
+                                                                                 system_uri,
+                                                                                 describe_status_attributes,
+                                                                                 G_N_ELEMENTS (describe_status_attributes));
+
+        if (describe->status_attrs &&
+            _cph_printer_app_config_time (describe->status_attrs) == describe->config_time) {
+                config_time = describe->config_time;
+        } else {
+                ippDelete (describe->status_attrs);
+                describe->status_attrs = NULL;
+
+                describe->attrs = _cph_printer_app_get_system_attributes (connection,
+                                                                          system_uri,
+                                                                          describe_attributes,
+                                                                          G_N_ELEMENTS (describe_attributes));
+                config_time = describe->attrs ? _cph_printer_app_config_time (describe->attrs)
+                                              : -1;
+        }
+
+        if (describe->attrs || describe->status_attrs) {
+                describe->status = CPH_APP_QUERY_OK;
+
+                /* same rule as _cph_printer_app_get_drivers() */
+                if (describe->check_drivers) {
+                        if (config_time >= 0 &&
+                            config_time == describe->drivers_config_time)
+                                describe->drivers_current = TRUE;
+                        else
+                                describe->drivers = _cph_printer_app_fetch_drivers (connection,
+                                                                                    system_uri);
+                }
+        } else if (g_cancellable_is_cancelled (describe->cancellable)) {
+                describe->status = CPH_APP_QUERY_SKIPPED;
+        } else {
+                describe->status = CPH_APP_QUERY_FAILED;
+        }
+
+        describe->latency = g_get_monotonic_time () - start;
+
+        _cph_app_connection_release (describe->cups, connection,
+                                     httpError (connection->http) == 0);
+        g_free (system_uri);
+}
+
+/* Replaces the status attributes of the cached attrs with those of
+ * status_attrs. */
+static void
+_cph_printer_app_update_status (ipp_t *attrs,
+                                ipp_t *status_attrs)
+{
+        ipp_attribute_t *attr;
+        guint            i;
+
+        for (i = 0; i < G_N_ELEMENTS (describe_status_attributes); i++) {
+                attr = ippFindAttribute (attrs, describe_status_attributes[i],
+                                         IPP_TAG_ZERO);
+                if (attr)
+                        ippDeleteAttribute (attrs, attr);
+
+                attr = ippFindAttribute (status_attrs, describe_status_attributes[i],
+                                         IPP_TAG_ZERO);
+                if (attr)
+                        ippCopyAttribute (attrs, attr, 0);
+        }
+}
+
+static void _cph_cups_describe_apps_return (CphCupsDescribeApps *data);
+
+static gboolean
+_cph_app_describe_done (gpointer user_data)
+{
+        CphAppDescribe      *describe = user_data;
+        CphCupsDescribeApps *data = describe->data;
+        CphPrinterApp       *app;
+
+        /* the application can be gone meanwhile */
+        app = _cph_app_registry_get (describe->cups,
+                                     describe->hostname, describe->port);
+
+        if (app && describe->status != CPH_APP_QUERY_SKIPPED)
+                _cph_printer_app_record (describe->cups, app,
+                                         describe->status == CPH_APP_QUERY_OK,
+                                         describe->latency);
+
+        if (app && describe->status == CPH_APP_QUERY_OK) {
+                if (describe->attrs) {
+                        ippDelete (app->system_attrs);
+                        app->system_attrs = describe->attrs;
+                        app->system_config_time = _cph_printer_app_config_time (describe->attrs);
+                        describe->attrs = NULL;
+                } else if (app->system_attrs) {
+                        _cph_printer_app_update_status (app->system_attrs,
+                                                        describe->status_attrs);
+                }
+
+                if (describe->drivers) {
+                        if (app->drivers)
+                                _cph_driver_index_free (app->drivers);
+
+                        app->drivers = describe->drivers;
+                        app->drivers_config_time = app->system_config_time;
+                        app->drivers_checked = g_get_monotonic_time ();
+                        describe->drivers = NULL;
+                } else if (describe->drivers_current) {
+                        app->drivers_checked = g_get_monotonic_time ();
+                }
+
+                g_hash_table_add (data->refreshed, g_strdup (describe->key));
+        }
+
+        ippDelete (describe->attrs);
+        ippDelete (describe->status_attrs);
+        if (describe->drivers)
+                _cph_driver_index_free (describe->drivers);
+        if (describe->cancellable)
+                g_object_unref (describe->cancellable);
+        g_object_unref (describe->cups);
+        g_free (describe->key);
+        g_free (describe->hostname);
+        g_free (describe);
+
+        if (--data->pending == 0)
+                _cph_cups_describe_apps_return (data);
+
+        return G_SOURCE_REMOVE;
+}
+
+static void
+_cph_printer_app_builder_add_attr (GVariantBuilder *builder,
+                                   const char      *name,
+                                   int              index,
+                                   ipp_t           *attrs,
+                                   const char      *attr_name)
+{
+        ipp_attribute_t *attr;
+        char             value[1024];
+
+        attr = ippFindAttribute (attrs, attr_name, IPP_TAG_ZERO);
+        if (!attr)
+                return;
+
+        /* system-state has the values of printer-state */
+        if (ippGetValueTag (attr) == IPP_TAG_ENUM)
+                g_strlcpy (value, ippEnumString ("printer-state",
+                                                 ippGetInteger (attr, 0)),
+                           sizeof (value));
+        else
+                ippAttributeString (attr, value, sizeof (value));
+
+        _cph_device_builder_add (builder, name, index, value);
+}
+
+static void
+_cph_printer_app_builder_add_description (GVariantBuilder *builder,
+                                          CphPrinterApp   *app,
+                                          int              index,
+                                          gboolean         refreshed)
+{
+        ipp_attribute_t *attr;
+        GString         *driver_names;
+        const char      *health;
+        char            *name;
+        char            *value;
+        int              count;
+        int              i;
+
+        _cph_device_builder_add (builder, "hostname", index, app->hostname);
+        value = g_strdup_printf ("%d", app->port);
+        _cph_device_builder_add (builder, "port", index, value);
+        g_free (value);
+        _cph_device_builder_add (builder, "name", index, app->name);
+
+        switch (app->health.state) {
+                case CPH_APP_BREAKER_OPEN:
+                        health = "unavailable";
+                        break;
+                case CPH_APP_BREAKER_HALF_OPEN:
+                        health = "probing";
+                        break;
+                default:
+                        health = "ok";
+                        break;
+        }
+        _cph_device_builder_add (builder, "health", index, health);
+
+        value = g_strdup_printf ("%.2f", app->health.error_rate);
+        _cph_device_builder_add (builder, "error-rate", index, value);
+        g_free (value);
+
+        if (app->health.latency >= 0) {
+                value = g_strdup_printf ("%.0f", app->health.latency);
+                _cph_device_builder_add (builder, "latency", index, value);
+                g_free (value);
+        }
+
+        if (!app->system_attrs)
+                return;
+
+        /* what is reported comes from an earlier call */
+        if (!refreshed)
+                _cph_device_builder_add (builder, "stale", index, "true");
+
+        _cph_printer_app_builder_add_attr (builder, "system-name", index,
+                                           app->system_attrs, "system-name");
+        _cph_printer_app_builder_add_attr (builder, "system-info", index,
+                                           app->system_attrs, "system-info");
+        _cph_printer_app_builder_add_attr (builder, "system-location", index,
+                                           app->system_attrs, "system-location");
+        _cph_printer_app_builder_add_attr (builder, "system-make-and-model", index,
+                                           app->system_attrs, "system-make-and-model");
+        _cph_printer_app_builder_add_attr (builder, "system-uuid", index,
+                                           app->system_attrs, "system-uuid");
+        _cph_printer_app_builder_add_attr (builder, "system-state", index,
+                                           app->system_attrs, "system-state");
+        _cph_printer_app_builder_add_attr (builder, "system-state-reasons", index,
+                                           app->system_attrs, "system-state-reasons");
+        _cph_printer_app_builder_add_attr (builder, "system-config-change-time", index,
+                                           app->system_attrs, "system-config-change-time");
+
+        /* printer names can contain anything, so they get a key each:
+         * printer-name:N:M */
+        attr = ippFindAttribute (app->system_attrs, "system-configured-printers",
+                                 IPP_TAG_BEGIN_COLLECTION);
+        count = attr ? ippGetCount (attr) : 0;
+
+        for (i = 0; i < count; i++) {
+                ipp_t *col = ippGetCollection (attr, i);
+
+                name = g_strdup_printf ("printer-name:%d", index);
+                _cph_printer_app_builder_add_attr (builder, name, i,
+                                                   col, "printer-name");
+                g_free (name);
+
+                name = g_strdup_printf ("printer-info:%d", index);
+                _cph_printer_app_builder_add_attr (builder, name, i,
+                                                   col, "printer-info");
+                g_free (name);
+
+                name = g_strdup_printf ("printer-state:%d", index);
+                _cph_printer_app_builder_add_attr (builder, name, i,
+                                                   col, "printer-state");
+                g_free (name);
+        }
+
+        /* driver names are keywords, so a space separates them */
+        if (app->drivers && app->drivers->drivers->len > 0) {
+                driver_names = g_string_new (NULL);
+
+                for (i = 0; i < (int) app->drivers->drivers->len; i++) {
+                        CphDriver *driver = g_ptr_array_index (app->drivers->drivers, i);
+
+                        if (driver_names->len > 0)
+                                g_string_append_c (driver_names, ' ');
+                        g_string_append (driver_names, driver->name);
+                }
+
+                _cph_device_builder_add (builder, "driver-names", index,
+                                         driver_names->str);
+                g_string_free (driver_names, TRUE);
+        }
+}
+
+static void
+_cph_cups_describe_apps_free (CphCupsDescribeApps *data)
+{
+        if (data->browse)
+                _cph_printer_app_browse_free (data->browse);
+
+        g_ptr_array_free (data->keys, TRUE);
+        g_hash_table_destroy (data->refreshed);
+
+        g_free (data);
+}
+
+static void
+_cph_cups_describe_apps_return (CphCupsDescribeApps *data)
+{
+        GTask           *task = data->task;
+        CphCups         *cups = g_task_get_source_object (task);
+        GVariantBuilder *builder;
+        CphPrinterApp   *app;
+        guint            i;
+        int              index = 0;
+
+        builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+
+        for (i = 0; i < data->keys->len; i++) {
+                const char *key = g_ptr_array_index (data->keys, i);
+
+                app = g_hash_table_lookup (cups->priv->printer_apps, key);
+                if (!app)
+                        continue;
+
+                _cph_printer_app_builder_add_description (builder, app, index++,
+                                                          g_hash_table_contains (data->refreshed,
+                                                                                 key));
+        }
+
+        g_task_return_pointer (task,
+                               g_variant_ref_sink (g_variant_builder_end (builder)),
+                               (GDestroyNotify) g_variant_unref);
+        g_variant_builder_unref (builder);
+        g_object_unref (task);
+}
+
+/* Once DNS-SD reported the printer applications it knows about, asks all
+ * the registered ones for their description. */
+static void
+_cph_cups_describe_apps_browse_done (CphPrinterAppBrowse *browse,
+                                     gpointer             user_data)
+{
+        CphCupsDescribeApps *data = user_data;
+        CphCups             *cups = g_task_get_source_object (data->task);
+        GHashTableIter       iter;
+        CphPrinterApp       *app;
+        const char          *key;
+        gint64               now;
+
+        _cph_printer_app_browse_free (data->browse);
+        data->browse = NULL;
+
+        now = g_get_monotonic_time ();
+
+        /* one for the loop, so that the result is not returned before all
+         * the jobs are pushed */
+        data->pending = 1;
+
+        g_hash_table_iter_init (&iter, cups->priv->printer_apps);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &key, (gpointer *) &app)) {
+                CphAppDescribe *describe;
+
+                g_ptr_array_add (data->keys, g_strdup (key));
+
+                /* one which keeps failing is only probed, and described
+                 * from what it told before */
+                if (app->health.state != CPH_APP_BREAKER_CLOSED)
+                        continue;
+
+                describe = g_new0 (CphAppDescribe, 1);
+                describe->job.run = _cph_app_describe_run;
+                describe->job.done = _cph_app_describe_done;
+                describe->data = data;
+                describe->cups = g_object_ref (cups);
+                describe->cancellable = g_task_get_cancellable (data->task);
+                if (describe->cancellable)
+                        g_object_ref (describe->cancellable);
+                describe->key = g_strdup (key);
+                describe->hostname = g_strdup (app->hostname);
+                describe->port = app->port;
+                describe->config_time = app->system_attrs ? app->system_config_time : -1;
+                describe->check_drivers = !app->drivers ||
+                                          now - app->drivers_checked >= DRIVER_CATALOGUE_CHECK_INTERVAL * G_USEC_PER_SEC;
+                describe->drivers_config_time = app->drivers ? app->drivers_config_time : -1;
+
+                data->pending++;
+                _cph_app_job_push (cups, &describe->job);
+        }
+
+        if (--data->pending == 0)
+                _cph_cups_describe_apps_return (data);
+}
+
+void
+cph_cups_printer_apps_describe_async (CphCups             *cups,
+                                      int                  timeout,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data)
+{
+        CphCupsDescribeApps *data;
+        GTask               *task;
+
+        g_return_if_fail (CPH_IS_CUPS (cups));
+
+        task = g_task_new (cups, cancellable, callback, user_data);
+
+        data = g_new0 (CphCupsDescribeApps, 1);
+        data->task = task;
+        data->deadline = _cph_cups_deadline_new (timeout);
+        data->keys = g_ptr_array_new_with_free_func (g_free);
+        data->refreshed = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+        g_task_set_task_data (task, data,
+                              (GDestroyNotify) _cph_cups_describe_apps_free);
+
+        /* the task is given to the browse, and then to the jobs, until
+         * they complete; the browse registers the applications it finds */
+        data->browse = _cph_cups_printer_app_browse (cups,
+                                                     data,
+                                                     NULL,
+                                                     NULL,
+                                                     data->deadline,
+                                                     cancellable,
+                                                     _cph_cups_describe_apps_browse_done,
+                                                     data);
+}
+
+gboolean
+cph_cups_printer_apps_describe_finish (CphCups       *cups,
+                                       GAsyncResult  *result,
+                                       GVariant     **apps)
+{
+        GError *error = NULL;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+        g_return_val_if_fail (g_task_is_valid (result, cups), FALSE);
+        g_return_val_if_fail (apps != NULL, FALSE);
+
+        *apps = g_task_propagate_pointer (G_TASK (result), &error);
+
+        if (*apps == NULL) {
+                _cph_cups_set_internal_status (cups, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/******************************************************
+ * Browsing and resolving services on demand
+ ******************************************************/
+
+static gboolean
+_cph_cups_service_type_in (const char *const *service_types,
+                           const char        *service_type)
+{
+        int i;
+
+        for (i = 0; service_types[i] != NULL; i++) {
+                if (g_strcmp0 (service_types[i], service_type) == 0)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+static gboolean
+_cph_cups_is_service_type_valid (CphCups    *cups,
+                                 const char *service_type)
+{
+        char *error;
+
+        if (_cph_cups_service_type_in (printer_service_types, service_type) ||
+            _cph_cups_service_type_in (printer_app_service_types, service_type))
+                return TRUE;
+
+        error = g_strdup_printf ("\"%s\" is not a supported service type.",
+                                 service_type ? service_type : "(null)");
+        _cph_cups_set_internal_status (cups, error);
+        g_free (error);
+
+        return FALSE;
+}
+
+static void
+_cph_cups_service_builder_add (GVariantBuilder *builder,
+                               const char      *key,
+                               const char      *value)
+{
+        if (!value || value[0] == '\0')
+                return;
+
+        g_variant_builder_add (builder, "{ss}", key, value);
+}
+
+/* Adds the key of a service (interface, protocol, name, type and domain),
+ * with the "service-*:N" keys used by ServicesBrowse. */
+static void
+_cph_cups_service_builder_add_key (GVariantBuilder *builder,
+                                   AvahiData       *service,
+                                   int              index)
+{
+        char buf[16];
+
+        _cph_device_builder_add (builder, "service-name", index, service->name);
+        _cph_device_builder_add (builder, "service-type", index, service->type);
+        _cph_device_builder_add (builder, "service-domain", index, service->domain);
+        g_snprintf (buf, sizeof (buf), "%d", service->interface);
+        _cph_device_builder_add (builder, "service-interface", index, buf);
+        g_snprintf (buf, sizeof (buf), "%d", service->family);
+        _cph_device_builder_add (builder, "service-protocol", index, buf);
+}
+
+static GVariant *
+_cph_cups_service_to_variant (AvahiData *service)
+{
+        GVariantBuilder *builder;
+        GVariant        *variant;
+        char            *uri;
+        char             buf[32];
+
+        builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+
+        _cph_cups_service_builder_add (builder, "service-name", service->name);
+        _cph_cups_service_builder_add (builder, "service-type", service->type);
+        _cph_cups_service_builder_add (builder, "service-domain", service->domain);
+        g_snprintf (buf, sizeof (buf), "%d", service->interface);
+        _cph_cups_service_builder_add (builder, "service-interface", buf);
+        g_snprintf (buf, sizeof (buf), "%d", service->family);
+        _cph_cups_service_builder_add (builder, "service-protocol", buf);
+
+        _cph_cups_service_builder_add (builder, "hostname", service->hostname);
+        _cph_cups_service_builder_add (builder, "address", service->address);
+        g_snprintf (buf, sizeof (buf), "%d", service->port);
+        _cph_cups_service_builder_add (builder, "port", buf);
+        _cph_cups_service_builder_add (builder, "uuid", service->UUID);
+        _cph_cups_service_builder_add (builder, "resource-path", service->resource_path);
+        _cph_cups_service_builder_add (builder, "location", service->location);
+        _cph_cups_service_builder_add (builder, "admin-url", service->admin_url);
+        _cph_cups_service_builder_add (builder, "make-and-model", service->make_and_model);
+        _cph_cups_service_builder_add (builder, "pdl", service->pdl);
+        _cph_cups_service_builder_add (builder, "urf", service->urf);
+        if (service->got_color)
+                _cph_cups_service_builder_add (builder, "color",
+                                               service->color ? "true" : "false");
+        if (service->got_duplex)
+                _cph_cups_service_builder_add (builder, "duplex",
+                                               service->duplex ? "true" : "false");
+
+        if (g_strcmp0 (service->object_type, "PRINTER_OBJECT") == 0) {
+                uri = _cph_cups_dnssd_uri (service);
+                _cph_cups_service_builder_add (builder, "device-uri", uri);
+                g_free (uri);
+        }
+
+        variant = g_variant_builder_end (builder);
+        g_variant_builder_unref (builder);
+
+        return variant;
+}
+
+typedef struct
+{
+        char                **service_types;
+        CphPrinterAppBrowse  *browse;
+} CphCupsServicesBrowse;
+
+static void
+_cph_cups_services_browse_free (CphCupsServicesBrowse *data)
+{
+        if (data->browse)
+                _cph_printer_app_browse_free (data->browse);
+
+        g_strfreev (data->service_types);
+
+        g_free (data);
+}
+
+static void
+_cph_cups_services_browse_done (CphPrinterAppBrowse *browse,
+                                gpointer             user_data)
+{
+        GTask                 *task = user_data;
+        CphCupsServicesBrowse *data = g_task_get_task_data (task);
+        GVariantBuilder       *builder;
+        int                    index;
+        int                    i;
+
+        builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+        index = 0;
+
+        for (i = 0; i < browse->n_watchers; i++) {
+                Avahi *backend = browse->watchers[i].backend;
+                GList *l;
+
+                if (backend == NULL)
+                        continue;
+
+                for (l = backend->items.head; l != NULL; l = l->next)
+                        _cph_cups_service_builder_add_key (builder, l->data, index++);
+        }
+
+        _cph_printer_app_browse_free (data->browse);
+        data->browse = NULL;
+
+        g_task_return_pointer (task,
+                               g_variant_ref_sink (g_variant_builder_end (builder)),
+                               (GDestroyNotify) g_variant_unref);
+        g_variant_builder_unref (builder);
+        g_object_unref (task);
+}
+
+/* Lists the services of service_types (all the printer service types if it
+ * is NULL or empty) without resolving them; cph_cups_service_resolve_async()
+ * resolves the one the caller is interested in. */
+void
+cph_cups_services_browse_async (CphCups             *cups,
+                                int                  timeout,
+                                const char *const   *service_types,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+        CphCupsServicesBrowse *data;
+        GTask                 *task;
+        int                    i;
+
+        g_return_if_fail (CPH_IS_CUPS (cups));
+
+        task = g_task_new (cups, cancellable, callback, user_data);
+
+        if (service_types) {
+                for (i = 0; service_types[i] != NULL; i++) {
+                        if (!_cph_cups_is_service_type_valid (cups, service_types[i])) {
+                                g_task_return_new_error (task, G_IO_ERROR,
+                                                         G_IO_ERROR_INVALID_ARGUMENT,
+                                                         "%s", cph_cups_last_status_to_string (cups));
+                                g_object_unref (task);
+                                return;
+                        }
+                }
+        }
+
+        data = g_new0 (CphCupsServicesBrowse, 1);
+        if (service_types && service_types[0] != NULL)
+                data->service_types = g_strdupv ((char **) service_types);
+        else
+                data->service_types = g_strdupv ((char **) printer_service_types);
+        g_task_set_task_data (task, data,
+                              (GDestroyNotify) _cph_cups_services_browse_free);
+
+        /* the task is given to the browse, until it completes */
+        data->browse = _cph_cups_browse (cups,
+                                         (const char *const *) data->service_types,
+                                         FALSE,
+                                         NULL, NULL, NULL,
+                                         _cph_cups_deadline_new (timeout),
+                                         cancellable,
+                                         _cph_cups_services_browse_done,
+                                         task);
+}
+
+gboolean
+cph_cups_services_browse_finish (CphCups       *cups,
+                                 GAsyncResult  *result,
+                                 GVariant     **services)
+{
+        GError *error = NULL;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+        g_return_val_if_fail (g_task_is_valid (result, cups), FALSE);
+        g_return_val_if_fail (services != NULL, FALSE);
+
+        *services = g_task_propagate_pointer (G_TASK (result), &error);
+
+        if (*services == NULL) {
+                _cph_cups_set_internal_status (cups, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+static void
+_cph_cups_service_resolve_done (GObject      *source_object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+        GTask               *task = user_data;
+        CphCups             *cups = g_task_get_source_object (task);
+        CphDiscoveryManager *manager = cups->priv->discovery;
+        AvahiData           *key = g_task_get_task_data (task);
+        AvahiData           *service;
+        Avahi               *backend;
+        GVariant            *output;
+        GError              *error = NULL;
+
+        output = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object),
+                                                result, &error);
+        if (output == NULL) {
+                g_task_return_error (task, error);
+                g_object_unref (task);
+                return;
+        }
+
+        service = avahi_data_new_from_reply (output);
+        g_variant_unref (output);
+
+        g_task_return_pointer (task,
+                               g_variant_ref_sink (_cph_cups_service_to_variant (service)),
+                               (GDestroyNotify) g_variant_unref);
+
+        /* the result stays valid as long as a browser sees the service */
+        backend = g_hash_table_lookup (manager->browsers, key->type);
+        if (backend && g_hash_table_lookup (backend->item_index, key))
+                g_hash_table_replace (manager->resolved, service, service);
+        else
+                avahi_data_unref (service);
+
+        g_object_unref (task);
+}
+
+/* Resolves one service, typically one listed by
+ * cph_cups_services_browse_async(). Services resolved already are answered
+ * from memory. */
+void
+cph_cups_service_resolve_async (CphCups             *cups,
+                                int                  interface,
+                                int                  protocol,
+                                const char          *name,
+                                const char          *type,
+                                const char          *domain,
+                                int                  timeout,
+                                GCancellable        *cancellable,
+                                GAsyncReadyCallback  callback,
+                                gpointer             user_data)
+{
+        CphDiscoveryManager *manager;
+        AvahiData           *key;
+        AvahiData           *service;
+        GTask               *task;
 
-        backend = user_data;  
+        g_return_if_fail (CPH_IS_CUPS (cups));
 
-        if (g_strcmp0 (signal_name, "ItemNew") == 0)
-          {
-            g_variant_get (parameters, "(ii&s&s&su)",
-                           &interface,
-                           &protocol,
-                           &name,
-                           &type,
-                           &domain,
-                           &flags);
+        task = g_task_new (cups, cancellable, callback, user_data);
 
-        GVariant *output = g_dbus_connection_call_sync (backend->dbus_connection,
-                        AVAHI_BUS,
-                        "/",
-                        AVAHI_SERVER_IFACE,
-                        "ResolveService",
-                        g_variant_new ("(iisssiu)",
-                                       interface,
-                                       protocol,
-                                       name,
-                                       type,
-                                       domain,
-                                       AVAHI_PROTO_UNSPEC,
-                                       0),
-                        G_VARIANT_TYPE ("(iissssisqaayu)"),
-                        G_DBUS_CALL_FLAGS_NONE,
-                        -1,
-                        backend->avahi_cancellable,
-                        NULL);
-
-        avahi_service_resolver_cb(output, user_data);
-              
-          }
-        else if (g_strcmp0 (signal_name, "ItemRemove") == 0)
-          {
-            g_variant_get (parameters, "(ii&s&s&su)",
-                           &interface,
-                           &protocol,
-                           &name,
-                           &type,
-                           &domain,
-                           &flags);
+        if (!name || name[0] == '\0') {
+                _cph_cups_set_internal_status (cups, "Empty service name.");
+                goto invalid;
+        }
+
+        if (!_cph_cups_is_service_type_valid (cups, type))
+                goto invalid;
+
+        if (cups->priv->discovery == NULL)
+                cups->priv->discovery = _cph_discovery_manager_new (cups);
+        manager = cups->priv->discovery;
+
+        key = avahi_data_new_key (interface, protocol, name, type,
+                                  domain && domain[0] != '\0' ? domain : "local");
+        g_task_set_task_data (task, key, (GDestroyNotify) avahi_data_unref);
+
+        service = _cph_discovery_manager_lookup_resolved (manager, key);
+        if (service) {
+                g_task_return_pointer (task,
+                                       g_variant_ref_sink (_cph_cups_service_to_variant (service)),
+                                       (GDestroyNotify) g_variant_unref);
+                g_object_unref (task);
+                return;
+        }
+
+        if (!_cph_discovery_manager_connect (manager)) {
+                g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                         "Cannot connect to the system bus");
+                g_object_unref (task);
+                return;
+        }
+
+        g_dbus_connection_call (manager->connection,
+                                AVAHI_BUS,
+                                "/",
+                                AVAHI_SERVER_IFACE,
+                                "ResolveService",
+                                g_variant_new ("(iisssiu)",
+                                               key->interface,
+                                               key->family,
+                                               key->name,
+                                               key->type,
+                                               key->domain,
+                                               AVAHI_PROTO_UNSPEC,
+                                               0),
+                                G_VARIANT_TYPE ("(iissssisqaayu)"),
+                                G_DBUS_CALL_FLAGS_NONE,
+                                _cph_cups_deadline_msec (_cph_cups_deadline_new (timeout), -1),
+                                cancellable,
+                                _cph_cups_service_resolve_done,
+                                task);
+
+        return;
+
+invalid:
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                                 "%s", cph_cups_last_status_to_string (cups));
+        g_object_unref (task);
+}
+
+gboolean
+cph_cups_service_resolve_finish (CphCups       *cups,
+                                 GAsyncResult  *result,
+                                 GVariant     **service)
+{
+        GError *error = NULL;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+        g_return_val_if_fail (g_task_is_valid (result, cups), FALSE);
+        g_return_val_if_fail (service != NULL, FALSE);
+
+        *service = g_task_propagate_pointer (G_TASK (result), &error);
+
+        if (*service == NULL) {
+                _cph_cups_set_internal_status (cups, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Functions to choose a driver */
+
+/* Fetching the PPDs cupsd knows is slow with many drivers installed: the
+ * index is only fetched again once it is PPD_INDEX_MAX_AGE old, in a
+ * thread, over a connection of its own. */
+
+typedef struct
+{
+        gint64          deadline;
+        GCancellable   *cancellable;
+        /* the new index, NULL if it cannot be had */
+        CphDriverIndex *index;
+} CphPpdIndexFetch;
+
+static void
+_cph_ppd_index_fetch_free (CphPpdIndexFetch *fetch)
+{
+        if (fetch->index)
+                _cph_driver_index_free (fetch->index);
+        if (fetch->cancellable)
+                g_object_unref (fetch->cancellable);
+        g_free (fetch);
+}
+
+static int
+_cph_ppd_index_fetch_timeout_cb (http_t *http,
+                                 void   *user_data)
+{
+        CphPpdIndexFetch *fetch = user_data;
+
+        if (g_cancellable_is_cancelled (fetch->cancellable))
+                return 0;
+
+        return !_cph_cups_deadline_expired (fetch->deadline);
+}
+
+static void
+_cph_ppd_index_fetch_thread (GTask        *task,
+                             gpointer      source_object,
+                             gpointer      task_data,
+                             GCancellable *cancellable)
+{
+        CphPpdIndexFetch   *fetch = task_data;
+        const char * const  attrs[3] = { "ppd-name",
+                                         "ppd-make-and-model",
+                                         "ppd-device-id" };
+        http_t             *http;
+        ipp_t              *request;
+        ipp_t              *reply;
+        ipp_attribute_t    *attr;
+        int                 cancel = 0;
+        gulong              cancelled_id = 0;
+
+        if (fetch->cancellable)
+                cancelled_id = g_cancellable_connect (fetch->cancellable,
+                                                      G_CALLBACK (_cph_cups_cancel_http_cb),
+                                                      &cancel, NULL);
+
+        http = httpConnect2 (cupsServer (), ippPort (), NULL, AF_UNSPEC,
+                             cupsEncryption (), 1,
+                             _cph_cups_deadline_msec (fetch->deadline, 30000),
+                             &cancel);
+
+        if (cancelled_id)
+                g_cancellable_disconnect (fetch->cancellable, cancelled_id);
+
+        if (http == NULL) {
+                g_task_return_boolean (task, TRUE);
+                return;
+        }
+
+        httpSetTimeout (http,
+                        CLAMP (_cph_cups_deadline_msec (fetch->deadline, -1) / 1000.0,
+                               0.1, APP_CONNECTION_POLL_INTERVAL),
+                        _cph_ppd_index_fetch_timeout_cb, fetch);
+
+        request = ippNewRequest (CUPS_GET_PPDS);
+        ippAddStrings (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                       "requested-attributes", G_N_ELEMENTS (attrs), NULL, attrs);
+
+        reply = cupsDoRequest (http, request, "/");
+        httpClose (http);
+
+        if (!reply || ippGetStatusCode (reply) > IPP_OK_CONFLICT) {
+                if (reply)
+                        ippDelete (reply);
+                g_task_return_boolean (task, TRUE);
+                return;
+        }
+
+        fetch->index = _cph_driver_index_new ();
+
+        attr = ippFirstAttribute (reply);
+        while (attr) {
+                const char *name = NULL;
+                const char *make_and_model = NULL;
+                const char *device_id = NULL;
+
+                while (attr && ippGetGroupTag (attr) != IPP_TAG_PRINTER)
+                        attr = ippNextAttribute (reply);
+
+                while (attr && ippGetGroupTag (attr) == IPP_TAG_PRINTER) {
+                        const char *attr_name = ippGetName (attr);
+
+                        if (g_strcmp0 (attr_name, "ppd-name") == 0)
+                                name = ippGetString (attr, 0, NULL);
+                        else if (g_strcmp0 (attr_name, "ppd-make-and-model") == 0)
+                                make_and_model = ippGetString (attr, 0, NULL);
+                        else if (g_strcmp0 (attr_name, "ppd-device-id") == 0)
+                                device_id = ippGetString (attr, 0, NULL);
+
+                        attr = ippNextAttribute (reply);
+                }
+
+                _cph_driver_index_add (fetch->index, name, make_and_model, device_id);
+        }
+
+        ippDelete (reply);
+
+        g_task_return_boolean (task, TRUE);
+}
+
+/* A DriversGet in progress: the PPD index and the catalogues which are not
+ * recent are checked in parallel, sharing the budget of the call; the
+ * drivers are matched in the main loop once all are done. */
+typedef struct
+{
+        CphDeviceIdTokens  tokens;
+        int                limit;
+        gint64             deadline;
+        GCancellable      *cancellable;
+        /* checks that did not complete yet */
+        int                pending;
+} CphDriversGetOp;
+
+static void
+_cph_drivers_get_op_free (CphDriversGetOp *op)
+{
+        _cph_device_id_tokens_clear (&op->tokens);
+        if (op->cancellable)
+                g_object_unref (op->cancellable);
+        g_free (op);
+}
+
+/* Returns the drivers matching the tokens of op, best first, from the PPD
+ * index and the catalogues as they are now. */
+static GVariant *
+_cph_cups_drivers_get_build (CphCups         *cups,
+                             CphDriversGetOp *op)
+{
+        GVariantBuilder *builder;
+        GVariant        *drivers;
+        GHashTableIter   iter;
+        CphPrinterApp   *app;
+        GArray          *matches;
+        guint            i;
+
+        matches = g_array_new (FALSE, FALSE, sizeof (CphDriverMatch));
+
+        _cph_driver_index_match (cups->priv->ppd_index, &op->tokens, NULL, matches);
+
+        g_hash_table_iter_init (&iter, cups->priv->printer_apps);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &app))
+                _cph_driver_index_match (app->drivers, &op->tokens, app, matches);
+
+        g_array_sort (matches, _cph_driver_match_compare);
+
+        builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+
+        for (i = 0; i < matches->len && (op->limit <= 0 || i < (guint) op->limit); i++) {
+                CphDriverMatch *match = &g_array_index (matches, CphDriverMatch, i);
+                char           *value;
+
+                _cph_device_builder_add (builder, "driver-name", i,
+                                         match->driver->name);
+                _cph_device_builder_add (builder, "driver-make-and-model", i,
+                                         match->driver->make_and_model);
+                _cph_device_builder_add (builder, "driver-device-id", i,
+                                         match->driver->device_id);
+                _cph_device_builder_add (builder, "driver-source", i,
+                                         match->app ? "printer-app" : "ppd");
+
+                value = g_strdup_printf ("%d", match->score);
+                _cph_device_builder_add (builder, "driver-score", i, value);
+                g_free (value);
+
+                if (match->app) {
+                        _cph_device_builder_add (builder, "printer-app-hostname", i,
+                                                 match->app->hostname);
+
+                        value = g_strdup_printf ("%d", match->app->port);
+                        _cph_device_builder_add (builder, "printer-app-port", i, value);
+                        g_free (value);
+                }
+        }
+
+        drivers = g_variant_builder_end (builder);
+
+        g_variant_builder_unref (builder);
+        g_array_free (matches, TRUE);
+
+        return drivers;
+}
+
+/* Answers with the drivers; the task is unreffed. */
+static void
+_cph_cups_drivers_get_complete (GTask *task)
+{
+        CphDriversGetOp *op = g_task_get_task_data (task);
+        GVariant        *drivers;
+
+        drivers = _cph_cups_drivers_get_build (g_task_get_source_object (task), op);
+
+        g_task_return_pointer (task, g_variant_ref_sink (drivers),
+                               (GDestroyNotify) g_variant_unref);
+        g_object_unref (task);
+}
+
+/* Called when a check completed; the last one answers. */
+static void
+_cph_cups_drivers_get_check_done (gpointer user_data)
+{
+        GTask           *task = user_data;
+        CphDriversGetOp *op = g_task_get_task_data (task);
+
+        op->pending--;
+        if (op->pending == 0)
+                _cph_cups_drivers_get_complete (task);
+}
+
+static void
+_cph_cups_ppd_index_fetch_done (GObject      *source_object,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+        CphCups          *cups = CPH_CUPS (source_object);
+        CphPpdIndexFetch *fetch = g_task_get_task_data (G_TASK (result));
+
+        /* keep using the old index if a new one cannot be had */
+        if (fetch->index) {
+                if (cups->priv->ppd_index)
+                        _cph_driver_index_free (cups->priv->ppd_index);
+
+                cups->priv->ppd_index = fetch->index;
+                cups->priv->ppd_index_time = g_get_monotonic_time ();
+                fetch->index = NULL;
+        }
+
+        _cph_cups_drivers_get_check_done (user_data);
+}
+
+/* Gets the drivers for the device with device_id, best first: PPDs from
+ * cupsd and drivers of the printer applications, as "driver-*:N" keys. */
+void
+cph_cups_drivers_get_async (CphCups             *cups,
+                            const char          *device_id,
+                            int                  limit,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+        CphDriversGetOp *op;
+        GTask           *task;
+        GHashTableIter   iter;
+        CphPrinterApp   *app;
+        gint64           now;
+
+        g_return_if_fail (CPH_IS_CUPS (cups));
+
+        task = g_task_new (cups, cancellable, callback, user_data);
+
+        if (!_cph_cups_is_device_id_valid (cups, device_id))
+                goto invalid;
+
+        op = g_new0 (CphDriversGetOp, 1);
+        g_task_set_task_data (task, op,
+                              (GDestroyNotify) _cph_drivers_get_op_free);
+
+        _cph_device_id_tokens_init (&op->tokens, device_id, NULL);
+        if (!op->tokens.mfg) {
+                _cph_cups_set_internal_status (cups,
+                                               "The device ID has no manufacturer or model.");
+                goto invalid;
+        }
+
+        op->limit = limit;
+        /* the checks share the budget of the call */
+        op->deadline = _cph_cups_deadline_new (APP_OPERATION_TIMEOUT);
+        op->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+        /* nothing completes before the main loop runs again, so pending
+         * can be counted up as the checks start */
+        now = g_get_monotonic_time ();
+
+        if (!cups->priv->ppd_index ||
+            now - cups->priv->ppd_index_time >= PPD_INDEX_MAX_AGE * G_USEC_PER_SEC) {
+                CphPpdIndexFetch *fetch;
+                GTask            *fetch_task;
+
+                fetch = g_new0 (CphPpdIndexFetch, 1);
+                fetch->deadline = op->deadline;
+                fetch->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+                fetch_task = g_task_new (cups, NULL, _cph_cups_ppd_index_fetch_done, task);
+                g_task_set_task_data (fetch_task, fetch,
+                                      (GDestroyNotify) _cph_ppd_index_fetch_free);
+
+                op->pending++;
+                g_task_run_in_thread (fetch_task, _cph_ppd_index_fetch_thread);
+                g_object_unref (fetch_task);
+        }
+
+        g_hash_table_iter_init (&iter, cups->priv->printer_apps);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &app)) {
+                if (_cph_printer_app_drivers_are_fresh (app, now))
+                        continue;
+
+                op->pending++;
+                _cph_printer_app_check_drivers (cups, app, op->deadline, cancellable,
+                                                _cph_cups_drivers_get_check_done,
+                                                task);
+        }
+
+        /* the checks own the task until the last of them is done */
+        if (op->pending == 0)
+                _cph_cups_drivers_get_complete (task);
+
+        return;
+
+invalid:
+        g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                                 "%s", cph_cups_last_status_to_string (cups));
+        g_object_unref (task);
+}
+
+gboolean
+cph_cups_drivers_get_finish (CphCups       *cups,
+                             GAsyncResult  *result,
+                             GVariant     **drivers)
+{
+        GError *error = NULL;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+        g_return_val_if_fail (g_task_is_valid (result, cups), FALSE);
+        g_return_val_if_fail (drivers != NULL, FALSE);
+
+        *drivers = g_task_propagate_pointer (G_TASK (result), &error);
+
+        if (*drivers == NULL) {
+                _cph_cups_set_internal_status (cups, error->message);
+                g_error_free (error);
+                return FALSE;
+        }
+
+        _cph_cups_set_internal_status (cups, NULL);
+        cups->priv->last_status = IPP_OK;
+
+        return TRUE;
+}
+
+/* Functions that work on a printer */
+
+/* Connects to the printer application which is to create the queue for
+ * device_uri: the one at hostname:port if hostname is set, else the one the
+ * registry picks. system_uri gets the system-uri to use with it, and app
+ * the registry entry, NULL if the application is not known. The requests
+ * sent over the connection share a budget of APP_OPERATION_TIMEOUT. */
+static CphAppConnection *
+_cph_cups_printer_app_connect (CphCups        *cups,
+                               const char     *device_uri,
+                               const char     *hostname,
+                               int             port,
+                               CphPrinterApp **app,
+                               char          **system_uri)
+{
+        CphAppConnection *connection;
+
+        if (!hostname || hostname[0] == '\0') {
+                *app = _cph_app_registry_lookup (cups, device_uri);
+                if (*app == NULL) {
+                        _cph_cups_set_internal_status (cups,
+                                                       "No printer application can drive this device.");
+                        return NULL;
+                }
+
+                hostname = (*app)->hostname;
+                port = (*app)->port;
+        } else {
+                *app = _cph_app_registry_get (cups, hostname, port);
+        }
+
+        *system_uri = _cph_printer_app_system_uri (hostname, port);
+        if (*system_uri == NULL) {
+                _cph_cups_set_internal_status (cups,
+                                               "Invalid printer application address.");
+                return NULL;
+        }
+
+        connection = _cph_app_connection_get (cups, hostname, port,
+                                              HTTP_ENCRYPTION_IF_REQUESTED,
+                                              _cph_cups_deadline_new (APP_OPERATION_TIMEOUT),
+                                              NULL);
+        if (connection == NULL) {
+                _cph_cups_set_internal_status (cups,
+                                               "Cannot connect to the printer application.");
+                g_free (*system_uri);
+                *system_uri = NULL;
+        }
+
+        return connection;
+}
+
+/* Builds the CREATE_PRINTER request for a queue on the printer application
+ * with system_uri; device_id, info and location are optional. */
+static ipp_t *
+_cph_printer_app_create_printer_request (const char *system_uri,
+                                         const char *printer_name,
+                                         const char *device_uri,
+                                         const char *driver,
+                                         const char *device_id,
+                                         const char *info,
+                                         const char *location)
+{
+        ipp_t *request;
+
+        request = ippNewRequest (IPP_OP_CREATE_PRINTER);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "system-uri", NULL, system_uri);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                      "printer-service-type", NULL, "print");
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                      "smi55357-driver", NULL, driver);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_URI,
+                      "smi55357-device-uri", NULL, device_uri);
+        ippAddString (request, IPP_TAG_OPERATION, IPP_TAG_NAME,
+                      "requesting-user-name", NULL, cupsUser ());
+        ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_NAME,
+                      "printer-name", NULL, printer_name);
+        if (device_id && device_id[0] != '\0')
+                ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_TEXT,
+                              "printer-device-id", NULL, device_id);
+        if (info && info[0] != '\0')
+                ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_TEXT,
+                              "printer-info", NULL, info);
+        if (location && location[0] != '\0')
+                ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_TEXT,
+                              "printer-location", NULL, location);
+
+        return request;
+}
+
+/* Creates a queue for printer_uri on the printer application the registry
+ * picks for it. ppd_file is not used: the driver comes from the catalogue
+ * of the application. */
+gboolean
+cph_cups_printer_add (CphCups    *cups,
+                      const char *printer_name,
+                      const char *printer_uri,
+                      const char *ppd_file,
+                      const char *info,
+                      const char *location)
+{
+        ipp_t            *request;
+        ipp_t            *response;
+        CphAppConnection *connection;
+        CphPrinterApp    *app;
+        const char       *device_id = NULL;
+        char             *system_uri;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+
+        if (!_cph_cups_is_printer_name_valid (cups, printer_name))
+                return FALSE;
+        if (!_cph_cups_is_printer_uri_valid (cups, printer_uri))
+                return FALSE;
+        if (!_cph_cups_is_info_valid (cups, info))
+                return FALSE;
+        if (!_cph_cups_is_location_valid (cups, location))
+                return FALSE;
+
+        connection = _cph_cups_printer_app_connect (cups, printer_uri,
+                                                    NULL, 0, &app, &system_uri);
+        if (connection == NULL)
+                return FALSE;
 
+        if (app)
+                device_id = g_hash_table_lookup (app->device_uris, printer_uri);
 
-                 GList *iter = g_list_find_custom (backend->system_objects, name , (GCompareFunc) compare_services);
-                if (iter != NULL)
-                  {
-                    backend->system_objects = g_list_delete_link (backend->system_objects, iter);
-                    g_free (iter->data);
-                  }
+        request = _cph_printer_app_create_printer_request (system_uri,
+                                                           printer_name,
+                                                           printer_uri,
+                                                           _cph_printer_app_resolve_driver (cups, app,
+                                                                                            connection,
+                                                                                            device_id),
+                                                           device_id,
+                                                           info,
+                                                           location);
 
-          }
-        else if (g_strcmp0 (signal_name, "AllForNow"))
-          {
-        //     backend->done = TRUE;
-                g_main_loop_quit(backend->loop);
-          }
+        response = cupsDoRequest (connection->http, request, "/ipp/system");
+        _cph_app_connection_release (cups, connection, response != NULL);
 
-   return;
+        g_free (system_uri);
+
+        return _cph_cups_handle_reply (cups, response);
 }
 
-static void
-avahi_service_browser_new_cb (GVariant*          output,
-                              gpointer           user_data)
+/* Creates a queue for device_uri on the printer application at
+ * hostname:port, or on the one the registry picks for device_uri if
+ * hostname is NULL. */
+gboolean
+cph_cups_printer_app_printer_add(CphCups    *cups,
+                      const char *printer_name,
+                      const char *device_uri,
+                      const char *device_info,
+                      const char *device_id,
+                      const char *hostname,
+                      int *port)
 {
-        Avahi               *printer_device_backend;
-        GError              *error = NULL;
-        printer_device_backend = user_data;
+        ipp_t		        *request,		
+		                *response;		
+        CphAppConnection        *connection;
+        CphPrinterApp           *app;
+        char                    *system_uri;
 
-        if (output)
-          {
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
 
-            g_variant_get (output, "(o)", &printer_device_backend->avahi_service_browser_path);
-            printer_device_backend->avahi_service_browser_subscription_id =
-              g_dbus_connection_signal_subscribe (printer_device_backend->dbus_connection,
-                                                  NULL,
-                                                  AVAHI_SERVICE_BROWSER_IFACE,
-                                                  NULL,
-                                                  printer_device_backend->avahi_service_browser_path,
-                                                  NULL,
-                                                  G_DBUS_SIGNAL_FLAGS_NONE,
-                                                  avahi_service_browser_signal_handler,
-                                                  printer_device_backend,
-                                                  NULL);
-
-            // if (printer_device_backend->avahi_service_browser_path)
-            //     printer_device_backend->unsubscribe_general_subscription_id = g_idle_add (unsubscribe_general_subscription_cb, printer_device_backend);
-
-            g_variant_unref (output);
-          }
-        else
-          {
-            /*
-             * The creation of ServiceBrowser fails with G_IO_ERROR_DBUS_ERROR
-             * if Avahi is disabled.
-             */
-            if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_DBUS_ERROR) &&
-                !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-                //  _cph_cups_set_internal_status(printer_device_backend->cups, g_strdup_printf("%s", error->message));
-            g_error_free (error);
-          }
-        
-}
+        if (!_cph_cups_is_printer_name_valid (cups, printer_name))
+                return FALSE;
+        if (!_cph_cups_is_printer_uri_valid (cups, device_uri))
+                return FALSE;
 
-static void
-avahi_create_browsers (gpointer    user_data)
-{ 
-        Avahi               *backend;  
-        backend = user_data;
+        connection = _cph_cups_printer_app_connect (cups, device_uri,
+                                                    hostname, port ? *port : 0,
+                                                    &app, &system_uri);
+        if (connection == NULL)
+                return FALSE;
 
-        backend->avahi_service_browser_subscription_id =
-          g_dbus_connection_signal_subscribe  (backend->dbus_connection,
-                                               NULL,
-                                               AVAHI_SERVICE_BROWSER_IFACE,
-                                               NULL,
-                                               NULL,
-                                               NULL,
-                                               G_DBUS_SIGNAL_FLAGS_NONE,
-                                               avahi_service_browser_signal_handler,
-                                               backend,
-                                               NULL);
-
-         GVariant* output = g_dbus_connection_call_sync (backend->dbus_connection,
-                                AVAHI_BUS,
-                                "/",
-                                AVAHI_SERVER_IFACE,
-                                "ServiceBrowserNew",
-                                g_variant_new ("(iissu)",
-                                               AVAHI_IF_UNSPEC,
-                                               AVAHI_PROTO_UNSPEC,
-                                               backend->service_type,
-                                               "",
-                                               0),
-                                G_VARIANT_TYPE ("(o)"),
-                                G_DBUS_CALL_FLAGS_NONE,
-                                -1,
-                                backend->avahi_cancellable,
-                                NULL);
-        
-        avahi_service_browser_new_cb (output, user_data);
+        if ((!device_id || device_id[0] == '\0') && app)
+                device_id = g_hash_table_lookup (app->device_uris, device_uri);
 
-        g_main_loop_run(backend->loop);
+        request = _cph_printer_app_create_printer_request (system_uri,
+                                                           printer_name,
+                                                           device_uri,
+                                                           _cph_printer_app_resolve_driver (cups, app,
+                                                                                            connection,
+                                                                                            device_id),
+                                                           device_id,
+                                                           device_info,
+                                                           NULL);
+        response = cupsDoRequest(connection->http, request, "/ipp/system");
+        _cph_app_connection_release (cups, connection, response != NULL);
 
-        return;
-}
+        g_free (system_uri);
 
-static void 
-_cph_cups_pappl_device_err_cb (const char        *message,
-                               void              *data)
-{        
-        CphCups *cups = data;
-        _cph_cups_set_internal_status ( cups, 
-                          g_strdup_printf ("%s",message));
-        
-        return;
+        return _cph_cups_handle_reply (cups, response);
 }
 
-static bool
-_cph_cups_pappl_device_cb (const char    *device_info,
-                          const char    *device_uri,
-                          const char    *device_id,
-                          void          *user_data)
+/* PrintersAddMany: queues are grouped by the printer application they go
+ * to, drivers are resolved from its catalogue in one pass, and the
+ * CREATE_PRINTER requests of a group are spread over lanes, each with a
+ * pooled connection. The lanes are jobs of the pool of threads which talk
+ * to printer applications, so they send in parallel while the main loop
+ * keeps running. */
+
+typedef struct
 {
-        CphCupsGetDevices *data = user_data;
-        char              *key;
+        /* these point into the printers of the request */
+        const char *printer_name;
+        const char *device_uri;
+        const char *info;
+        const char *location;
+        /* the catalogue and the registry can change while the lanes run */
+        char       *driver;
+        char       *device_id;
+        GVariant   *options;
+        /* NULL once the queue is created */
+        char       *error;
+} CphPrinterAddEntry;
 
-        if (data == NULL) 
-        {
-                return FALSE;
-        }
-        if (data->limit > 0 && data->iter >= data->limit)
-                return FALSE;
+typedef struct
+{
+        /* the operation owns the lane, done does not free it */
+        CphAppJob      job;
+        GTask         *task;
+        CphCups       *cups;
+        const char    *hostname;
+        int            port;
+        const char    *system_uri;
+        GCancellable  *cancellable;
+        /* CphPrinterAddEntry */
+        GPtrArray     *entries;
+} CphPrinterAddLane;
 
-        key = g_strdup_printf ("device_printer_application_missing:%d",data->iter);
-                g_variant_builder_add (data->builder, "{ss}",
-                                        key, "true");
-        g_free (key);
-        _cph_cups_get_devices_cb ( NULL, device_id, device_info, NULL, device_uri, NULL, NULL);
-   
-   return TRUE;
+typedef struct
+{
+        GTask          *task;
+        CphCups        *cups;
+        /* only valid until the call returns to the main loop */
+        CphPrinterApp  *app;
+        char           *hostname;
+        int             port;
+        char           *system_uri;
+        /* CphPrinterAddEntry */
+        GPtrArray      *entries;
+} CphPrinterAddGroup;
+
+typedef struct
+{
+        GVariant           *printers;
+        CphPrinterAddEntry *entries;
+        gsize               n_entries;
+        GHashTable         *groups;
+        /* CphPrinterAddLane */
+        GPtrArray          *lanes;
+        /* catalogue checks and lanes which did not complete yet */
+        guint               pending;
+        guint               n_failed;
+        GCancellable       *cancellable;
+} CphPrinterAddOp;
+
+static void
+_cph_printer_add_group_free (CphPrinterAddGroup *group)
+{
+        g_free (group->hostname);
+        g_free (group->system_uri);
+        g_ptr_array_unref (group->entries);
+        g_free (group);
 }
 
-int _parse_app_devices (CphCups                 *cups,
-                        CphCupsGetDevices       *data,
-                        FILE                    *fp)
+static void
+_cph_printer_add_lane_free (CphPrinterAddLane *lane)
 {
-        char     buf[2048];
-        char     device_uri[1024];
-        char	 device_id[1024];
+        g_ptr_array_unref (lane->entries);
+        g_free (lane);
+}
 
-        while (fgets (buf, sizeof (buf), fp))
-          {
+static void
+_cph_printer_add_op_free (CphPrinterAddOp *op)
+{
+        gsize i;
 
-	         strcpy (device_uri,buf);
+        for (i = 0; i < op->n_entries; i++) {
+                g_free (op->entries[i].driver);
+                g_free (op->entries[i].device_id);
+                g_free (op->entries[i].error);
+                g_variant_unref (op->entries[i].options);
+        }
 
-                 device_uri[strlen (device_uri) - 1] = '\0';                
-                _cph_cups_get_devices_cb ( NULL, device_id, NULL, NULL, device_uri, NULL, NULL);
-          }
+        g_ptr_array_unref (op->lanes);
+        g_hash_table_destroy (op->groups);
+        g_free (op->entries);
+        g_variant_unref (op->printers);
 
-          return 0;     
+        if (op->cancellable)
+                g_object_unref (op->cancellable);
+
+        g_free (op);
 }
 
-static void 
-get_printer_app_devices (gpointer  cb_data,
-                        gpointer user_data)
+static char *
+_cph_printer_add_error (ipp_t *response)
 {
-        
-        ipp_t		        *request,		
-		                *response;		
-        ipp_attribute_t         *attr;		
-        http_t	                *http;			
-        int                     timeout_param = CUPS_TIMEOUT_DEFAULT;  
-        char                    *include_schemes_param,
-                                *exclude_schemes_param,
-                                *device_info,
-                                *device_id,
-                                *device_name,
-                                *device_uri;
-        AvahiData *printer_app = user_data;
-        //   *data = printer_app->user_data; 
-        http = httpConnect2(printer_app->hostname, printer_app->port, NULL, AF_UNSPEC,
-                           HTTP_ENCRYPTION_IF_REQUESTED, 1, 30000, NULL);
-        request = ippNewRequest(IPP_OP_PAPPL_FIND_DEVICES);
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_CHARSET, "attributes-charset", NULL, "utf-8");
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_LANGUAGE, "attributes-natural-language", NULL, "en-GB");
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, "ipp://localhost/ipp/system");
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
-        response = cupsDoRequest(http, request, "/ipp/system");         
-        if ((attr = ippFindAttribute(response, "smi55357-device-col", IPP_TAG_BEGIN_COLLECTION)) != NULL)
-          {
-            int	i,			
-        		num_devices = ippGetCount(attr);
-            for (i = 0; i < num_devices; i ++)
-            {
-              ipp_t		*item = ippGetCollection(attr, i);
-        					// Device entry
-              ipp_attribute_t	*item_attr;	// Device attr
-              if ((item_attr = ippFindAttribute(item, "smi55357-device-uri", IPP_TAG_ZERO)) != NULL)
-              {
-	         if ((item_attr = ippFindAttribute(item, "smi55357-device-info", IPP_TAG_ZERO)) != NULL)
-      	           device_info = g_strdup(ippGetString(item_attr, 0, NULL));
-      	         if ((item_attr = ippFindAttribute(item, "smi55357-device-id", IPP_TAG_ZERO)) != NULL)
-      	           device_id = g_strdup(ippGetString(item_attr, 0, NULL));
-                 if ((item_attr = ippFindAttribute(item, "smi55357-device-name", IPP_TAG_ZERO)) != NULL)
-      	           device_name = g_strdup(ippGetString(item_attr, 0, NULL));
-                 if ((item_attr = ippFindAttribute(item, "smi55357-device-uri", IPP_TAG_ZERO)) != NULL)
-      	           device_uri = g_strdup(ippGetString(item_attr, 0, NULL));
-                _cph_cups_get_devices_cb (NULL, 
-                                         device_id,
-                                         device_info,
-                                         NULL,
-                                         device_uri,
-                                         NULL,
-                                         user_data);
-                 g_free (device_id);
-                 g_free (device_info);
-                 g_free (device_name);
-                 g_free (device_uri);
-              }
-            }
-          }
+        if (!response)
+                return g_strdup (cupsLastErrorString ());
 
-         ippDelete(response);                
+        if (ippGetStatusCode (response) > IPP_OK_CONFLICT)
+                return g_strdup (ippErrorString (ippGetStatusCode (response)));
+
+        return NULL;
 }
 
-static void 
-discover_printer_app_devices_cb (gpointer  cb_data,
-                                gpointer user_data)
+/* Answers with the (name, error) of every entry; the task is unreffed. */
+static void
+_cph_printer_add_complete (GTask *task)
 {
-        AvahiData *printer_app = cb_data;
-        char                *key;
-        CphCupsGetPrinterApps  *data = ((Avahi*)user_data)->data;
+        CphPrinterAddOp *op = g_task_get_task_data (task);
+        GVariantBuilder *builder;
+        gsize            i;
 
-        if (printer_app->hostname && printer_app->hostname[0] != '\0') {
-                        key  = g_strdup_printf ("hostname:%d", data->iter);
-                        g_message("%s\n", key);
-                        g_variant_builder_add (data->builder, "{ss}",
-                                               key, printer_app->hostname);
-                        g_free (key);
-        }
-        
-        if (printer_app->port > 0) {
-                key  = g_strdup_printf ("port:%d", data->iter);
-                g_variant_builder_add (data->builder, "{ss}",
-                                       key, g_strdup_printf("%i", printer_app->port));
-                g_free (key);
+        builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ss)"));
+
+        for (i = 0; i < op->n_entries; i++) {
+                g_variant_builder_add (builder, "(ss)",
+                                       op->entries[i].printer_name,
+                                       op->entries[i].error ? op->entries[i].error : "");
+                if (op->entries[i].error)
+                        op->n_failed++;
         }
-        data->iter++;
+
+        g_task_return_pointer (task,
+                               g_variant_ref_sink (g_variant_builder_end (builder)),
+                               (GDestroyNotify) g_variant_unref);
+        g_variant_builder_unref (builder);
+        g_object_unref (task);
 }
 
+/* Runs in the main loop once a lane is done; the last one answers. */
 static gboolean
-_cph_cups_printer_app_get (CphCups               *cups,
-                           int                    timeout,
-                           gpointer               data,
-                           printer_app_cb          cb)
+_cph_printer_add_lane_done (gpointer user_data)
 {
+        CphPrinterAddLane *lane = user_data;
+        GTask             *task = lane->task;
+        CphPrinterAddOp   *op = g_task_get_task_data (task);
 
-        Avahi               *printer_app_backend;
+        op->pending--;
+        if (op->pending == 0)
+                _cph_printer_add_complete (task);
 
-        printer_app_backend = g_new0 (Avahi,2);
-        printer_app_backend[0].service_type = g_strdup_printf("_ipps-system._tcp");
-        printer_app_backend[1].service_type = g_strdup_printf("_ipp-system._tcp");
+        return FALSE;
+}
 
-        for(int i = 0 ; i < 2; i++)
-                {
-                        printer_app_backend[i].cups = cups;
-                        printer_app_backend[i].data = data;
-                        printer_app_backend[i].done = false;   
-                        printer_app_backend[i].loop = g_main_loop_new(NULL, FALSE);                    
-                        printer_app_backend[i].callback = cb; 
-                        printer_app_backend[i].avahi_cancellable = g_cancellable_new ();
-                        printer_app_backend[i].dbus_connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, printer_app_backend->avahi_cancellable, NULL);
-                        avahi_create_browsers (&printer_app_backend[i]);
+static void
+_cph_printer_add_lane_run (gpointer job)
+{
+        CphPrinterAddLane *lane = job;
+        CphAppConnection  *connection = NULL;
+        guint              i;
+
+        for (i = 0; i < lane->entries->len; i++) {
+                CphPrinterAddEntry *entry = g_ptr_array_index (lane->entries, i);
+                ipp_t              *request;
+                ipp_t              *response;
+
+                if (g_cancellable_is_cancelled (lane->cancellable)) {
+                        entry->error = g_strdup ("The request was cancelled.");
+                        continue;
                 }
 
-        return TRUE;
-}
+                /* a failed request can leave the connection unusable */
+                if (!connection)
+                        connection = _cph_app_connection_get (lane->cups,
+                                                              lane->hostname, lane->port,
+                                                              HTTP_ENCRYPTION_IF_REQUESTED,
+                                                              -1, lane->cancellable);
+                if (!connection) {
+                        entry->error = g_strdup ("Cannot connect to the printer application.");
+                        continue;
+                }
 
-static gboolean
-_cph_cups_devices_get (CphCups           *cups,
-                       int                timeout,
-                       int                limit,
-                       const char *const *include_schemes,
-                       const char *const *exclude_schemes,
-                       int                len_include,
-                       int                len_exclude,
-                       CphCupsGetDevices *data)
-{
-        ipp_status_t            retval;
-        ipp_t		        *request,		
-		                *response;		
-        ipp_attribute_t         *attr;		
-        http_t	                *http;			
-        int                     timeout_param = CUPS_TIMEOUT_DEFAULT;  
-        char                    *include_schemes_param,
-                                *exclude_schemes_param,
-                                *device_info,
-                                *device_id,
-                                *device_name,
-                                *device_uri;
-        if (timeout > 0)
-                timeout_param = timeout;
-
-        if (include_schemes && len_include > 0)
-                include_schemes_param = g_strjoinv (",", (char **) include_schemes);
-        else
-                include_schemes_param = g_strdup (CUPS_INCLUDE_ALL);
+                /* each queue gets the full bound, not what the previous
+                 * ones left of it */
+                _cph_app_connection_rearm (connection, -1);
 
-        if (exclude_schemes && len_exclude > 0)
-                exclude_schemes_param = g_strjoinv (",", (char **) exclude_schemes);
-        else
-                exclude_schemes_param = g_strdup (CUPS_EXCLUDE_NONE);
+                request = _cph_printer_app_create_printer_request (lane->system_uri,
+                                                                   entry->printer_name,
+                                                                   entry->device_uri,
+                                                                   entry->driver,
+                                                                   entry->device_id,
+                                                                   entry->info,
+                                                                   entry->location);
+                response = cupsDoRequest (connection->http, request, "/ipp/system");
 
-        // Discovering devices via lpinfo   
+                entry->error = _cph_printer_add_error (response);
 
-        retval = cupsGetDevices (cups->priv->connection,   
-                                 timeout_param, 
-                                 include_schemes_param,
-                                 exclude_schemes_param,
-                                 _cph_cups_get_devices_cb,
-                                 data);
+                if (!response) {
+                        _cph_app_connection_release (lane->cups, connection, FALSE);
+                        connection = NULL;
+                }
 
-        // Discovering services via Avahi
-        Avahi *printer_app_backend = g_new0 (Avahi,1);
-        printer_app_backend -> cups = cups;
+                ippDelete (response);
+        }
 
-        // Polling devices from available Printer Apps
-        _cph_cups_printer_app_get (cups, timeout, data, get_printer_app_devices);
-        
-        //  pappl_data_callback *pappl_data = g_new0 (pappl_data_callback,1);
-        //  pappl_data->signal_pappl = 0;
-        //  pappl_data->data = data;
-        //  g_timeout_add_seconds (10,pappl_timeout_cb,pappl_data);
-         
-        //  papplDeviceList (PAPPL_DEVTYPE_ALL,
-        //                   _cph_cups_pappl_device_cb,                  
-        //                   pappl_data,
-        //                   _cph_cups_pappl_device_err_cb,
-        //                   cups );
-           
-	
-        // if (retval != IPP_OK) {
-        //         _cph_cups_set_internal_status (cups,
-        //                                        "Cannot get devices.");
-        //         return FALSE;
-        // }
-
-        g_free (include_schemes_param);
-        g_free (exclude_schemes_param);
-        
-        return TRUE;
+        if (connection)
+                _cph_app_connection_release (lane->cups, connection, TRUE);
 }
 
-gboolean
-cph_cups_devices_get (CphCups            *cups,
-                      int                 timeout,
-                      int                 limit,
-                      const char *const  *include_schemes,
-                      const char *const  *exclude_schemes,
-                      GVariant          **devices)
-{
-        CphCupsGetDevices data;
-        int               len_include;
-        int               len_exclude;
-        gboolean          retval;
-
-        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
-        g_return_val_if_fail (devices != NULL, FALSE);
+/* Picks the drivers the entries of group lack from drivers, which can be
+ * NULL, and pushes the lanes which send its requests. */
+static void
+_cph_printer_add_group_start (GTask              *task,
+                              CphPrinterAddGroup *group,
+                              CphDriverIndex     *drivers)
+{
+        CphPrinterAddOp *op = g_task_get_task_data (task);
+        guint            n_lanes;
+        guint            i;
 
-        *devices = NULL;
+        for (i = 0; i < group->entries->len; i++) {
+                CphPrinterAddEntry *entry = g_ptr_array_index (group->entries, i);
 
-        /* check the validity of values */
-        len_include = 0;
-        if (include_schemes) {
-                while (include_schemes[len_include] != NULL) {
-                        if (!_cph_cups_is_scheme_valid (cups, include_schemes[len_include]))
-                                return FALSE;
-                        len_include++;
+                if (entry->driver[0] == '\0') {
+                        g_free (entry->driver);
+                        entry->driver = g_strdup (_cph_driver_index_best (drivers,
+                                                                          entry->device_id));
                 }
         }
 
-        len_exclude = 0;
-        if (exclude_schemes) {
-                while (exclude_schemes[len_exclude] != NULL) {
-                        if (!_cph_cups_is_scheme_valid (cups, exclude_schemes[len_exclude]))
-                                return FALSE;
-                        len_exclude++;
-                }
+        n_lanes = MIN (group->entries->len, APP_CONNECTION_MAX_IDLE);
+
+        for (i = 0; i < n_lanes; i++) {
+                CphPrinterAddLane *lane;
+                guint              k;
+
+                lane = g_new0 (CphPrinterAddLane, 1);
+                lane->job.run = _cph_printer_add_lane_run;
+                lane->job.done = _cph_printer_add_lane_done;
+                lane->task = task;
+                lane->cups = group->cups;
+                lane->hostname = group->hostname;
+                lane->port = group->port;
+                lane->system_uri = group->system_uri;
+                lane->cancellable = op->cancellable;
+                lane->entries = g_ptr_array_new ();
+
+                for (k = i; k < group->entries->len; k += n_lanes)
+                        g_ptr_array_add (lane->entries,
+                                         g_ptr_array_index (group->entries, k));
+
+                g_ptr_array_add (op->lanes, lane);
+
+                /* the lanes share the pool of the other requests to printer
+                 * applications, so that concurrent calls stay within
+                 * MaxPrinterAppQueries */
+                op->pending++;
+                _cph_app_job_push (group->cups, &lane->job);
         }
+}
 
-        data.iter    = 0;
-        data.limit   = -1;
-        data.builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
-        if (limit > 0)
-                data.limit = limit;
-
-        retval = _cph_cups_devices_get (cups, timeout, limit,
-                                        include_schemes, exclude_schemes,
-                                        len_include, len_exclude,
-                                        &data);
-
-        if (retval)
-                *devices = g_variant_builder_end (data.builder);
+/* Called once the catalogue of the printer application of group was
+ * checked. */
+static void
+_cph_printer_add_group_checked (gpointer user_data)
+{
+        CphPrinterAddGroup *group = user_data;
+        GTask              *task = group->task;
+        CphPrinterAddOp    *op = g_task_get_task_data (task);
+        CphPrinterApp      *app;
 
-        g_variant_builder_unref (data.builder);
+        app = _cph_app_registry_get (group->cups, group->hostname, group->port);
+        _cph_printer_add_group_start (task, group, app ? app->drivers : NULL);
 
-        return retval;
+        op->pending--;
+        if (op->pending == 0)
+                _cph_printer_add_complete (task);
 }
 
-gboolean
-cph_cups_printer_app_get (CphCups            *cups,
-                          int                 timeout,
-                          GVariant          **apps)
+/* Validates entry and files it under the group of the printer application
+ * it goes to. Returns FALSE with entry->error set if it cannot be added. */
+static gboolean
+_cph_printer_add_entry_route (CphCups            *cups,
+                              CphPrinterAddEntry *entry,
+                              GHashTable         *groups)
 {
-        CphCupsGetPrinterApps   data;
-        gboolean                retval;
+        CphPrinterAddGroup *group;
+        CphPrinterApp      *app;
+        const char         *hostname = NULL;
+        char               *key;
+        int                 port = 0;
+
+        if (!_cph_cups_is_printer_name_valid (cups, entry->printer_name) ||
+            !_cph_cups_is_printer_uri_valid (cups, entry->device_uri) ||
+            !_cph_cups_is_info_valid (cups, entry->info) ||
+            !_cph_cups_is_location_valid (cups, entry->location) ||
+            (entry->device_id && entry->device_id[0] != '\0' &&
+             !_cph_cups_is_device_id_valid (cups, entry->device_id))) {
+                entry->error = g_strdup (cph_cups_last_status_to_string (cups));
+                return FALSE;
+        }
 
-        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
-        g_return_val_if_fail (apps != NULL, FALSE);
+        g_variant_lookup (entry->options, "hostname", "&s", &hostname);
+        g_variant_lookup (entry->options, "port", "i", &port);
 
-        *apps = NULL;
+        if (!hostname || hostname[0] == '\0') {
+                app = _cph_app_registry_lookup (cups, entry->device_uri);
+                if (!app) {
+                        entry->error = g_strdup ("No printer application can drive this device.");
+                        return FALSE;
+                }
 
-        data.iter    = 0;
-        data.builder = g_variant_builder_new (G_VARIANT_TYPE ("a{ss}"));
+                hostname = app->hostname;
+                port = app->port;
+        } else {
+                /* the helper runs as root: it only talks to printer
+                 * applications it was configured with or found itself */
+                app = _cph_app_registry_get (cups, hostname, port);
+                if (!app) {
+                        entry->error = g_strdup ("Unknown printer application.");
+                        return FALSE;
+                }
+        }
 
-        retval = _cph_cups_printer_app_get (cups,
-                                            timeout, 
-                                            &data,
-                                            discover_printer_app_devices_cb);
-        if (retval)
-                *apps = g_variant_builder_end (data.builder);
+        if (!entry->device_id || entry->device_id[0] == '\0') {
+                g_free (entry->device_id);
+                entry->device_id = g_strdup (g_hash_table_lookup (app->device_uris,
+                                                                  entry->device_uri));
+        }
 
-        g_variant_builder_unref (data.builder);
+        key = _cph_printer_app_key (hostname, port);
+        group = g_hash_table_lookup (groups, key);
 
-        return retval;
+        if (!group) {
+                group = g_new0 (CphPrinterAddGroup, 1);
+                group->app = app;
+                group->hostname = g_strdup (hostname);
+                group->port = port;
+                group->system_uri = _cph_printer_app_system_uri (hostname, port);
+                group->entries = g_ptr_array_new ();
 
-}
+                g_hash_table_insert (groups, key, group);
+        } else {
+                g_free (key);
+        }
 
-/* Functions that work on a printer */
+        if (!group->system_uri) {
+                entry->error = g_strdup ("Invalid printer application address.");
+                return FALSE;
+        }
 
-gboolean
-cph_cups_printer_add (CphCups    *cups,
-                      const char *printer_name,
-                      const char *printer_uri,
-                      const char *ppd_file,
-                      const char *info,
-                      const char *location)
-{
+        g_ptr_array_add (group->entries, entry);
 
-        ipp_t		        *request,		
-		                *response;		
-        ipp_attribute_t         *attr;		
-        http_t	                *http;			
-        int                     timeout_param = CUPS_TIMEOUT_DEFAULT;
+        return TRUE;
+}
 
-        http = httpConnect2("localhost", 8001, NULL, AF_UNSPEC,
-                           HTTP_ENCRYPTION_IF_REQUESTED, 1, 30000, NULL);
+/* Creates the queues of printers, an array of (name, device URI, driver,
+ * description, options), where an empty driver is picked from the device
+ * ID and options can have "location", "device-id", and "hostname" and
+ * "port" of the printer application. The requests are sent from worker
+ * threads; callback is called from the main loop once all of them are
+ * answered. */
+void
+cph_cups_printers_add_many_async (CphCups             *cups,
+                                  GVariant            *printers,
+                                  GCancellable        *cancellable,
+                                  GAsyncReadyCallback  callback,
+                                  gpointer             user_data)
+{
+        CphPrinterAddOp    *op;
+        GTask              *task;
+        GHashTableIter      iter;
+        CphPrinterAddGroup *group;
+        gsize               i;
+
+        g_return_if_fail (CPH_IS_CUPS (cups));
+        g_return_if_fail (g_variant_is_of_type (printers,
+                                                G_VARIANT_TYPE ("a(ssssa{sv})")));
+
+        task = g_task_new (cups, cancellable, callback, user_data);
+
+        op = g_new0 (CphPrinterAddOp, 1);
+        g_task_set_task_data (task, op,
+                              (GDestroyNotify) _cph_printer_add_op_free);
+
+        /* the entries point into the printers */
+        op->printers = g_variant_ref (printers);
+        op->n_entries = g_variant_n_children (printers);
+        op->entries = g_new0 (CphPrinterAddEntry, op->n_entries);
+        op->groups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) _cph_printer_add_group_free);
+        op->lanes = g_ptr_array_new_with_free_func ((GDestroyNotify) _cph_printer_add_lane_free);
+        op->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+
+        for (i = 0; i < op->n_entries; i++) {
+                CphPrinterAddEntry *entry = &op->entries[i];
+                const char         *driver;
+
+                g_variant_get_child (printers, i, "(&s&s&s&s@a{sv})",
+                                     &entry->printer_name, &entry->device_uri,
+                                     &driver, &entry->info,
+                                     &entry->options);
+                entry->driver = g_strdup (driver);
+                g_variant_lookup (entry->options, "location", "&s", &entry->location);
+                g_variant_lookup (entry->options, "device-id", "s", &entry->device_id);
+
+                _cph_printer_add_entry_route (cups, entry, op->groups);
+        }
 
-        request = ippNewRequest(IPP_OP_PAPPL_FIND_DRIVERS);
-        ippAddString(request, IPP_TAG_OPERATION, IPP_CONST_TAG(IPP_TAG_URI), "system-uri", NULL, "ipp://localhost/ipp/system");
-        // I will pass here correct device id for devices
-        //ippAddString(request, IPP_TAG_OPERATION, IPP_CONST_TAG(IPP_TAG_TEXT), "smi55357-device-id", NULL, "MFG:HP;CMD:PJL,PML,DW-PCL;MDL:HP LaserJet Tank MFP 260x;CLS:PRINTER;DES:HP LaserJet Tank MFP 2606dn;MEM:MEM=308MB;PRN:381U0A;S:0300000000000000000000000000000000;COMMENT:RES=600x2;LEDMDIS:USB#ff#04#01;CID:HPLJPCLMSMV2;MCT:MF;MCL:FL;MCV:4.2;");
-        response = cupsDoRequest(http, request, "/ipp/system");
+        /* Drivers come from the catalogues, each being checked once, in the
+         * pool if it is not recent; then every group is split into lanes,
+         * one connection each. Nothing completes before the main loop
+         * runs again, so pending can be counted up as the jobs are
+         * pushed. */
+        g_hash_table_iter_init (&iter, op->groups);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &group)) {
+                gboolean needs_drivers = FALSE;
+                guint    j;
 
-        attr = ippFindAttribute(response, "smi55357-driver-col", IPP_TAG_BEGIN_COLLECTION);
-        const char *driver = NULL;
+                if (group->entries->len == 0)
+                        continue;
 
-        if (attr != NULL) {
-            driver = ippGetString(attr, 0, NULL);
-        }
+                for (j = 0; j < group->entries->len && !needs_drivers; j++) {
+                        CphPrinterAddEntry *entry = g_ptr_array_index (group->entries, j);
 
-        request = ippNewRequest(IPP_OP_CREATE_PRINTER);
+                        needs_drivers = entry->driver[0] == '\0';
+                }
 
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, "ipp://localhost/ipp/system");
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "printer-service-type", NULL, "print");
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "smi55357-driver", NULL, driver);
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "smi55357-device-uri", NULL, printer_uri);
-        ippAddString(request, IPP_TAG_PRINTER, IPP_TAG_NAME, "printer-name", NULL, printer_name);
-        // ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
-        // return _cph_cups_send_request (cups, request, CPH_RESOURCE_ADMIN);
+                group->task = task;
+                group->cups = cups;
 
-        response = cupsDoRequest(http, request, "/ipp/system");
+                if (!needs_drivers ||
+                    _cph_printer_app_drivers_are_fresh (group->app, g_get_monotonic_time ())) {
+                        _cph_printer_add_group_start (task, group, group->app->drivers);
+                        continue;
+                }
 
-        gboolean status = FALSE;
-        if (cupsLastError() != IPP_STATUS_OK) {
-                status = false;
+                op->pending++;
+                _cph_printer_app_check_drivers (cups, group->app,
+                                                _cph_cups_deadline_new (APP_OPERATION_TIMEOUT),
+                                                op->cancellable,
+                                                _cph_printer_add_group_checked,
+                                                group);
         }
-        ippDelete(response);
-        httpClose(http);
-
-        return status;
 
-        // ipp_t *request;
-
-        // g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
-
-        // if (!_cph_cups_is_printer_name_valid (cups, printer_name))
-        //         return FALSE;
-        // if (!_cph_cups_is_printer_uri_valid (cups, printer_uri))
-        //         return FALSE;
-        // if (!_cph_cups_is_ppd_valid (cups, ppd_file))
-        //         return FALSE;
-        // if (!_cph_cups_is_info_valid (cups, info))
-        //         return FALSE;
-        // if (!_cph_cups_is_location_valid (cups, location))
-        //         return FALSE;
-
-        // request = ippNewRequest (CUPS_ADD_MODIFY_PRINTER);
-        // _cph_cups_add_printer_uri (request, printer_name);
-        // _cph_cups_add_requesting_user_name (request, NULL);
-
-        // ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_NAME,
-        //               "printer-name", NULL, printer_name);
-
-        // if (ppd_file && ppd_file[0] != '\0') {
-        //         ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_NAME,
-        //                       "ppd-name", NULL, ppd_file);
-        // }
-        // if (printer_uri && printer_uri[0] != '\0') {
-        //         ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_URI,
-        //                       "device-uri", NULL, printer_uri);
-        // }
-        // if (info && info[0] != '\0') {
-        //         ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_TEXT,
-        //                       "printer-info", NULL, info);
-        // }
-        // if (location && location[0] != '\0') {
-        //         ippAddString (request, IPP_TAG_PRINTER, IPP_TAG_TEXT,
-        //                       "printer-location", NULL, location);
-        // }
-
-        // return _cph_cups_send_request (cups, request, CPH_RESOURCE_ADMIN);
+        /* the jobs own the task until the last of them is done */
+        if (op->pending == 0)
+                _cph_printer_add_complete (task);
 }
 
+/* results gets an array of (name, error), with an empty error for the
+ * queues which were created; FALSE is returned if any of them failed. */
 gboolean
-cph_cups_printer_app_printer_add(const char *printer_name,
-                      const char *device_uri,
-                      const char *device_info,
-                      const char *device_id,
-                      const char *hostname,
-                      int *port)
+cph_cups_printers_add_many_finish (CphCups       *cups,
+                                   GAsyncResult  *result,
+                                   GVariant     **results)
 {
-        ipp_t		        *request,		
-		                *response;		
-        ipp_attribute_t         *attr;		
-        http_t	                *http;			
-        int                     timeout_param = CUPS_TIMEOUT_DEFAULT;
-
-        http = httpConnect2("localhost", 8001, NULL, AF_UNSPEC,
-                           HTTP_ENCRYPTION_IF_REQUESTED, 1, 30000, NULL);
-
-        request = ippNewRequest(IPP_OP_CREATE_PRINTER);
-        // ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, "ipp://localhost/ipp/system");
-        // ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "printer-service-type", NULL, "print");
-        // ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "smi55357-driver", NULL, "HP 915");
-        // ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "smi55357-device-uri", NULL, "ipps://Kaushikhp._ipps._tcp.local/");
-        // ippAddString(request, IPP_TAG_PRINTER, IPP_TAG_NAME, "printer-name", NULL, "Kaushikhp2");
-
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "system-uri", NULL, "ipp://localhost/ipp/system");
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "printer-service-type", NULL, "print");
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_KEYWORD, "smi55357-driver", NULL, "auto");
-        // ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "smi55357-device-uri", NULL, device_uri);
-        // ippAddString(request, IPP_TAG_PRINTER, IPP_TAG_NAME, "printer-name", NULL, device_info);
-        // ippAddString(request, IPP_TAG_PRINTER, IPP_TAG_TEXT, "printer-device-id", NULL, device_id);
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "smi55357-device-uri", NULL, "usb://Canon/MF240%20Series%20UFRII%20LT?serial=0175B636DB5C&interface=1");
-        ippAddString(request, IPP_TAG_PRINTER, IPP_TAG_NAME, "printer-name", NULL, "Canon MF240 Series UFRII LT");
-        ippAddString(request, IPP_TAG_PRINTER, IPP_TAG_TEXT, "printer-device-id", NULL, "MFG:Canon;MDL:MF240 Series UFRII LT;CMD:LIPSLX,CPCA;CLS:PRINTER;DES:Canon MF240 Series UFRII LT;CID:CA UFRII BW OIP;IPP-HTTP:T;IPP-E:07-01-04; PESP:V1;");
-        ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_NAME, "requesting-user-name", NULL, cupsUser());
-        response = cupsDoRequest(http, request, "/ipp/system");
+        CphPrinterAddOp *op;
+        GError          *error = NULL;
+
+        g_return_val_if_fail (CPH_IS_CUPS (cups), FALSE);
+        g_return_val_if_fail (g_task_is_valid (result, cups), FALSE);
+        g_return_val_if_fail (results != NULL, FALSE);
 
-        gboolean status = true;
-        if (cupsLastError() != IPP_STATUS_OK) {
-                status = false;
+        op = g_task_get_task_data (G_TASK (result));
+        *results = g_task_propagate_pointer (G_TASK (result), &error);
+
+        if (*results == NULL) {
+                _cph_cups_set_internal_status (cups, error->message);
+                g_error_free (error);
+                return FALSE;
         }
-        ippDelete(response);
-        httpClose(http);
 
-        return status;
+        if (op->n_failed > 0) {
+                _cph_cups_set_internal_status (cups,
+                                               "Some printers could not be added.");
+                return FALSE;
+        }
+
+        _cph_cups_set_internal_status (cups, NULL);
+        cups->priv->last_status = IPP_OK;
+
+        return TRUE;
 }
 
 gboolean
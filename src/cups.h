@@ -25,6 +25,7 @@
 #define CPH_CUPS_H
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -71,6 +72,9 @@ char *cph_cups_printer_get_uri (CphCups    *cups,
 gboolean cph_cups_is_printer_local (CphCups    *cups,
                                     const char *printer_name);
 
+gboolean cph_cups_printers_are_local (CphCups           *cups,
+                                      const char *const *printer_names);
+
 gboolean cph_cups_file_get (CphCups      *cups,
                             const char   *resource,
                             const char   *filename,
@@ -87,16 +91,78 @@ gboolean cph_cups_server_get_settings (CphCups   *cups,
 gboolean cph_cups_server_set_settings (CphCups  *cups,
                                        GVariant *settings);
 
-gboolean cph_cups_devices_get (CphCups            *cups,
-                               int                 timeout,
-                               int                 limit,
-                               const char *const  *include_schemes,
-                               const char *const  *exclude_schemes,
-                               GVariant          **devices);
-
-gboolean cph_cups_printer_app_get (CphCups            *cups,
-                                   int                 timeout,
-                                   GVariant          **apps);
+void     cph_cups_devices_get_async  (CphCups             *cups,
+                                      int                  timeout,
+                                      int                  limit,
+                                      const char *const   *include_schemes,
+                                      const char *const   *exclude_schemes,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data);
+
+gboolean cph_cups_devices_get_finish (CphCups       *cups,
+                                      GAsyncResult  *result,
+                                      GVariant     **devices);
+
+void     cph_cups_printer_app_get_async  (CphCups             *cups,
+                                          int                  timeout,
+                                          GCancellable        *cancellable,
+                                          GAsyncReadyCallback  callback,
+                                          gpointer             user_data);
+
+gboolean cph_cups_printer_app_get_finish (CphCups       *cups,
+                                          GAsyncResult  *result,
+                                          GVariant     **apps);
+
+void     cph_cups_printer_apps_describe_async  (CphCups             *cups,
+                                                int                  timeout,
+                                                GCancellable        *cancellable,
+                                                GAsyncReadyCallback  callback,
+                                                gpointer             user_data);
+
+gboolean cph_cups_printer_apps_describe_finish (CphCups       *cups,
+                                                GAsyncResult  *result,
+                                                GVariant     **apps);
+
+void     cph_cups_services_browse_async  (CphCups             *cups,
+                                          int                  timeout,
+                                          const char *const   *service_types,
+                                          GCancellable        *cancellable,
+                                          GAsyncReadyCallback  callback,
+                                          gpointer             user_data);
+
+gboolean cph_cups_services_browse_finish (CphCups       *cups,
+                                          GAsyncResult  *result,
+                                          GVariant     **services);
+
+void     cph_cups_service_resolve_async  (CphCups             *cups,
+                                          int                  interface,
+                                          int                  protocol,
+                                          const char          *name,
+                                          const char          *type,
+                                          const char          *domain,
+                                          int                  timeout,
+                                          GCancellable        *cancellable,
+                                          GAsyncReadyCallback  callback,
+                                          gpointer             user_data);
+
+gboolean cph_cups_service_resolve_finish (CphCups       *cups,
+                                          GAsyncResult  *result,
+                                          GVariant     **service);
+
+void     cph_cups_start_resident_discovery (CphCups *cups,
+                                            int      refresh_interval);
+
+void     cph_cups_drivers_get_async  (CphCups             *cups,
+                                      const char          *device_id,
+                                      int                  limit,
+                                      GCancellable        *cancellable,
+                                      GAsyncReadyCallback  callback,
+                                      gpointer             user_data);
+
+gboolean cph_cups_drivers_get_finish (CphCups       *cups,
+                                      GAsyncResult  *result,
+                                      GVariant     **drivers);
                                    
 gboolean cph_cups_printer_add (CphCups    *cups,
                                const char *printer_name,
@@ -105,6 +171,16 @@ gboolean cph_cups_printer_add (CphCups    *cups,
                                const char *info,
                                const char *location);
 
+void     cph_cups_printers_add_many_async  (CphCups             *cups,
+                                            GVariant            *printers,
+                                            GCancellable        *cancellable,
+                                            GAsyncReadyCallback  callback,
+                                            gpointer             user_data);
+
+gboolean cph_cups_printers_add_many_finish (CphCups       *cups,
+                                            GAsyncResult  *result,
+                                            GVariant     **results);
+
 gboolean cph_cups_printer_add_with_ppd_file (CphCups    *cups,
                                              const char *printer_name,
                                              const char *printer_uri,
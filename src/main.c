@@ -52,19 +52,39 @@
 /* Time after which we exit if there's no activity (in seconds) */
 #define INACTIVITY_EXIT 30
 
+/* Default time between two scans of the CUPS backends in resident mode (in
+ * seconds) */
+#define RESIDENT_REFRESH_INTERVAL 60
+
 typedef struct
 {
         CphMechanism *mechanism;
         GMainLoop    *loop;
         unsigned int  timeout_id;
         gboolean      name_acquired;
+        gboolean      resident;
 } cph_main;
 
+static gboolean resident = FALSE;
+static int      refresh_interval = RESIDENT_REFRESH_INTERVAL;
+
+static GOptionEntry entries[] = {
+        { "resident", 'r', 0, G_OPTION_ARG_NONE, &resident,
+          "Do not exit when idle, and keep the list of devices up-to-date", NULL },
+        { "refresh-interval", 0, 0, G_OPTION_ARG_INT, &refresh_interval,
+          "Time between two scans of the CUPS backends in resident mode (default: 60)", "SECONDS" },
+        { NULL }
+};
+
 static gboolean
 quit_loop (gpointer user_data)
 {
         cph_main *data = (cph_main *) user_data;
 
+        /* do not leave a caller without an answer */
+        if (cph_mechanism_is_busy (data->mechanism))
+                return TRUE;
+
         g_main_loop_quit (data->loop);
 
         data->timeout_id = 0;
@@ -88,7 +108,8 @@ mechanism_got_called (CphMechanism *mechanism,
 {
         cph_main *data = (cph_main *) user_data;
 
-        reset_timeout (data);
+        if (!data->resident)
+                reset_timeout (data);
 }
 
 static void
@@ -142,11 +163,32 @@ on_name_lost (GDBusConnection *connection,
 int
 main (int argc, char **argv)
 {
-        cph_main data;
-        guint    owner_id;
+        cph_main        data;
+        guint           owner_id;
+        GOptionContext *context;
+        GError         *error = NULL;
 
         memset (&data, 0, sizeof (data));
 
+        context = g_option_context_new (NULL);
+        g_option_context_add_main_entries (context, entries, NULL);
+
+        if (!g_option_context_parse (context, &argc, &argv, &error)) {
+                g_printerr ("%s\n", error->message);
+                g_error_free (error);
+                g_option_context_free (context);
+                return 1;
+        }
+
+        g_option_context_free (context);
+
+        if (refresh_interval <= 0) {
+                g_printerr ("The refresh interval must be positive\n");
+                return 1;
+        }
+
+        data.resident = resident;
+
         data.mechanism = cph_mechanism_new ();
 
         if (data.mechanism == NULL) {
@@ -156,7 +198,11 @@ main (int argc, char **argv)
 
         data.loop = g_main_loop_new (NULL, FALSE);
 
-        reset_timeout (&data);
+        if (data.resident)
+                cph_mechanism_start_resident_discovery (data.mechanism,
+                                                        refresh_interval);
+        else
+                reset_timeout (&data);
 
         g_signal_connect (data.mechanism, "called",
                           G_CALLBACK (mechanism_got_called), &data);
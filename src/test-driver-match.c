@@ -0,0 +1,199 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*-
+ * vim: set et ts=8 sw=8:
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+/* Driver matching: tokenizing IEEE-1284 device IDs, deriving them from
+ * DNS-SD TXT records, and ranking drivers. The matcher is private to
+ * cups.c, so it is included here; it does not need cupsd. */
+
+#include "cups.c"
+
+static void
+test_tokens_mfg_alias (void)
+{
+        CphDeviceIdTokens tokens;
+        GHashTable       *keys;
+
+        _cph_device_id_tokens_init (&tokens,
+                                    "MFG:Hewlett-Packard;MDL:HP LaserJet 1020;CMD:ZJS, PJL;",
+                                    NULL);
+
+        g_assert_cmpstr (tokens.mfg, ==, "hp");
+        g_assert_cmpstr (tokens.mdl, ==, "laserjet 1020");
+        g_assert (tokens.cmd != NULL);
+        g_assert_cmpstr (tokens.cmd[0], ==, "zjs");
+        g_assert_cmpstr (tokens.cmd[1], ==, "pjl");
+        g_assert (tokens.cid == NULL);
+
+        keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        _cph_device_id_tokens_get_keys (&tokens, keys);
+
+        g_assert (g_hash_table_contains (keys, "model:hp;laserjet 1020"));
+        g_assert (g_hash_table_contains (keys, "word:hp;laserjet"));
+        g_assert (g_hash_table_contains (keys, "word:hp;1020"));
+        g_assert_cmpuint (g_hash_table_size (keys), ==, 3);
+
+        g_hash_table_destroy (keys);
+        _cph_device_id_tokens_clear (&tokens);
+
+        /* a PPD only has its make and model, followed by the driver */
+        _cph_device_id_tokens_init (&tokens, NULL,
+                                    "HP LaserJet 1020, hpcups 3.22.10");
+
+        g_assert_cmpstr (tokens.mfg, ==, "hp");
+        g_assert_cmpstr (tokens.mdl, ==, "laserjet 1020");
+
+        _cph_device_id_tokens_clear (&tokens);
+}
+
+static void
+test_best_model (void)
+{
+        CphDriverIndex *index;
+
+        index = _cph_driver_index_new ();
+        _cph_driver_index_add (index, "hp-laserjet_1022", NULL,
+                               "MFG:HP;MDL:LaserJet 1022;CMD:ZJS,PJL;");
+        _cph_driver_index_add (index, "hp-laserjet_1020",
+                               "HP LaserJet 1020, hpcups 3.22.10", NULL);
+        _cph_driver_index_add (index, "brother-hl_1020", NULL,
+                               "MFG:Brother;MDL:HL-1020;");
+
+        g_assert_cmpstr (_cph_driver_index_best (index,
+                                                 "MFG:Hewlett-Packard;MDL:HP LaserJet 1020;CMD:ZJS,PJL;"),
+                         ==, "hp-laserjet_1020");
+
+        _cph_driver_index_free (index);
+}
+
+static void
+test_best_cid (void)
+{
+        CphDriverIndex *index;
+        CphDeviceIdTokens tokens;
+        GArray         *matches;
+
+        index = _cph_driver_index_new ();
+        _cph_driver_index_add (index, "brother-laser_type1", NULL,
+                               "MFG:Brother;MDL:HL-L2300D series;CMD:PJL,PCL,PCLXL;CID:Brother Laser Type1;");
+        _cph_driver_index_add (index, "brother-inkjet", NULL,
+                               "MFG:Brother;MDL:MFC-J480DW;CMD:PJL,URF;CID:Brother Generic Jpeg Type2;");
+
+        g_assert_cmpstr (_cph_driver_index_best (index,
+                                                 "MFG:Brother;MDL:HL-L2350DW series;CMD:PJL,PCL,PCLXL,URF;CID:Brother Laser Type1;"),
+                         ==, "brother-laser_type1");
+
+        /* only the compatible ID is shared */
+        _cph_device_id_tokens_init (&tokens,
+                                    "MFG:Brother;MDL:HL-L2350DW series;CID:Brother Laser Type1;",
+                                    NULL);
+        matches = g_array_new (FALSE, FALSE, sizeof (CphDriverMatch));
+        _cph_driver_index_match (index, &tokens, NULL, matches);
+
+        g_assert_cmpuint (matches->len, ==, 1);
+        g_assert_cmpint (g_array_index (matches, CphDriverMatch, 0).score, ==, DRIVER_SCORE_CID);
+        g_assert (g_array_index (matches, CphDriverMatch, 0).exact);
+
+        g_array_free (matches, TRUE);
+        _cph_device_id_tokens_clear (&tokens);
+        _cph_driver_index_free (index);
+}
+
+static void
+test_best_words_only (void)
+{
+        CphDriverIndex    *index;
+        CphDeviceIdTokens  tokens;
+        GArray            *matches;
+        const char        *device_id = "MFG:Xerox;MDL:Phaser 3320 3330 3610 6510 6515;CMD:PCL5,PCL6,PS,PDF,URF,PWG;";
+
+        index = _cph_driver_index_new ();
+        _cph_driver_index_add (index, "xerox-phaser_ps", NULL,
+                               "MFG:Xerox;MDL:Phaser 3320 3330 3610 6510 6515 PS;CMD:PCL5,PCL6,PS,PDF,URF,PWG;");
+        _cph_driver_index_add (index, "epson-et_2750", NULL,
+                               "MFG:Epson;MDL:ET-2750 Series;CMD:ESCPL2,BDC;");
+
+        /* the shared words and command sets add up to the score of a
+         * compatible ID, without either key matching */
+        _cph_device_id_tokens_init (&tokens, device_id, NULL);
+        matches = g_array_new (FALSE, FALSE, sizeof (CphDriverMatch));
+        _cph_driver_index_match (index, &tokens, NULL, matches);
+
+        g_assert_cmpuint (matches->len, ==, 1);
+        g_assert_cmpint (g_array_index (matches, CphDriverMatch, 0).score, >=, DRIVER_SCORE_CID);
+        g_assert (!g_array_index (matches, CphDriverMatch, 0).exact);
+
+        g_assert_cmpstr (_cph_driver_index_best (index, device_id), ==, "auto");
+
+        /* nor does another make */
+        g_assert_cmpstr (_cph_driver_index_best (index, "MFG:Canon;MDL:ET-2750;"),
+                         ==, "auto");
+
+        g_array_free (matches, TRUE);
+        _cph_device_id_tokens_clear (&tokens);
+        _cph_driver_index_free (index);
+}
+
+static void
+test_dnssd_device_id (void)
+{
+        AvahiData       printer;
+        CphDriverIndex *index;
+        char           *device_id;
+
+        /* a driverless printer without usb_* keys */
+        memset (&printer, 0, sizeof (printer));
+        printer.make_and_model = "HP LaserJet 1020";
+        printer.product = "(HP LaserJet 1020)";
+        printer.pdl = "application/octet-stream,application/vnd.hp-pclxl,image/urf";
+
+        device_id = _cph_cups_dnssd_device_id (&printer);
+        g_assert_cmpstr (device_id, ==, "MFG:HP;MDL:HP LaserJet 1020;CMD:PCLXL,URF;");
+
+        index = _cph_driver_index_new ();
+        _cph_driver_index_add (index, "hp-laserjet_1020",
+                               "HP LaserJet 1020, hpcups 3.22.10", NULL);
+        g_assert_cmpstr (_cph_driver_index_best (index, device_id), ==,
+                         "hp-laserjet_1020");
+
+        _cph_driver_index_free (index);
+        g_free (device_id);
+
+        /* the usb_* keys win */
+        printer.usb_mfg = "Hewlett-Packard";
+        printer.usb_mdl = "HP LaserJet 1020";
+        printer.usb_cmd = "ZJS,PJL";
+
+        device_id = _cph_cups_dnssd_device_id (&printer);
+        g_assert_cmpstr (device_id, ==, "MFG:Hewlett-Packard;MDL:HP LaserJet 1020;CMD:ZJS,PJL;");
+        g_free (device_id);
+}
+
+int
+main (int argc, char **argv)
+{
+        g_test_init (&argc, &argv, NULL);
+
+        g_test_add_func ("/driver-match/tokens/mfg-alias", test_tokens_mfg_alias);
+        g_test_add_func ("/driver-match/best/model", test_best_model);
+        g_test_add_func ("/driver-match/best/cid", test_best_cid);
+        g_test_add_func ("/driver-match/best/words-only", test_best_words_only);
+        g_test_add_func ("/driver-match/dnssd-device-id", test_dnssd_device_id);
+
+        return g_test_run ();
+}